@@ -0,0 +1,26 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Count the heap allocations made by the program, to check that simulation runs don't allocate, by replacing the
+// global allocation functions. Include it in a single translation unit of the program. All the plain, array and
+// sized forms are replaced so that memory is always released by the function matching the one which allocated it.
+
+//! Number of heap allocations performed so far.
+static std::atomic<size_t> g_allocations{0};
+
+void* operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size)) return ptr;
+    throw std::bad_alloc{};
+}
+
+void* operator new[](size_t size) { return ::operator new(size); }
+
+// Not inlined, or the compiler would see memory from operator new released by free() and warn of a mismatch.
+[[gnu::noinline]] void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { ::operator delete(ptr); }
+void operator delete(void* ptr, size_t) noexcept { ::operator delete(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { ::operator delete(ptr); }
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "allocations.h"
+#include "config.h"
+
+// Microbenchmarks of the simulation engine, on a fixed set of networks with fixed seeds so that every build
+// simulates the exact same blocks. Results are printed as JSON, see --help.
+
+//! How long to run each simulation for.
+static constexpr std::chrono::months BENCH_DURATION{12};
+
+//! How many simulations to run per scenario and thread count.
+static constexpr int BENCH_RUNS{256};
+
+//! Seed from which the randomness of every run is derived.
+static constexpr uint64_t BENCH_SEED{1};
+
+/** A network to benchmark the engine on. */
+struct BenchScenario {
+    std::string_view name;
+    std::vector<Miner> miners;
+    std::vector<LinkLatency> latencies;
+};
+
+/** The networks to benchmark, each exercising a different path of the engine. */
+std::vector<BenchScenario> MakeBenchScenarios()
+{
+    // The default network of the simulation, see SetupMiners() in main.cpp.
+    const auto default_miners{[](std::chrono::milliseconds propagation) {
+        std::vector<Miner> miners;
+        for (const double perc: {30, 29, 12, 11, 8, 5, 3, 1, 1}) {
+            miners.emplace_back(miners.size(), perc, propagation);
+        }
+        return miners;
+    }};
+
+    std::vector<BenchScenario> scenarios;
+    scenarios.push_back({"honest-9", default_miners(1s), {}});
+
+    auto selfish{default_miners(1s)};
+    selfish[0] = Miner{0, 40, 1s, true};
+    selfish[1].perc = 19;
+    scenarios.push_back({"selfish-40", std::move(selfish), {}});
+
+    std::vector<Miner> small_miners;
+    for (unsigned i{0}; i < 1'000; ++i) small_miners.emplace_back(i, 0.1, 1s);
+    scenarios.push_back({"small-miners-1000", std::move(small_miners), {}});
+
+    // A decentralized network of unequal miners, some of them slow to propagate their blocks. The work per block
+    // must not grow with the number of miners.
+    std::vector<Miner> population;
+    AddPopulation(population, PopulationSpec{.count = 10'000, .perc = 100, .pareto_alpha = 1.5, .propagation = 1s, .propagation_sigma = 0.5});
+    scenarios.push_back({"population-10000", std::move(population), {}});
+
+    // Slow propagation makes for many forks, and the two largest pools being well connected to each other
+    // exercises the per-pair latencies.
+    scenarios.push_back({"long-propagation", default_miners(10s), {{0, 1, 100ms}, {1, 0, 100ms}}});
+
+    return scenarios;
+}
+
+/** The result of simulating a scenario on a number of threads. */
+struct BenchTiming {
+    unsigned threads;
+    double seconds;
+    //! Blocks found over all the runs, including the stale ones.
+    uint64_t blocks;
+    //! Heap allocations performed by the runs, not counting the setup of the simulation contexts.
+    size_t allocations;
+};
+
+/** Simulate the given number of runs of the scenario, spread over the given number of threads. Each thread
+ * picks the next run to do until there is none left, as in RunScenarios(). */
+BenchTiming RunBench(const BenchScenario& scenario, int runs, unsigned threads)
+{
+    // Set up the contexts beforehand, so only the simulations themselves are timed.
+    std::vector<std::optional<SimulationContext>> contexts(threads);
+    for (auto& ctx: contexts) ctx.emplace(scenario.miners, BENCH_DURATION, scenario.latencies);
+    std::vector<std::vector<MinerStats>> stats(threads, std::vector<MinerStats>(scenario.miners.size()));
+    std::vector<uint64_t> blocks(threads, 0);
+    std::atomic<int> next_run{0};
+    const auto work{[&](unsigned t) {
+        for (int run; (run = next_run.fetch_add(1, std::memory_order_relaxed)) < runs; ) {
+            RunSimulation(*contexts[t], DeriveSeed(BENCH_SEED, run), stats[t]);
+            // The tree starts with the genesis block.
+            blocks[t] += contexts[t]->tree.size() - 1;
+        }
+    }};
+
+    // On a single thread simulate on the calling one, so that no allocation is made but by the runs.
+    const auto allocations_before{g_allocations.load()};
+    const auto start{std::chrono::steady_clock::now()};
+    if (threads == 1) {
+        work(0);
+    } else {
+        std::vector<std::thread> workers;
+        workers.reserve(threads);
+        for (unsigned t{0}; t < threads; ++t) workers.emplace_back(work, t);
+        for (auto& worker: workers) worker.join();
+    }
+    const std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() - start};
+    const auto allocations{g_allocations.load() - allocations_before};
+
+    uint64_t total_blocks{0};
+    for (const auto count: blocks) total_blocks += count;
+    return {threads, elapsed.count(), total_blocks, allocations};
+}
+
+/** The thread counts to measure scaling at: powers of two up to the maximum, and the maximum itself. */
+std::vector<unsigned> ThreadCounts(unsigned max_threads)
+{
+    std::vector<unsigned> counts;
+    for (unsigned count{1}; count < max_threads; count *= 2) counts.push_back(count);
+    counts.push_back(max_threads);
+    return counts;
+}
+
+int main(int argc, char* argv[])
+{
+    int runs{BENCH_RUNS};
+    unsigned max_threads{std::max(1u, std::thread::hardware_concurrency())};
+    std::optional<std::string_view> only;
+    for (int i{1}; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: " << argv[0] << " [--runs <count>] [--threads <max>] [--scenario <name>]\n"
+                      << "Simulate fixed networks with fixed seeds and print, for each of them as JSON, the time per\n"
+                      << "block simulated on a single thread, the heap allocations per run, and the scaling efficiency\n"
+                      << "from 1 thread up to --threads (" << max_threads << " by default).\n"
+                      << "Scenarios:";
+            for (const auto& scenario: MakeBenchScenarios()) std::cout << ' ' << scenario.name;
+            std::cout << std::endl;
+            return 0;
+        }
+        if (i + 1 == argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        const std::string_view value{argv[++i]};
+        if (arg == "--runs") {
+            const auto count{ParseNumber<int>(value)};
+            if (!count || *count <= 0) {
+                std::cerr << "Invalid number of runs: " << value << std::endl;
+                return 1;
+            }
+            runs = *count;
+        } else if (arg == "--threads") {
+            const auto count{ParseNumber<unsigned>(value)};
+            if (!count || *count == 0) {
+                std::cerr << "Invalid number of threads: " << value << std::endl;
+                return 1;
+            }
+            max_threads = *count;
+        } else if (arg == "--scenario") {
+            only = value;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    auto scenarios{MakeBenchScenarios()};
+    if (only) {
+        std::erase_if(scenarios, [&](const auto& scenario) { return scenario.name != *only; });
+        if (scenarios.empty()) {
+            std::cerr << "Unknown scenario: " << *only << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "{\n  \"runs\": " << runs << ",\n  \"duration_ms\": "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(BENCH_DURATION).count()
+              << ",\n  \"seed\": " << BENCH_SEED << ",\n  \"scenarios\": [";
+    for (size_t i{0}; i < scenarios.size(); ++i) {
+        const auto& scenario{scenarios[i]};
+        std::cerr << "Benchmarking " << scenario.name << ".." << std::endl;
+        std::vector<BenchTiming> timings;
+        for (const auto threads: ThreadCounts(max_threads)) timings.push_back(RunBench(scenario, runs, threads));
+        const auto& single{timings[0]};
+        // Every thread count simulates the same runs with the same seeds.
+        assert(std::ranges::all_of(timings, [&](const auto& timing) { return timing.blocks == single.blocks; }));
+
+        std::cout << (i > 0 ? "," : "") << "\n    {\n"
+                  << "      \"name\": \"" << scenario.name << "\",\n"
+                  << "      \"miners\": " << scenario.miners.size() << ",\n"
+                  << "      \"blocks_per_run\": " << static_cast<double>(single.blocks) / runs << ",\n"
+                  << "      \"ns_per_block\": " << single.seconds * 1e9 / single.blocks << ",\n"
+                  << "      \"blocks_per_second_per_core\": " << single.blocks / single.seconds << ",\n"
+                  << "      \"allocations_per_run\": " << static_cast<double>(single.allocations) / runs << ",\n"
+                  << "      \"scaling\": [";
+        for (size_t j{0}; j < timings.size(); ++j) {
+            const auto& timing{timings[j]};
+            // How close we get to a linear speedup over the single thread.
+            const double efficiency{single.seconds / (timing.seconds * timing.threads)};
+            std::cout << (j > 0 ? "," : "") << "\n        {\"threads\": " << timing.threads
+                      << ", \"seconds\": " << timing.seconds << ", \"efficiency\": " << efficiency << "}";
+        }
+        std::cout << "\n      ]\n    }";
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
@@ -0,0 +1,674 @@
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <numbers>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "simulation.h"
+
+//! The shallowest finality depth allowed. Strategic miners may keep mining on a branch up to 255 blocks behind the
+//! best chain (see SelfishParams), which must not fork off below the final block.
+static constexpr uint32_t MIN_FINALITY_DEPTH{256};
+
+/** Which slice of the runs of every scenario to simulate, so that a sweep can be spread over several machines. */
+struct ShardSpec {
+    //! Position of this slice, from 0.
+    unsigned index;
+    //! How many slices the runs are split into.
+    unsigned count;
+
+    bool operator==(const ShardSpec&) const = default;
+};
+
+/** The parameters of a simulation sweep, as set on the command line or in a configuration file. */
+struct Config {
+    //! How long to run each simulation for.
+    std::chrono::milliseconds duration{0};
+    //! How many simulations to run. An upper bound if stale_rate_precision is set.
+    int runs{0};
+    //! Seed from which the randomness of every run is derived. A random one is used if unset.
+    std::optional<uint64_t> seed{};
+    //! How many threads to run the simulations on. Use one per core if 0.
+    unsigned threads{0};
+    //! Simulate the runs on the GPU rather than on threads (see gpu.h). Only for networks of honest miners whose
+    //! blocks reach everyone at once.
+    bool gpu{false};
+    //! Stop once the 95% confidence interval around every miner's stale rate is narrower than this, if set.
+    std::optional<double> stale_rate_precision{};
+    //! Stop once every miner's stale rate agrees with the analytic model within this, if set. See AgreesWithModel().
+    std::optional<double> model_tolerance{};
+    //! Only print the stale rates of the analytic model, without simulating. See ModelStaleRates().
+    bool analytic{false};
+    //! The miners on the network, with their share of the network hashrate, propagation time and strategy.
+    std::vector<Miner> miners{};
+    //! Latencies between pairs of miners which differ from the sender's propagation time.
+    std::vector<LinkLatency> latencies{};
+    //! Changes to the share of the hashrate and strategy of miners during each run.
+    std::vector<HashrateChange> hashrate_changes{};
+    //! Adjust the difficulty every this many blocks, if set. It is constant otherwise.
+    std::optional<uint32_t> retarget_period{};
+    //! Drop the blocks this deep in the best chain during each run, if set, to simulate very long durations.
+    std::optional<uint32_t> finality_depth{};
+    //! Estimate how often reorgs at least this deep happen by importance sampling instead of the stats of the
+    //! miners, if set (see SimulationContext::reorg_depth).
+    std::optional<uint32_t> reorg_depth{};
+    //! File to write the stats of every miner to over the course of the simulations, as CSV, if set.
+    std::optional<std::string> time_series{};
+    //! How often to sample the stats written to the time series. Two weeks is about a difficulty period.
+    std::chrono::milliseconds sample_interval{std::chrono::weeks{2}};
+    //! Only simulate this slice of the runs and write their stats to shard_file, if set.
+    std::optional<ShardSpec> shard{};
+    //! Where to write the stats of the shard. Named after it if unset.
+    std::optional<std::string> shard_file{};
+    //! File to save the progress of the sweep to every checkpoint_interval, if set.
+    std::optional<std::string> checkpoint{};
+    std::chrono::milliseconds checkpoint_interval{std::chrono::minutes{1}};
+    //! Continue the sweep saved in this checkpoint file, if set.
+    std::optional<std::string> resume{};
+    //! File to also write the progress of the simulations to as CSV, if set.
+    std::optional<std::string> progress_log{};
+    //! File to write the events of one run in trace_every to, if set, to replay them. See TraceFile.
+    std::optional<std::string> trace{};
+    int trace_every{1'000};
+
+    // Parameters to sweep over. Every combination of them is simulated. Unused if empty.
+
+    //! Propagation times to set for every miner.
+    std::vector<std::chrono::milliseconds> sweep_propagation{};
+    //! Shares of the network hashrate (in percent) to give to the first miner. Others are scaled accordingly.
+    std::vector<double> sweep_share{};
+    //! Shares of the network hashrate (in percent) to give to an additional selfish miner. Others are scaled
+    //! accordingly.
+    std::vector<double> sweep_selfish{};
+
+    bool IsSweep() const
+    {
+        return !sweep_propagation.empty() || !sweep_share.empty() || !sweep_selfish.empty();
+    }
+};
+
+static constexpr std::string_view CONFIG_USAGE{
+    "Options (each can also be set in a configuration file, one per line without the leading dashes):\n"
+    "  --config <file>        Read options from this file. Options after it on the command line take precedence.\n"
+    "  --duration <duration>  How long to run each simulation for, e.g. 12mo, 365d or 2w.\n"
+    "  --runs <count>         How many simulations to run.\n"
+    "  --seed <seed>          Seed to derive the randomness of every run from, to reproduce a previous sweep.\n"
+    "  --threads <count>      How many threads to use. One per core by default.\n"
+    "  --backend <cpu|gpu|model>\n"
+    "                         Simulate the runs on the CPU (the default) or on the GPU, in builds which support it.\n"
+    "                         The GPU only simulates honest miners whose blocks reach everyone at once, with nothing\n"
+    "                         changing during the runs. Results are the same either way. The model doesn't simulate\n"
+    "                         anything but only prints the stale rates of the analytic model of plot_stale_rate,\n"
+    "                         which only describes honest miners with nothing changing during the runs.\n"
+    "  --precision <ratio>    Stop once every miner's stale rate 95% confidence interval is narrower than this\n"
+    "                         (e.g. 0.0001 for +/-0.01%).\n"
+    "  --model-tolerance <ratio>\n"
+    "                         Stop simulating a scenario once every miner's stale rate is within this of the analytic\n"
+    "                         model's with 95% confidence (e.g. 0.0001 for +/-0.01%), to only spend the runs where they\n"
+    "                         disagree.\n"
+    "  --miner <share>,<propagation>[,selfish[:<option>...]]\n"
+    "                         Add a miner with this share of the hashrate (in percent) and block propagation time\n"
+    "                         (e.g. 30,1s or 1,100ms,selfish). Replaces the default network when first set.\n"
+    "                         Variants of the selfish mining strategy are set with options separated by colons:\n"
+    "                           gamma=<ratio>  Share of the honest hashrate mining on our block during a race.\n"
+    "                           lead           Only reveal enough blocks to match the best chain, never all.\n"
+    "                           equal-fork     Keep a block found during a race private.\n"
+    "                           trail=<count>  Keep mining on our branch up to this many blocks behind.\n"
+    "                         For instance 40,1s,selfish:gamma=0.5:lead:trail=1.\n"
+    "  --population <count>,<share>,<hashrates>,<propagation>[,<seed>]\n"
+    "                         Add this many honest miners holding this share of the hashrate (in percent) in total,\n"
+    "                         their hashrates either equal or drawn from a Pareto distribution (pareto:<alpha>, alpha\n"
+    "                         at least 0.1 and the lower the more unequal) and their propagation times either all the\n"
+    "                         same or drawn from a lognormal distribution (lognormal:<median>:<sigma>). The same seed\n"
+    "                         (0 by default) always gives the same miners, e.g. 10000,20,pareto:1.5,lognormal:1s:0.5.\n"
+    "                         Replaces the default network when first set, as --miner. Networks of more than 32 miners\n"
+    "                         are reported by classes of hashrate and propagation time rather than miner by miner.\n"
+    "  --latency <sender>,<receiver>,<duration>\n"
+    "                         Time for the blocks of a miner to reach another, numbered in the order they were added.\n"
+    "  --change <time>,<miner>,<share>[,selfish[:<option>...]]\n"
+    "                         Set the share of the hashrate and strategy of a miner at this time of every run, as with\n"
+    "                         --miner. For instance a miner with a share of 0 joins the network (e.g. 3mo,2,10).\n"
+    "  --retarget <blocks>    Adjust the difficulty to the network hashrate every this many blocks (e.g. 2016).\n"
+    "  --finality <blocks>    Consider blocks this deep in the best chain final and drop them from memory, for very\n"
+    "                         long runs (at least 256, e.g. 1000). No reorg may ever be as deep.\n"
+    "  --reorg-depth <blocks> Estimate how often reorgs at least this deep happen instead of the stats of the miners,\n"
+    "                         making forks last longer and weighting them by how likely they actually are (see the\n"
+    "                         README). Only networks of honest miners benefit from it.\n"
+    "  --time-series <file>   Also write the stats of every miner at regular times during the runs to this file.\n"
+    "  --sample-interval <duration>\n"
+    "                         How often to sample the stats written to the time series. 2w by default.\n"
+    "  --shard <index>/<count>\n"
+    "                         Only simulate the index-th of count slices of the runs (from 0, e.g. 2/8) and write\n"
+    "                         their stats to a file, to be merged with the others' (see merge --help). Needs --seed.\n"
+    "  --shard-file <file>    Where to write the stats of the shard. shard-<index>-of-<count>.bin by default.\n"
+    "  --checkpoint <file>    Save the progress of the simulations to this file regularly, to resume them if interrupted.\n"
+    "  --checkpoint-interval <duration>\n"
+    "                         How often to save the progress to the checkpoint file. 1min by default.\n"
+    "  --resume <file>        Continue the simulations saved in this checkpoint file, with the same options. Keep saving\n"
+    "                         the progress to it unless --checkpoint is set.\n"
+    "  --trace <file>         Record what happens during some of the runs (blocks found, published and received, and\n"
+    "                         reorgs) to this file, to replay them (see replay --help).\n"
+    "  --trace-every <count>  Which runs to record to the trace file: one in this many. 1000 by default.\n"
+    "  --progress-log <file>  Also write the progress of the simulations to this file (or pipe) as CSV, a line\n"
+    "                         several times a second with the runs done, runs and blocks simulated per second and\n"
+    "                         time left.\n"
+    "\n"
+    "Sweep over every combination of the following parameters, and print the results as CSV. Each takes a list of\n"
+    "values and <start>:<stop>:<step> ranges separated by commas, for instance 100ms,1s:10s:1s.\n"
+    "  --sweep-propagation <durations>\n"
+    "                         Block propagation time of every miner.\n"
+    "  --sweep-share <shares> Share of the hashrate (in percent) of the first miner. Others are scaled accordingly.\n"
+    "  --sweep-selfish <shares>\n"
+    "                         Share of the hashrate (in percent) of an additional selfish miner. Others are scaled\n"
+    "                         accordingly.\n"};
+
+/** Split a string at each occurrence of the separator. */
+std::vector<std::string_view> SplitString(std::string_view str, char separator)
+{
+    std::vector<std::string_view> parts;
+    for (size_t start{0}, end; start <= str.size(); start = end + 1) {
+        end = std::min(str.find(separator, start), str.size());
+        parts.push_back(str.substr(start, end - start));
+    }
+    return parts;
+}
+
+/** Parse a number, which must span the whole string. Floating point ones must be finite, as "nan" would pass any
+ * range check. */
+template<typename T>
+std::optional<T> ParseNumber(std::string_view str)
+{
+    T value;
+    const auto [end, err]{std::from_chars(str.data(), str.data() + str.size(), value)};
+    if (err != std::errc{} || end != str.data() + str.size()) return {};
+    if constexpr (std::is_floating_point_v<T>) {
+        if (!std::isfinite(value)) return {};
+    }
+    return value;
+}
+
+/** Parse a duration made of a (possibly fractional) number and a unit, for instance "1.5s" or "12mo". */
+std::optional<std::chrono::milliseconds> ParseDuration(std::string_view str)
+{
+    static constexpr std::pair<std::string_view, std::chrono::milliseconds> UNITS[]{
+        {"ms", 1ms}, {"s", 1s}, {"min", 1min}, {"h", 1h}, {"d", std::chrono::days{1}},
+        {"w", std::chrono::weeks{1}}, {"mo", std::chrono::months{1}}, {"y", std::chrono::years{1}},
+    };
+    const auto unit_start{str.find_first_not_of("0123456789.")};
+    if (unit_start == std::string_view::npos) return {};
+    const auto value{ParseNumber<double>(str.substr(0, unit_start))};
+    if (!value || *value < 0) return {};
+    for (const auto& [name, unit]: UNITS) {
+        if (str.substr(unit_start) == name) {
+            return std::chrono::milliseconds{std::llround(*value * unit.count())};
+        }
+    }
+    return {};
+}
+
+/** Parse the variant of the selfish mining strategy from a list of options separated by colons, for instance
+ * "gamma=0.5:lead:trail=2". */
+std::optional<SelfishParams> ParseSelfishParams(std::string_view str)
+{
+    SelfishParams params;
+    if (str.empty()) return params;
+    for (const auto option: SplitString(str, ':')) {
+        if (option == "lead") {
+            params.lead_stubborn = true;
+        } else if (option == "equal-fork") {
+            params.equal_fork_stubborn = true;
+        } else if (option.starts_with("gamma=")) {
+            const auto gamma{ParseNumber<float>(option.substr(6))};
+            if (!gamma || *gamma < 0 || *gamma > 1) return {};
+            params.gamma = *gamma;
+        } else if (option.starts_with("trail=")) {
+            const auto trail{ParseNumber<uint8_t>(option.substr(6))};
+            if (!trail) return {};
+            params.trail_stubbornness = *trail;
+        } else {
+            return {};
+        }
+    }
+    return params;
+}
+
+/** Parse a mining strategy, "honest" or "selfish" optionally followed by its options, for instance
+ * "selfish:gamma=0.5:lead". Returns whether it is selfish along with its options. */
+std::optional<std::pair<bool, SelfishParams>> ParseStrategy(std::string_view str)
+{
+    if (str == "honest") return std::pair{false, SelfishParams{}};
+    const auto strategy{str.substr(0, str.find(':'))};
+    if (strategy != "selfish") return {};
+    const auto params{ParseSelfishParams(str.substr(std::min(strategy.size() + 1, str.size())))};
+    if (!params) return {};
+    return std::pair{true, *params};
+}
+
+/** Parse a miner's description, its share of the hashrate and propagation time optionally followed by its
+ * strategy, for instance "30,1s", "40,1s,selfish" or "40,1s,selfish:gamma=0.5:lead". */
+std::optional<Miner> ParseMiner(unsigned id, std::string_view str)
+{
+    const auto fields{SplitString(str, ',')};
+    if (fields.size() < 2 || fields.size() > 3) return {};
+    const auto perc{ParseNumber<double>(fields[0])};
+    const auto propagation{ParseDuration(fields[1])};
+    if (!perc || *perc < 0 || !propagation) return {};
+    if (fields.size() == 2) return Miner{id, *perc, *propagation};
+
+    const auto strategy{ParseStrategy(fields[2])};
+    if (!strategy) return {};
+    return Miner{id, *perc, *propagation, strategy->first, strategy->second};
+}
+
+/** A population of honest miners described by the distributions of their hashrates and propagation times rather
+ * than one by one, to simulate networks of thousands of small miners. */
+struct PopulationSpec {
+    //! How many miners to generate.
+    unsigned count{0};
+    //! Share of the network hashrate (in percent) of the whole population.
+    double perc{0.0};
+    //! Shape of the Pareto distribution the miners' hashrates are drawn from, the lower the more unequal (at least
+    //! 0.1), if set. They all have the same otherwise.
+    std::optional<double> pareto_alpha{};
+    //! Median propagation time of the miners' blocks, and the standard deviation of its logarithm, as they are
+    //! drawn from a lognormal distribution. They all have the median if it is 0.
+    std::chrono::milliseconds propagation{0};
+    double propagation_sigma{0.0};
+    //! Seed the miners are drawn from, so the same spec always gives the same miners.
+    uint64_t seed{0};
+};
+
+/** Append the miners of a population to the network, numbered after the others. Each miner is drawn on its own,
+ * then their shares are scaled for the population to have its share of the hashrate. This does not depend on the
+ * standard library's distributions, which differ between implementations, so every machine gets the same miners. */
+void AddPopulation(std::vector<Miner>& miners, const PopulationSpec& spec)
+{
+    RNG rng{spec.seed};
+    // Uniformly distributed in [0; 1), as the complement is never 0.
+    const auto uniform{[&] { return (rng.rand64() >> 11) * 0x1.0p-53; }};
+    const size_t first{miners.size()};
+    double total{0.0};
+    for (unsigned i{0}; i < spec.count; ++i) {
+        // Inverse transform sampling, with a minimum hashrate of 1 before scaling.
+        const double hashrate{spec.pareto_alpha ? std::pow(1 - uniform(), -1 / *spec.pareto_alpha) : 1.0};
+        // Box-Muller transform, of which only the cosine is used.
+        const double normal{std::sqrt(-2 * std::log(1 - uniform())) * std::cos(2 * std::numbers::pi * uniform())};
+        // Capped so that absurd spreads don't overflow.
+        const auto propagation{std::llround(std::min(spec.propagation.count() * std::exp(spec.propagation_sigma * normal), 0x1p62))};
+        miners.emplace_back(miners.size(), hashrate, std::chrono::milliseconds{propagation});
+        total += hashrate;
+    }
+    for (auto& miner: std::span{miners}.subspan(first)) miner.perc *= spec.perc / total;
+}
+
+/** Parse a population of miners, their count, share of the hashrate, distribution of hashrates ("equal" or
+ * "pareto:<alpha>") and of propagation times (a duration or "lognormal:<median>:<sigma>"), optionally followed by
+ * the seed they are drawn from. For instance "10000,20,pareto:1.5,lognormal:1s:0.5" or "500,5,equal,2s,7". */
+std::optional<PopulationSpec> ParsePopulation(std::string_view str)
+{
+    const auto fields{SplitString(str, ',')};
+    if (fields.size() < 4 || fields.size() > 5) return {};
+    const auto count{ParseNumber<unsigned>(fields[0])};
+    const auto perc{ParseNumber<double>(fields[1])};
+    if (!count || *count == 0 || !perc || *perc < 0) return {};
+    PopulationSpec spec{.count = *count, .perc = *perc};
+
+    if (fields[2].starts_with("pareto:")) {
+        const auto alpha{ParseNumber<double>(fields[2].substr(7))};
+        if (!alpha || !(*alpha >= 0.1)) return {};
+        spec.pareto_alpha = *alpha;
+    } else if (fields[2] != "equal") {
+        return {};
+    }
+    if (fields[3].starts_with("lognormal:")) {
+        const auto params{SplitString(fields[3].substr(10), ':')};
+        if (params.size() != 2) return {};
+        const auto median{ParseDuration(params[0])};
+        const auto sigma{ParseNumber<double>(params[1])};
+        if (!median || !sigma || *sigma < 0) return {};
+        spec.propagation = *median;
+        spec.propagation_sigma = *sigma;
+    } else {
+        const auto propagation{ParseDuration(fields[3])};
+        if (!propagation) return {};
+        spec.propagation = *propagation;
+    }
+    if (fields.size() == 5) {
+        const auto seed{ParseNumber<uint64_t>(fields[4])};
+        if (!seed) return {};
+        spec.seed = *seed;
+    }
+    return spec;
+}
+
+/** Parse a scheduled change to a miner's share of the hashrate and strategy, for instance "3mo,0,35" or
+ * "1y,2,40,selfish:lead". */
+std::optional<HashrateChange> ParseHashrateChange(std::string_view str)
+{
+    const auto fields{SplitString(str, ',')};
+    if (fields.size() < 3 || fields.size() > 4) return {};
+    const auto time{ParseDuration(fields[0])};
+    const auto miner{ParseNumber<unsigned>(fields[1])};
+    const auto perc{ParseNumber<double>(fields[2])};
+    if (!time || !miner || !perc || *perc < 0) return {};
+    if (fields.size() == 3) return HashrateChange{*time, *miner, *perc, false, {}};
+
+    const auto strategy{ParseStrategy(fields[3])};
+    if (!strategy) return {};
+    return HashrateChange{*time, *miner, *perc, strategy->first, strategy->second};
+}
+
+/** Parse the latency of the link from a miner to another, for instance "0,1,100ms". */
+std::optional<LinkLatency> ParseLinkLatency(std::string_view str)
+{
+    const auto fields{SplitString(str, ',')};
+    if (fields.size() != 3) return {};
+    const auto sender{ParseNumber<unsigned>(fields[0])}, receiver{ParseNumber<unsigned>(fields[1])};
+    const auto latency{ParseDuration(fields[2])};
+    if (!sender || !receiver || *sender == *receiver || !latency) return {};
+    return LinkLatency{*sender, *receiver, *latency};
+}
+
+/** Parse which slice of the runs to simulate, for instance "2/8". */
+std::optional<ShardSpec> ParseShard(std::string_view str)
+{
+    const auto fields{SplitString(str, '/')};
+    if (fields.size() != 2) return {};
+    const auto index{ParseNumber<unsigned>(fields[0])}, count{ParseNumber<unsigned>(fields[1])};
+    if (!index || !count || *index >= *count) return {};
+    return ShardSpec{*index, *count};
+}
+
+/** Parse the values of a swept parameter: a comma-separated list of values and inclusive <start>:<stop>:<step>
+ * ranges, for instance "1s,2s:10s:2s". */
+template<typename T, typename Parse>
+std::optional<std::vector<T>> ParseSweep(std::string_view str, Parse parse)
+{
+    std::vector<T> values;
+    for (const auto item: SplitString(str, ',')) {
+        const auto bounds{SplitString(item, ':')};
+        if (bounds.size() == 1) {
+            const auto value{parse(item)};
+            if (!value) return {};
+            values.push_back(*value);
+            continue;
+        }
+        if (bounds.size() != 3) return {};
+        const auto start{parse(bounds[0])}, stop{parse(bounds[1])}, step{parse(bounds[2])};
+        if (!start || !stop || !step || !(*step > T{}) || *stop < *start) return {};
+        // Tolerate rounding errors on the last step, so 0:1:0.1 does include 1.
+        const auto steps{static_cast<int64_t>((*stop - *start) / *step + 1e-9)};
+        for (int64_t i{0}; i <= steps; ++i) {
+            values.push_back(*start + *step * i);
+        }
+    }
+    return values;
+}
+
+/** Parse a share of the network hashrate, in percent. */
+std::optional<double> ParseShare(std::string_view str)
+{
+    const auto share{ParseNumber<double>(str)};
+    if (!share || *share < 0 || *share > 100) return {};
+    return share;
+}
+
+/** Set a single option on the config. Logs and returns false if it's not valid. */
+bool SetOption(Config& config, bool& default_miners, std::string_view name, std::string_view value)
+{
+    const auto invalid{[&] {
+        std::cerr << "Invalid value for '" << name << "': '" << value << "'." << std::endl;
+        return false;
+    }};
+    if (name == "duration") {
+        const auto duration{ParseDuration(value)};
+        if (!duration || *duration <= 0ms) return invalid();
+        config.duration = *duration;
+    } else if (name == "runs") {
+        const auto runs{ParseNumber<int>(value)};
+        if (!runs || *runs <= 0) return invalid();
+        config.runs = *runs;
+    } else if (name == "seed") {
+        const auto seed{ParseNumber<uint64_t>(value)};
+        if (!seed) return invalid();
+        config.seed = *seed;
+    } else if (name == "threads") {
+        const auto threads{ParseNumber<unsigned>(value)};
+        if (!threads) return invalid();
+        config.threads = *threads;
+    } else if (name == "backend") {
+        if (value != "cpu" && value != "gpu" && value != "model") return invalid();
+        config.gpu = value == "gpu";
+        config.analytic = value == "model";
+    } else if (name == "precision") {
+        const auto precision{ParseNumber<double>(value)};
+        if (!precision || *precision <= 0) return invalid();
+        config.stale_rate_precision = *precision;
+    } else if (name == "model-tolerance") {
+        const auto tolerance{ParseNumber<double>(value)};
+        if (!tolerance || *tolerance <= 0) return invalid();
+        config.model_tolerance = *tolerance;
+    } else if (name == "miner") {
+        if (default_miners) {
+            config.miners.clear();
+            default_miners = false;
+        }
+        auto miner{ParseMiner(config.miners.size(), value)};
+        if (!miner) return invalid();
+        config.miners.push_back(std::move(*miner));
+    } else if (name == "population") {
+        if (default_miners) {
+            config.miners.clear();
+            default_miners = false;
+        }
+        const auto population{ParsePopulation(value)};
+        if (!population) return invalid();
+        AddPopulation(config.miners, *population);
+    } else if (name == "latency") {
+        const auto link{ParseLinkLatency(value)};
+        if (!link) return invalid();
+        config.latencies.push_back(*link);
+    } else if (name == "change") {
+        const auto change{ParseHashrateChange(value)};
+        if (!change) return invalid();
+        config.hashrate_changes.push_back(*change);
+    } else if (name == "retarget") {
+        const auto period{ParseNumber<uint32_t>(value)};
+        if (!period || *period == 0) return invalid();
+        config.retarget_period = *period;
+    } else if (name == "finality") {
+        const auto depth{ParseNumber<uint32_t>(value)};
+        if (!depth || *depth < MIN_FINALITY_DEPTH) return invalid();
+        config.finality_depth = *depth;
+    } else if (name == "reorg-depth") {
+        const auto depth{ParseNumber<uint32_t>(value)};
+        if (!depth || *depth == 0) return invalid();
+        config.reorg_depth = *depth;
+    } else if (name == "time-series") {
+        if (value.empty()) return invalid();
+        config.time_series = std::string{value};
+    } else if (name == "sample-interval") {
+        const auto interval{ParseDuration(value)};
+        if (!interval || *interval <= 0ms) return invalid();
+        config.sample_interval = *interval;
+    } else if (name == "shard") {
+        const auto shard{ParseShard(value)};
+        if (!shard) return invalid();
+        config.shard = *shard;
+    } else if (name == "shard-file") {
+        if (value.empty()) return invalid();
+        config.shard_file = std::string{value};
+    } else if (name == "checkpoint") {
+        if (value.empty()) return invalid();
+        config.checkpoint = std::string{value};
+    } else if (name == "checkpoint-interval") {
+        const auto interval{ParseDuration(value)};
+        if (!interval || *interval <= 0ms) return invalid();
+        config.checkpoint_interval = *interval;
+    } else if (name == "resume") {
+        if (value.empty()) return invalid();
+        config.resume = std::string{value};
+    } else if (name == "trace") {
+        if (value.empty()) return invalid();
+        config.trace = std::string{value};
+    } else if (name == "trace-every") {
+        const auto every{ParseNumber<int>(value)};
+        if (!every || *every <= 0) return invalid();
+        config.trace_every = *every;
+    } else if (name == "progress-log") {
+        if (value.empty()) return invalid();
+        config.progress_log = std::string{value};
+    } else if (name == "sweep-propagation") {
+        const auto values{ParseSweep<std::chrono::milliseconds>(value, ParseDuration)};
+        if (!values) return invalid();
+        config.sweep_propagation = *values;
+    } else if (name == "sweep-share") {
+        const auto values{ParseSweep<double>(value, ParseShare)};
+        if (!values) return invalid();
+        config.sweep_share = *values;
+    } else if (name == "sweep-selfish") {
+        const auto values{ParseSweep<double>(value, ParseShare)};
+        if (!values) return invalid();
+        config.sweep_selfish = *values;
+    } else {
+        std::cerr << "Unknown option '" << name << "'." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/** Read options from a configuration file. Each line is an option name followed by its value, blank lines and
+ * lines starting with a '#' are ignored. */
+bool ReadConfigFile(Config& config, bool& default_miners, const std::string& path)
+{
+    std::ifstream file{path};
+    if (!file) {
+        std::cerr << "Could not open configuration file '" << path << "'." << std::endl;
+        return false;
+    }
+    for (std::string line; std::getline(file, line); ) {
+        std::istringstream fields{line};
+        std::string name, value, extra;
+        if (!(fields >> name) || name.starts_with('#')) continue;
+        if (name == "config" || !(fields >> value) || fields >> extra) {
+            std::cerr << "Invalid line in '" << path << "': '" << line << "'." << std::endl;
+            return false;
+        }
+        if (!SetOption(config, default_miners, name, value)) return false;
+    }
+    return true;
+}
+
+/** Parse the command line on top of the given defaults. Logs and returns nothing if it's not valid. */
+std::optional<Config> ParseConfig(int argc, const char* const argv[], Config config)
+{
+    bool default_miners{true};
+    for (int i{1}; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+        if (arg == "-h" || arg == "--help") {
+            std::cerr << "Usage: " << argv[0] << " [options]\n" << CONFIG_USAGE;
+            return {};
+        }
+        if (!arg.starts_with("--") || i + 1 == argc) {
+            std::cerr << "Invalid argument '" << arg << "'. See --help." << std::endl;
+            return {};
+        }
+        const auto name{arg.substr(2)};
+        const std::string_view value{argv[++i]};
+        if (name == "config" ? !ReadConfigFile(config, default_miners, std::string{value}) : !SetOption(config, default_miners, name, value)) {
+            return {};
+        }
+    }
+    if (std::ranges::none_of(config.miners, [](const auto& miner) { return miner.perc > 0; })) {
+        std::cerr << "At least one miner with some hashrate is needed." << std::endl;
+        return {};
+    }
+    // Blocks record their miner on 16 bits, one value of which means none.
+    if (config.miners.size() >= BlockTree::NO_MINER) {
+        std::cerr << "At most " << BlockTree::NO_MINER - 1 << " miners can be simulated, not " << config.miners.size() << "." << std::endl;
+        return {};
+    }
+    // Miners may be set after the latencies between them.
+    for (const auto& link: config.latencies) {
+        if (std::max(link.sender, link.receiver) >= config.miners.size()) {
+            std::cerr << "Latency set between miners " << link.sender << " and " << link.receiver << " but there are only " << config.miners.size() << " miners." << std::endl;
+            return {};
+        }
+    }
+    // The network must never be left without hashrate.
+    auto changes{config.hashrate_changes};
+    std::ranges::stable_sort(changes, {}, &HashrateChange::time);
+    std::vector<double> percs;
+    for (const auto& miner: config.miners) percs.push_back(miner.perc);
+    for (size_t i{0}; i < changes.size(); ++i) {
+        if (changes[i].miner >= percs.size()) {
+            std::cerr << "Change scheduled for miner " << changes[i].miner << " but there are only " << percs.size() << " miners." << std::endl;
+            return {};
+        }
+        percs[changes[i].miner] = changes[i].perc;
+        if ((i + 1 == changes.size() || changes[i + 1].time != changes[i].time) && std::ranges::none_of(percs, [](double perc) { return perc > 0; })) {
+            std::cerr << "No miner has any hashrate left after the changes scheduled at " << changes[i].time << "." << std::endl;
+            return {};
+        }
+    }
+    if (config.resume && !config.checkpoint) config.checkpoint = config.resume;
+    if (config.analytic && (std::ranges::any_of(config.miners, &Miner::is_selfish) || !config.sweep_selfish.empty()
+                            || !config.hashrate_changes.empty() || config.reorg_depth)) {
+        std::cerr << "The analytic model only describes honest miners, without --change, --sweep-selfish nor --reorg-depth." << std::endl;
+        return {};
+    }
+    // Where the sweep stops depends on the model, which is not part of the shard and checkpoint files.
+    if (config.model_tolerance && (config.shard || config.checkpoint || config.reorg_depth)) {
+        std::cerr << "--model-tolerance can't be used with --shard, --checkpoint, --resume nor --reorg-depth." << std::endl;
+        return {};
+    }
+    // The GPU only simulates races, see IsRace().
+    if (config.gpu) {
+        if (std::ranges::any_of(config.miners, &Miner::is_selfish) || !config.sweep_selfish.empty() || !config.latencies.empty()
+            || !config.hashrate_changes.empty() || config.retarget_period || config.time_series) {
+            std::cerr << "The GPU backend only simulates honest miners whose blocks reach everyone at once, without --latency, --change, --retarget nor --time-series." << std::endl;
+            return {};
+        }
+        // Races make their blocks final at a fixed depth of their own (see RACE_FINALITY_DEPTH), not at the one set.
+        if (config.finality_depth) {
+            std::cerr << "The GPU backend can't be used with --finality." << std::endl;
+            return {};
+        }
+        if (config.checkpoint) {
+            std::cerr << "The GPU backend does not save checkpoints." << std::endl;
+            return {};
+        }
+        if (config.trace) {
+            std::cerr << "The GPU backend does not trace runs." << std::endl;
+            return {};
+        }
+    }
+    // The estimate of deep reorgs replaces the stats of the miners, and is not part of the shard and checkpoint files.
+    if (config.reorg_depth && (config.stale_rate_precision || config.time_series || config.gpu || config.shard || config.checkpoint)) {
+        std::cerr << "--reorg-depth can't be used with --precision, --time-series, the GPU backend, --shard, --checkpoint nor --resume." << std::endl;
+        return {};
+    }
+    // All the shards must simulate different runs of the same sweep, to the end.
+    if (config.shard) {
+        if (!config.seed) {
+            std::cerr << "The same --seed must be set for all the shards." << std::endl;
+            return {};
+        }
+        if (config.stale_rate_precision) {
+            std::cerr << "Shards can't stop early, as each only sees some of the runs." << std::endl;
+            return {};
+        }
+        if (config.shard->count > static_cast<unsigned>(config.runs)) {
+            std::cerr << "Can't split " << config.runs << " runs into " << config.shard->count << " shards." << std::endl;
+            return {};
+        }
+    }
+    return config;
+}
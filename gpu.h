@@ -0,0 +1,191 @@
+#include "race.h"
+
+// The GPU backend: the runs of races (see race.h) simulated one per GPU thread, with CUDA or HIP. It is only compiled
+// in when building with nvcc or hipcc, in which case SIM_GPU is defined, see the README.
+
+#if defined(__CUDACC__) || defined(__HIPCC__)
+#define SIM_GPU 1
+
+#if defined(__HIPCC__)
+#include <hip/hip_runtime.h>
+#define GPU_API(name) hip##name
+#else
+#include <cuda_runtime.h>
+#define GPU_API(name) cuda##name
+#endif
+
+//! How many runs to simulate per kernel launch, a whole number of chunks. Each takes about 6KiB of device memory,
+//! plus 12 bytes per miner.
+static constexpr int GPU_RUNS_PER_LAUNCH{1'024 * RUNS_PER_CHUNK};
+//! Threads per block of the kernels.
+static constexpr unsigned GPU_BLOCK_SIZE{128};
+
+/** Logs and returns false if a call to the GPU API failed. */
+bool CheckGpu(GPU_API(Error_t) error, const char* what)
+{
+    if (error == GPU_API(Success)) return true;
+    std::cerr << "GPU error while " << what << ": " << GPU_API(GetErrorString)(error) << std::endl;
+    return false;
+}
+
+/** An allocation of device memory, freed when it goes out of scope. */
+template<typename T>
+class DeviceBuffer
+{
+    T* m_data{nullptr};
+
+public:
+    DeviceBuffer() = default;
+    DeviceBuffer(const DeviceBuffer&) = delete;
+    DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+    ~DeviceBuffer() { if (m_data) GPU_API(Free)(m_data); }
+
+    /** Allocate room for this many values. Logs and returns false if it can't. */
+    bool Allocate(size_t count)
+    {
+        return CheckGpu(GPU_API(Malloc)(reinterpret_cast<void**>(&m_data), count * sizeof(T)), "allocating device memory");
+    }
+
+    /** Allocate room for the values and copy them. Logs and returns false if it can't. */
+    bool Upload(std::span<const T> values)
+    {
+        return Allocate(values.size())
+               && CheckGpu(GPU_API(Memcpy)(m_data, values.data(), values.size_bytes(), GPU_API(MemcpyHostToDevice)), "copying to the device");
+    }
+
+    T* data() const { return m_data; }
+};
+
+/** Simulate the runs of a batch of races, one per thread (see RunBatchRace()). */
+__global__ void RunRacesKernel(RaceNetwork network, RaceBuffers buffers, uint64_t seed, int64_t first_run)
+{
+    const size_t race{blockIdx.x * size_t{blockDim.x} + threadIdx.x};
+    if (race < buffers.races) RunBatchRace(network, buffers, seed, first_run, race);
+}
+
+/** Add up the stats of each miner over each chunk of runs of a batch of races, one miner of one chunk per thread (see
+ * ReduceBatchRaces()). */
+__global__ void ReduceRacesKernel(RaceBuffers buffers, uint32_t miner_count, MinerStatsAccumulator* chunk_stats)
+{
+    const size_t i{blockIdx.x * size_t{blockDim.x} + threadIdx.x};
+    if (i / miner_count * RUNS_PER_CHUNK < buffers.races) chunk_stats[i] = ReduceBatchRaces(buffers, miner_count, i);
+}
+
+/** The results of a miner in a run which did not fit in a race, simulated on the CPU, to be set in its state. */
+struct FallbackResult {
+    uint32_t run;
+    uint32_t miner;
+    int32_t stale_blocks;
+    uint32_t blocks_found;
+};
+
+/** Set the results of the runs of a batch which did not fit in a race in their state, one of a miner per thread. */
+__global__ void SetFallbackResultsKernel(RaceBuffers buffers, const FallbackResult* results, size_t count)
+{
+    const size_t i{blockIdx.x * size_t{blockDim.x} + threadIdx.x};
+    if (i >= count) return;
+    const auto race{GetRaceState(buffers, results[i].run)};
+    race.stale_blocks[results[i].miner] = results[i].stale_blocks;
+    race.blocks_found[results[i].miner] = results[i].blocks_found;
+}
+
+/** Same as RunScenarios(), simulating the runs on the GPU. The scenarios must all be races (see IsRace()), and the
+ * stats are reported in the order of the scenarios once each is done, with no samples nor counters. The results are
+ * the exact same as RunScenarios()' given the same parameters, early stopping included: the stats of each chunk of
+ * runs are added up on the GPU, and merged in order on the CPU. The runs which don't fit in a race, if any, are
+ * simulated by RunSimulation() on the CPU before their stats are added up.
+ *
+ * Logs and returns false if the GPU can't be used.
+ */
+bool RunScenariosOnGpu(std::span<const Scenario> scenarios, const SweepParams& params, std::ostream& progress,
+                       const std::function<void(size_t scenario, std::span<const MinerStatsAccumulator> stats,
+                                                std::span<const MinerStatsAccumulator> samples, const RunCounters& counters)>& report)
+{
+    const int64_t total_runs{int64_t{params.runs} * static_cast<int64_t>(scenarios.size())};
+    int64_t completed_runs{0};
+    uint64_t simulated_blocks{0};
+    ProgressMeter meter{progress, params.progress_log, total_runs};
+    for (size_t i{0}; i < scenarios.size(); ++i) {
+        const auto& scenario{scenarios[i]};
+        assert(IsRace(scenario, params));
+        const size_t miner_count{scenario.miners.size()};
+        const RaceTables tables{scenario.miners, params.duration};
+        const auto model{params.model_tolerance ? ModelStaleRates(scenario) : std::nullopt};
+        DeviceBuffer<uint64_t> thresholds;
+        DeviceBuffer<uint32_t> aliases;
+        DeviceBuffer<int64_t> propagation_ms;
+        if (!thresholds.Upload(tables.thresholds) || !aliases.Upload(tables.aliases) || !propagation_ms.Upload(tables.propagation_ms)) return false;
+        const RaceNetwork network{static_cast<uint32_t>(miner_count), thresholds.data(), aliases.data(), propagation_ms.data(), tables.duration_ms};
+
+        const size_t launch_runs{static_cast<size_t>(std::min(params.runs, GPU_RUNS_PER_LAUNCH))};
+        RaceBuffers buffers;
+        DeviceBuffer<std::byte> memory;
+        if (!memory.Allocate(LayoutRaceBuffers(buffers, nullptr, launch_runs, miner_count))) return false;
+        const size_t launch_chunks{(launch_runs + RUNS_PER_CHUNK - 1) / RUNS_PER_CHUNK};
+        DeviceBuffer<MinerStatsAccumulator> device_chunk_stats;
+        if (!device_chunk_stats.Allocate(launch_chunks * miner_count)) return false;
+        std::vector<uint32_t> chain_sizes(launch_runs);
+        std::vector<MinerStatsAccumulator> chunk_stats(launch_chunks * miner_count), stats(miner_count);
+        // For the runs which don't fit in a race.
+        std::optional<SimulationContext> ctx;
+        const RaceWorkspace host_race{1, miner_count};
+        std::vector<MinerStats> run_stats(miner_count);
+        std::vector<FallbackResult> fallback_results;
+
+        bool done{false};
+        for (int first_run{0}; first_run < params.runs && !done; first_run += GPU_RUNS_PER_LAUNCH) {
+            const size_t runs{static_cast<size_t>(std::min(params.runs - first_run, GPU_RUNS_PER_LAUNCH))};
+            LayoutRaceBuffers(buffers, memory.data(), runs, miner_count);
+            const auto blocks{[](size_t threads) { return static_cast<unsigned>((threads + GPU_BLOCK_SIZE - 1) / GPU_BLOCK_SIZE); }};
+            RunRacesKernel<<<blocks(runs), GPU_BLOCK_SIZE>>>(network, buffers, params.seed, int64_t{params.first_run} + first_run);
+            if (!CheckGpu(GPU_API(GetLastError)(), "simulating runs")) return false;
+            if (!CheckGpu(GPU_API(Memcpy)(chain_sizes.data(), buffers.chain_sizes, runs * sizeof(uint32_t), GPU_API(MemcpyDeviceToHost)), "copying from the device")) return false;
+            fallback_results.clear();
+            for (size_t run{0}; run < runs; ++run) {
+                if (chain_sizes[run] != 0) continue;
+                if (!ctx) ctx.emplace(scenario.miners, params.duration);
+                RunSimulation(*ctx, DeriveSeed(params.seed, params.first_run + first_run + run), run_stats);
+                const auto results{GetRaceState(host_race.Buffers(), 0)};
+                chain_sizes[run] = SetRaceResults(*ctx, results);
+                for (uint32_t j{0}; j < miner_count; ++j) {
+                    fallback_results.push_back({static_cast<uint32_t>(run), j, results.stale_blocks[j], results.blocks_found[j]});
+                }
+            }
+            // Copy their results to the state of their races at once, as they are strided there (see RaceState).
+            if (!fallback_results.empty()) {
+                DeviceBuffer<FallbackResult> device_results;
+                if (!device_results.Upload(fallback_results)
+                    || !CheckGpu(GPU_API(Memcpy)(buffers.chain_sizes, chain_sizes.data(), runs * sizeof(uint32_t), GPU_API(MemcpyHostToDevice)), "copying to the device")) return false;
+                SetFallbackResultsKernel<<<blocks(fallback_results.size()), GPU_BLOCK_SIZE>>>(buffers, device_results.data(), fallback_results.size());
+                if (!CheckGpu(GPU_API(GetLastError)(), "copying results")) return false;
+            }
+
+            const size_t chunks{(runs + RUNS_PER_CHUNK - 1) / RUNS_PER_CHUNK};
+            ReduceRacesKernel<<<blocks(chunks * miner_count), GPU_BLOCK_SIZE>>>(buffers, static_cast<uint32_t>(miner_count), device_chunk_stats.data());
+            if (!CheckGpu(GPU_API(GetLastError)(), "adding up stats")) return false;
+            if (!CheckGpu(GPU_API(Memcpy)(chunk_stats.data(), device_chunk_stats.data(), chunks * miner_count * sizeof(MinerStatsAccumulator), GPU_API(MemcpyDeviceToHost)), "copying from the device")) return false;
+            // Merge the chunks in order, checking the early stopping criterion after each as RunScenarios() does.
+            size_t merged_chunks{0};
+            for (; merged_chunks < chunks && !done; ++merged_chunks) {
+                for (size_t j{0}; j < miner_count; ++j) stats[j].Merge(chunk_stats[merged_chunks * miner_count + j]);
+                done = StopEarly(stats, model, params);
+            }
+            // Only the runs of the merged chunks count. Once stopped early, the runs skipped are done too, as with
+            // RunScenarios(), so that both backends report the same progress.
+            const size_t merged_runs{std::min(runs, merged_chunks * RUNS_PER_CHUNK)};
+            completed_runs += static_cast<int64_t>(merged_runs);
+            for (size_t run{0}; run < merged_runs; ++run) simulated_blocks += chain_sizes[run] - 1;
+            if (done) {
+                const int64_t scenario_end{int64_t{params.runs} * static_cast<int64_t>(i + 1)};
+                meter.Skip(scenario_end - completed_runs);
+                completed_runs = scenario_end;
+            }
+            meter.Report(completed_runs, simulated_blocks);
+        }
+        report(i, stats, {}, RunCounters{});
+    }
+    meter.Finish();
+    return true;
+}
+
+#endif // __CUDACC__ || __HIPCC__
@@ -1,7 +1,15 @@
+#include <fstream>
 #include <iostream>
-#include <future>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 
-#include "simulation.h"
+#include "gpu.h"
+
+// The defaults below can be overridden at runtime, see --help.
 
 //! How long to run each simulation for.
 static constexpr std::chrono::months SIM_DURATION{12};
@@ -9,38 +17,15 @@ static constexpr std::chrono::months SIM_DURATION{12};
 //! How many simulations to run in parallel.
 static constexpr int SIM_RUNS{16 * 2'048};
 
-/** Statistics about a miner's revenue in function of the best chain. */
-struct MinerStats {
-    //! The count of blocks found by this miner in the best chain.
-    long blocks_found;
-    //! The ratio of blocks found by this miner in the best chain.
-    double blocks_share;
-    //! The ratio of blocks found in the best chain over stale blocks for this miner.
-    double stale_rate;
-
-    /** Compute revenue statistics for this miner in the given best chain. */
-    explicit MinerStats(const Miner& miner, std::span<const Block> best_chain)
-    {
-        blocks_found = std::count_if(best_chain.begin(), best_chain.end(), [&miner](const Block& b) {
-            return b.miner_id == miner.id;
-        });
-        // -1 for the genesis block.
-        blocks_share = blocks_found == 0 ? 0.0 : static_cast<double>(blocks_found) / (best_chain.size() - 1);
-        stale_rate = blocks_found == 0 ? 0.0 : static_cast<double>(miner.stale_blocks) / blocks_found;
-    }
-
-    explicit MinerStats(): blocks_found{0}, blocks_share{0.0}, stale_rate{0.0} {}
-
-    MinerStats& operator+=(const MinerStats& other)
-    {
-        blocks_found += other.blocks_found;
-        blocks_share += other.blocks_share;
-        stale_rate += other.stale_rate;
-        return *this;
-    }
-};
-
-/** Set the hashrate distribution for the simulation. Must add up to 1. */
+//! Seed from which the randomness of every run is derived. Set it to the seed printed by a previous sweep to
+//! reproduce its results exactly. A random one is used if unset.
+static constexpr std::optional<uint64_t> SIM_SEED{};
+
+//! If set, stop running simulations as soon as the 95% confidence interval around every miner's stale rate is
+//! narrower than this (in both directions, e.g. 0.0001 for ±0.01%). SIM_RUNS is then an upper bound.
+static constexpr std::optional<double> SIM_STALE_RATE_PRECISION{};
+
+/** Set the default hashrate distribution for the simulation. Shares are normalized. */
 std::vector<Miner> SetupMiners()
 {
     std::vector<Miner> miners;
@@ -64,172 +49,512 @@ std::vector<Miner> SetupMiners()
     return miners;
 }
 
-/** Get the best chain known by any miner. */
-std::span<const Block> BestChain(const std::vector<Miner>& miners, std::chrono::milliseconds cur_time)
+/** Write the stats sampled during the runs of a scenario as CSV, one line per miner and sample time. */
+void WriteTimeSeries(std::ostream& out, size_t scenario, size_t miner_count, std::chrono::milliseconds interval,
+                     std::span<const MinerStatsAccumulator> samples)
+{
+    for (size_t i{0}; i < samples.size(); ++i) {
+        const auto& stats{samples[i]};
+        out << scenario << ',' << (interval * (i / miner_count + 1)).count() << ',' << i % miner_count << ',' << stats.stale_rate.count;
+        for (const auto& stat: {stats.blocks_found, stats.blocks_share, stats.stale_rate}) {
+            out << ',' << stat.mean << ',' << stat.ConfidenceInterval();
+        }
+        out << '\n';
+    }
+    out << std::flush;
+}
+
+/** Print what the engine did on average per run, in instrumented builds. */
+void PrintCounters(std::ostream& out, const RunCounters& counters)
+{
+    if (counters.runs == 0) return;
+    const auto per_run{[&](uint64_t count) { return static_cast<double>(count) / counters.runs; }};
+    out << "  Engine: " << per_run(counters.events) << " events per run, " << per_run(counters.reorgs) << " reorgs per run";
+    if (counters.reorgs > 0) {
+        out << " (" << static_cast<double>(counters.reorged_blocks) / counters.reorgs << " blocks deep on average, " << counters.max_reorg_depth << " at most)";
+    }
+    out << ", at most " << counters.max_in_flight << " blocks in flight." << std::endl;
+    if constexpr (INSTRUMENT_TIMERS) {
+        out << "  Ticks per run: " << per_run(counters.pick_finder_ticks) << " picking finders, " << per_run(counters.best_chain_ticks)
+            << " updating the best chain, " << per_run(counters.notify_ticks) << " notifying miners." << std::endl;
+    }
+}
+
+//! Header of the CSV the stats of sweeps are written as, see WriteScenarioStats().
+static constexpr std::string_view SWEEP_CSV_HEADER{"scenario,propagation_ms,share,selfish_share,miner,perc,selfish,runs,blocks_found,blocks_found_ci,blocks_share,blocks_share_ci,stale_rate,stale_rate_ci,model_stale_rate"};
+//! Header of the CSV the estimates of deep reorgs of sweeps are written as instead, see WriteScenarioDeepReorgs().
+static constexpr std::string_view DEEP_REORGS_CSV_HEADER{"scenario,propagation_ms,share,selfish_share,runs,deep_reorgs,deep_reorgs_ci"};
+//! Header of the CSV the stale rates of the analytic model are written as with --backend model, see WriteScenarioModel().
+static constexpr std::string_view MODEL_CSV_HEADER{"scenario,propagation_ms,share,selfish_share,miner,perc,model_stale_rate"};
+
+/** Write the index of a scenario of a sweep and the values of the parameters swept over, as the first CSV columns. */
+void WriteScenarioParams(std::ostream& out, size_t i, const Scenario& scenario)
 {
-    std::span<const Block> best_chain;
+    out << i << ',';
+    if (scenario.propagation) out << scenario.propagation->count();
+    out << ',';
+    if (scenario.share) out << *scenario.share;
+    out << ',';
+    if (scenario.selfish_share) out << *scenario.selfish_share;
+}
 
-    for (const auto& miner: miners) {
-        const auto pub_chain{miner.PublishedChain(cur_time)};
-        const bool more_work{pub_chain.size() > best_chain.size()};
-        const bool first_seen{pub_chain.size() == best_chain.size() && !pub_chain.empty() && pub_chain.back().arrival < best_chain.back().arrival};
-        if (more_work || first_seen) {
-            best_chain = pub_chain;
+/** Write the stats of a scenario of a sweep as CSV, one line per miner, along with the stale rate of the analytic
+ * model if it describes the scenario. */
+void WriteScenarioStats(std::ostream& out, size_t i, const Scenario& scenario, std::span<const MinerStatsAccumulator> stats)
+{
+    const auto model{ModelStaleRates(scenario)};
+    for (size_t j{0}; j < stats.size(); ++j) {
+        const auto& miner{scenario.miners[j]};
+        WriteScenarioParams(out, i, scenario);
+        out << ',' << miner.id << ',' << miner.perc << ',' << miner.is_selfish << ',' << stats[j].stale_rate.count;
+        for (const auto& stat: {stats[j].blocks_found, stats[j].blocks_share, stats[j].stale_rate}) {
+            out << ',' << stat.mean << ',' << stat.ConfidenceInterval();
         }
+        out << ',';
+        if (model) out << (*model)[j];
+        out << std::endl;
     }
+}
+
+/** Write the stale rates of the analytic model for a scenario of a sweep as CSV, one line per miner. */
+void WriteScenarioModel(std::ostream& out, size_t i, const Scenario& scenario, std::span<const double> stale_rates)
+{
+    for (size_t j{0}; j < stale_rates.size(); ++j) {
+        WriteScenarioParams(out, i, scenario);
+        out << ',' << scenario.miners[j].id << ',' << scenario.miners[j].perc << ',' << stale_rates[j] << std::endl;
+    }
+}
+
+/** Write the estimate of how many deep reorgs happen per run in a scenario of a sweep as CSV, on one line. */
+void WriteScenarioDeepReorgs(std::ostream& out, size_t i, const Scenario& scenario, const RunningStats& deep_reorgs)
+{
+    WriteScenarioParams(out, i, scenario);
+    out << ',' << deep_reorgs.count << ',' << deep_reorgs.mean << ',' << deep_reorgs.ConfidenceInterval() << std::endl;
+}
 
-    return best_chain;
+/** Print the classes of the honest miners of a large network, by share of the hashrate and by propagation time (see
+ * ClassifyMiners()), with their stats if any and the stale rate of the analytic model if it describes the network. */
+void PrintMinerClasses(std::ostream& out, std::span<const Miner> miners, std::span<const MinerStatsAccumulator> stats, const std::optional<std::vector<double>>& model)
+{
+    const auto print{[&](std::string_view title, const auto& key, double base, const auto& describe) {
+        out << "  By " << title << ':' << std::endl;
+        for (const auto& cls: ClassifyMiners(miners, stats, model, key, base)) {
+            out << "    - " << cls.miners << " miners ";
+            describe(cls);
+            if (!stats.empty()) {
+                out << " found " << cls.blocks_share * 100 << "% of blocks. Stale rate: " << cls.stale_rate * 100 << "% (from "
+                    << cls.min_stale_rate * 100 << "% to " << cls.max_stale_rate * 100 << "% per miner)";
+                if (cls.model_stale_rate) out << ", " << *cls.model_stale_rate * 100 << "% by the model";
+            } else if (cls.model_stale_rate) {
+                out << " have a stale rate of " << *cls.model_stale_rate * 100 << '%';
+            }
+            out << '.' << std::endl;
+        }
+    }};
+    print("share of the network hashrate", &Miner::perc, 10, [&](const MinerClass& cls) {
+        cls.upper > 0 ? out << "with " << cls.lower << "% to " << cls.upper << '%' : out << "without any";
+        out << " of network hashrate (" << cls.perc << "% in total)";
+    });
+    print("propagation time", [](const Miner& miner) { return static_cast<double>(miner.propagation.count()); }, 2, [&](const MinerClass& cls) {
+        out << "whose blocks propagate in ";
+        cls.upper > 0 ? out << cls.lower << "ms to " << cls.upper << "ms" : out << "no time";
+        out << " (" << cls.perc << "% of network hashrate)";
+    });
 }
 
-/** Has any miner published a block that was not yet received by the entirety of the network? */
-bool AnyBlockInFlight(const std::vector<Miner>& miners, std::chrono::milliseconds cur_time)
+/** Print the stats for each miner by averaging over all simulation runs, along with the 95% confidence interval, and
+ * the stale rate of the analytic model if it describes the network. Networks of more than MAX_MINERS_LISTED miners
+ * are reported by classes of honest miners, selfish ones still miner by miner. */
+void PrintStats(std::ostream& out, const Scenario& scenario, std::chrono::milliseconds duration, std::span<const MinerStatsAccumulator> stats_total)
 {
-    for (const auto& miner: miners) {
-        const auto unpublished_blocks{miner.UnpublishedBlocks(cur_time)};
-        if (!miner.is_selfish && unpublished_blocks > 0) {
-            return true;
-        } else if (miner.is_selfish && unpublished_blocks > miner.SelfishBlocks()) {
-            return true;
+    const auto& miners{scenario.miners};
+    const auto model{ModelStaleRates(scenario)};
+    const auto days{std::chrono::duration_cast<std::chrono::days>(duration)};
+    const bool by_class{miners.size() > MAX_MINERS_LISTED};
+    out << "After running " << stats_total[0].stale_rate.count << " simulations for " << days << " each, on average:" << std::endl;
+    assert(miners.size() == stats_total.size());
+    for (size_t i{0}; i < miners.size(); ++i) {
+        const auto& miner{miners[i]};
+        const auto& stats{stats_total[i]};
+        if (by_class && !miner.is_selfish) continue;
+        out << "  - Miner " << miner.id << " (" << miner.perc << "% of network hashrate) found " << stats.blocks_found.mean << " (±" << stats.blocks_found.ConfidenceInterval() << ") blocks i.e. ";
+        out << stats.blocks_share.mean * 100 << "% (±" << stats.blocks_share.ConfidenceInterval() * 100 << "%) of blocks. ";
+        out << "Stale rate: " << stats.stale_rate.mean * 100 << "% (±" << stats.stale_rate.ConfidenceInterval() * 100 << "%)";
+        if (model) out << ", " << (*model)[i] * 100 << "% by the model";
+        out << '.';
+        if (miner.is_selfish) {
+            const auto& params{miner.selfish_params};
+            out << " ('selfish mining' strategy";
+            if (params.gamma > 0) out << ", gamma=" << params.gamma;
+            if (params.lead_stubborn) out << ", lead stubborn";
+            if (params.equal_fork_stubborn) out << ", equal-fork stubborn";
+            if (params.trail_stubbornness > 0) out << ", trail stubborn (" << +params.trail_stubbornness << ')';
+            out << ')';
         }
+        out << std::endl;
+    }
+    if (by_class) PrintMinerClasses(out, miners, stats_total, model);
+}
+
+/** Print the stale rate of each miner by the analytic model, or of classes of miners for large networks. */
+void PrintModel(std::ostream& out, std::span<const Miner> miners, const std::vector<double>& stale_rates)
+{
+    out << "By the analytic model:" << std::endl;
+    if (miners.size() > MAX_MINERS_LISTED) return PrintMinerClasses(out, miners, {}, stale_rates);
+    for (size_t i{0}; i < miners.size(); ++i) {
+        out << "  - Miner " << miners[i].id << " (" << miners[i].perc << "% of network hashrate) has a stale rate of " << stale_rates[i] * 100 << "%." << std::endl;
+    }
+}
+
+/** Print the estimate of how many reorgs at least this deep happen per run, along with the 95% confidence interval,
+ * and how often that is. */
+void PrintDeepReorgs(std::ostream& out, uint32_t depth, std::chrono::milliseconds duration, const RunningStats& deep_reorgs)
+{
+    const auto days{std::chrono::duration_cast<std::chrono::days>(duration)};
+    out << "After running " << deep_reorgs.count << " simulations for " << days << " each, reorgs at least " << depth << " blocks deep happen "
+        << deep_reorgs.mean << " (±" << deep_reorgs.ConfidenceInterval() << ") times per run on average";
+    if (deep_reorgs.mean > 0) {
+        const std::chrono::duration<double, std::chrono::years::period> years{duration};
+        out << ", i.e. once every " << years.count() / deep_reorgs.mean << " years";
     }
-    return false;
+    out << '.' << std::endl;
 }
 
-/** The earliest next block to arrive, if any. */
-std::optional<std::chrono::milliseconds> EarliestArrival(const std::vector<Miner>& miners, std::chrono::milliseconds cur_time)
+/** Open the file to write the time series to and write the CSV header. Logs and returns false if it can't. */
+bool OpenTimeSeries(std::ofstream& file, const std::string& path)
 {
-    std::optional<std::chrono::milliseconds> earliest_arrival{};
-    for (const auto& miner: miners) {
-        if (const auto next_arrival = miner.NextArrival(cur_time)) {
-            if (earliest_arrival.has_value()) {
-                earliest_arrival = std::min(earliest_arrival.value(), next_arrival.value());
-            } else {
-                earliest_arrival = next_arrival;
+    file.open(path);
+    if (!file) {
+        std::cerr << "Could not open time series file '" << path << "'." << std::endl;
+        return false;
+    }
+    file << "scenario,time_ms,miner,runs,blocks_found,blocks_found_ci,blocks_share,blocks_share_ci,stale_rate,stale_rate_ci\n";
+    return true;
+}
+
+/** Merge the stats of the shards of a sweep, each simulated with --shard, and print them as if the whole sweep was
+ * simulated at once. */
+int MergeShardFiles(int argc, char* argv[])
+{
+    std::optional<std::string> time_series_path;
+    std::vector<ShardResults> shards;
+    for (int i{2}; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+        if (arg == "-h" || arg == "--help") {
+            std::cerr << "Usage: " << argv[0] << " merge [--time-series <file>] <shard file>...\n"
+                      << "Print the stats of all the shards of a sweep, simulated with --shard, and write its time series\n"
+                      << "to a file if the shards sampled the stats during the runs.\n";
+            return 1;
+        }
+        if (arg == "--time-series") {
+            if (i + 1 == argc) {
+                std::cerr << "Missing value for '--time-series'." << std::endl;
+                return 1;
             }
+            time_series_path = argv[++i];
+            continue;
+        }
+        std::ifstream file{std::string{arg}, std::ios::binary};
+        if (!file) {
+            std::cerr << "Could not open shard file '" << arg << "'." << std::endl;
+            return 1;
         }
+        auto shard{ReadShard(file, arg)};
+        if (!shard) return 1;
+        shards.push_back(std::move(*shard));
     }
-    return earliest_arrival;
-}
-
-/** Simulate the Bitcoin mining process for a given amount of time with the given miners, each having its
- * own share of network hashrate and block propagation time.
- *
- * The propagation time is a simplification: it is the time before which a miner's block has not reached
- * any other miner and after which it has reached all other miners.
- *
- * The mining process is accurately modeled: we draw the time between the last and next block from an
- * exponential distribution, then draw which miner found this block based on its hashrate and a uniform
- * distribution. Difficulty and network hashrate are assumed to be constant.
- *
- * This assumes today's Bitcoin Core behaviour: a miner will mine on top of its own block immediately and will
- * only switch to a propagated chain if it's longer (again, difficulty is assumed constant). Miners can optionally
- * be set to adopt the "selfish mining" strategy in SetupMiners().
- */
-std::vector<MinerStats> RunSimulation(std::chrono::milliseconds duration_time, std::vector<Miner> miners)
-{
-    // Create a number of miners with a given set of parameters.
-    std::random_device rd;
-    // Random number generators used to respectively pick the time before the next block interval and
-    // pick which miner found the last block.
-    RNG block_interval{rd()}, miner_picker{rd()};
-
-    // Absolute time of the next block arrival. Since we are starting from 0, for the first one this is
-    // just the block interval itself.
-    std::chrono::milliseconds next_block_time{NextBlockInterval(block_interval)};
-
-    std::chrono::milliseconds mean_prop_time{0};
-    for (const auto& miner: miners) {
-        mean_prop_time += miner.propagation;
-    }
-    mean_prop_time /= miners.size();
-    mean_prop_time = std::max(1ms, mean_prop_time);
-
-    // Run the simulation. As we advance time, we check if a block was found, and if so which miner
-    // found it. We also check if any miner needs to reorg once one miner's chain reached it.
-    size_t best_chain_size{1};
-    for (std::chrono::milliseconds cur_time{0}; cur_time < duration_time; ) {
-        // Has a block been found by now? NOTE: `while` and not `if` in the unlikely case that
-        // NextBlockInterval() returns 0.
-        while (cur_time == next_block_time) {
-            Miner& miner{PickFinder(miners, miner_picker)};
-            miner.FoundBlock(next_block_time, best_chain_size);
-            next_block_time += NextBlockInterval(block_interval);
-        }
-        assert(cur_time < next_block_time); // Must never miss any as we advance in steps of 1ms.
-
-        // Record the best propagated chain among all miners, and let them all know about it. They
-        // might switch to it if it's longer or act upon the information (for instance a selfish miner
-        // may selectively reveal some of its private blocks). Among chains of the same size, pick
-        // the one which arrived first (matching Bitcoin Core's first-seen rule).
-        const auto best_chain{BestChain(miners, cur_time)};
-        for (auto& miner: miners) {
-            miner.NotifyBestChain(best_chain, cur_time);
-        }
-
-        // Record the best chain size as FoundBlock() may decide not to publish a block based on this
-        // information.
-        best_chain_size = best_chain.size();
-
-        // There is only two events that may change the state of miners (including the selfish ones):
-        // a block is found, or a block is received. Instead of iterating through every ms where nothing
-        // will happen, cut-through to the next event.
-        const auto earliest_arrival{EarliestArrival(miners, cur_time)};
-        cur_time = next_block_time;
-        if (earliest_arrival.has_value()) {
-            if (earliest_arrival.value() < cur_time) {
-                cur_time = earliest_arrival.value();
+    const auto merged{MergeShards(shards)};
+    if (!merged) return 1;
+    std::ofstream time_series;
+    if (time_series_path && !merged->sample_interval) {
+        std::cerr << "The shards did not sample the stats during the runs, pass --time-series to all of them." << std::endl;
+        return 1;
+    }
+    if (time_series_path && !OpenTimeSeries(time_series, *time_series_path)) return 1;
+
+    std::cerr << "Merged the " << shards.size() << " shards of " << merged->runs << " simulations of " << merged->scenarios.size() << " scenarios (seed " << merged->seed << ")." << std::endl;
+    if (merged->is_sweep) std::cout << SWEEP_CSV_HEADER << std::endl;
+    for (size_t i{0}; i < merged->scenarios.size(); ++i) {
+        const auto& miners{merged->scenarios[i].miners};
+        const std::span<const MinerStatsAccumulator> all_stats{merged->stats[i]};
+        const auto stats{all_stats.first(miners.size())};
+        if (time_series_path) WriteTimeSeries(time_series, i, miners.size(), *merged->sample_interval, all_stats.subspan(miners.size()));
+        merged->is_sweep ? WriteScenarioStats(std::cout, i, merged->scenarios[i], stats) : PrintStats(std::cout, merged->scenarios[i], merged->duration, stats);
+    }
+    return 0;
+}
+
+/** Print an event of a traced run. */
+void PrintTraceEvent(std::ostream& out, size_t index, const TraceEvent& event)
+{
+    out << "Event " << index << " at " << event.time_ms << "ms: ";
+    switch (event.type) {
+    case TraceEvent::Type::Found: out << "miner " << event.miner << " found block " << event.block; break;
+    case TraceEvent::Type::Published: out << "miner " << event.miner << " published block " << event.block; break;
+    case TraceEvent::Type::Received:
+        out << "block " << event.block << " reached ";
+        event.miner == BlockTree::NO_MINER ? out << "everyone" : out << "miner " << event.miner;
+        break;
+    case TraceEvent::Type::Reorg: out << "the best chain dropped " << +event.depth << " blocks for block " << event.block << " of miner " << event.miner; break;
+    }
+    out << '.' << std::endl;
+}
+
+/** Print the state of a run being simulated: the last blocks of the best chain and what each miner mines on. */
+void PrintRunState(std::ostream& out, const SimulationContext& ctx)
+{
+    const auto& tree{ctx.tree};
+    const auto& best_chain{ctx.best_chain};
+    out << "The best chain is " << best_chain.size() - 1 << " blocks long, ending with (block, miner, arrival in ms):";
+    for (size_t height{std::max(best_chain.First(), best_chain.size() - std::min<size_t>(best_chain.size(), 6))}; height < best_chain.size(); ++height) {
+        const auto block{best_chain[height]};
+        out << " (" << block << ", " << tree.MinerId(block) << ", " << tree.Arrival(block).count() << ')';
+    }
+    out << '.' << std::endl;
+    for (const auto& miner: ctx.miners) {
+        out << "  - Miner " << miner.id << " (" << miner.perc << "% of network hashrate) mines on block " << miner.tip << " at height "
+            << tree.Height(miner.tip) << ", with " << miner.stale_blocks << " stale blocks counted so far";
+        if (miner.private_blocks > 0) out << " and " << miner.private_blocks << " private blocks";
+        out << '.' << std::endl;
+    }
+}
+
+/** Simulate a run recorded with --trace again from its seed, check the same events happen, and print the state of
+ * the run right after one of them if asked to. */
+int ReplayTrace(int argc, char* argv[])
+{
+    std::optional<std::string> path;
+    std::optional<uint32_t> scenario;
+    std::optional<int32_t> run;
+    std::optional<uint64_t> event;
+    for (int i{2}; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+        if (arg == "-h" || arg == "--help") {
+            std::cerr << "Usage: " << argv[0] << " replay [--scenario <index>] [--run <index>] [--event <index>] <trace file>\n"
+                      << "Simulate the first run traced with --trace (of this scenario and with this index among all the runs, if\n"
+                      << "set) again, check that the same events happen, and print the state of the run right after this event.\n";
+            return 1;
+        }
+        if (arg == "--scenario" || arg == "--run" || arg == "--event") {
+            const auto value{i + 1 < argc ? ParseNumber<uint64_t>(argv[++i]) : std::nullopt};
+            if (!value || (arg != "--event" && *value > std::numeric_limits<int32_t>::max())) {
+                std::cerr << "Invalid or missing value for '" << arg << "'." << std::endl;
+                return 1;
             }
+            arg == "--scenario" ? void(scenario = *value) : arg == "--run" ? void(run = *value) : void(event = *value);
+            continue;
+        }
+        if (path) {
+            std::cerr << "Only one trace file can be replayed at once." << std::endl;
+            return 1;
         }
+        path = arg;
+    }
+    if (!path) {
+        std::cerr << "No trace file to replay. See replay --help." << std::endl;
+        return 1;
+    }
+    std::ifstream file{*path, std::ios::binary};
+    if (!file) {
+        std::cerr << "Could not open trace file '" << *path << "'." << std::endl;
+        return 1;
+    }
+    const auto header{ReadTraceHeader(file, *path)};
+    if (!header) return 1;
+    const auto& sweep{header->sweep};
+    TracedRun traced;
+    bool found{false};
+    while (!found && ReadTracedRun(file, traced, *path)) {
+        found = (!scenario || traced.scenario == *scenario) && (!run || traced.run == *run);
+    }
+    if (file.fail()) return 1;
+    if (!found || traced.scenario >= sweep.scenarios.size()) {
+        std::cerr << "No such run was traced in '" << *path << "'." << std::endl;
+        return 1;
+    }
+    if (event && *event >= traced.events.size()) {
+        std::cerr << "Run " << traced.run << " of scenario " << traced.scenario << " only has " << traced.events.size() << " events." << std::endl;
+        return 1;
     }
 
-    const auto best_chain{BestChain(miners, duration_time)};
-    std::vector<MinerStats> stats;
-    for (const auto& miner: miners) {
-        stats.emplace_back(MinerStats(miner, best_chain));
+    const auto& network{sweep.scenarios[traced.scenario]};
+    SimulationContext ctx{network.miners, sweep.duration, network.latencies, sweep.sample_interval, network.hashrate_changes, sweep.retarget_period, sweep.finality_depth, header->reorg_depth};
+    RunTrace trace;
+    if (event) {
+        trace.inspect_at = *event + 1;
+        trace.inspect = [&](const SimulationContext& state) {
+            PrintTraceEvent(std::cout, *event, trace.events.back());
+            PrintRunState(std::cout, state);
+        };
     }
+    ctx.trace = &trace;
+    std::vector<MinerStats> stats(ctx.miners.size());
+    RunSimulation(ctx, DeriveSeed(sweep.seed, traced.run), stats);
 
-    return stats;
+    const auto [replayed, recorded]{std::ranges::mismatch(trace.events, traced.events)};
+    if (replayed != trace.events.end() || recorded != traced.events.end()) {
+        const auto index{static_cast<size_t>(recorded - traced.events.begin())};
+        std::cout << "The replay of run " << traced.run << " of scenario " << traced.scenario << " differs from its trace from event " << index << " on. ";
+        if (recorded != traced.events.end()) {
+            std::cout << "Traced:" << std::endl;
+            PrintTraceEvent(std::cout, index, *recorded);
+        }
+        if (replayed != trace.events.end()) {
+            std::cout << "Replayed:" << std::endl;
+            PrintTraceEvent(std::cout, index, *replayed);
+        }
+        return 1;
+    }
+    std::cout << "Replayed run " << traced.run << " of scenario " << traced.scenario << ": the same " << trace.events.size() << " events happened as traced." << std::endl;
+    return 0;
 }
 
-/** Run the simulation SIM_RUNS times for SIM_DURATION with the network configuration defined in SetupMiners(). */
-int main()
+/** Run the simulation SIM_RUNS times for SIM_DURATION with the network configuration defined in SetupMiners(),
+ * unless overridden on the command line. With `merge` as first argument, merge the stats of shards instead, and
+ * with `replay` replay a traced run. */
+int main(int argc, char* argv[])
 {
-    const auto miners{SetupMiners()};
-    const auto thread_count{std::thread::hardware_concurrency()};
-    std::vector<MinerStats> stats_total(miners.size());
+    if (argc > 1 && std::string_view{argv[1]} == "merge") return MergeShardFiles(argc, argv);
+    if (argc > 1 && std::string_view{argv[1]} == "replay") return ReplayTrace(argc, argv);
 
-    std::cout << "Running " << SIM_RUNS << " simulations in parallel using " << thread_count << " threads." << std::endl;
+    const auto config{ParseConfig(argc, argv, Config{
+        .duration = SIM_DURATION,
+        .runs = SIM_RUNS,
+        .seed = SIM_SEED,
+        .stale_rate_precision = SIM_STALE_RATE_PRECISION,
+        .miners = SetupMiners(),
+    })};
+    if (!config) return 1;
+#ifndef SIM_GPU
+    if (config->gpu) {
+        std::cerr << "This build has no GPU backend, see the README to build it with nvcc or hipcc." << std::endl;
+        return 1;
+    }
+#endif
+    const auto thread_count{config->threads > 0 ? config->threads : std::max(1u, std::thread::hardware_concurrency())};
+    // When resuming, the seed of the interrupted sweep is used unless it was set.
+    std::optional<Checkpoint> checkpoint;
+    if (config->resume && !(checkpoint = ReadCheckpoint(*config->resume))) return 1;
+    const uint64_t seed{config->seed ? *config->seed
+                        : checkpoint ? checkpoint->sweep.seed
+                                     : (uint64_t{std::random_device{}()} << 32) | std::random_device{}()};
+    std::optional<std::chrono::milliseconds> sample_interval;
+    if (config->time_series) sample_interval = config->sample_interval;
+    SweepParams params{config->duration, config->runs, seed, thread_count, config->stale_rate_precision, sample_interval, config->retarget_period};
+    const auto scenarios{MakeScenarios(*config)};
+    params.finality_depth = config->finality_depth;
+    params.reorg_depth = config->reorg_depth;
+    params.model_tolerance = config->model_tolerance;
+    if (config->shard) std::tie(params.first_run, params.runs) = ShardRuns(config->runs, *config->shard);
 
-    // Run the simulation `SIM_RUNS` times by batches of `thread_count` parallel tasks. Record all stats
-    // into `stats_total`.
-    unsigned int remaining_tasks{SIM_RUNS};
-    while (remaining_tasks > 0) {
-        std::vector<std::future<std::vector<MinerStats>>> sim_futures;
-        for (int i{0}; i < std::min(thread_count, remaining_tasks); ++i) {
-            sim_futures.emplace_back(std::async(std::launch::async, &RunSimulation, SIM_DURATION, miners));
+    // The analytic model needs no simulation at all.
+    if (config->analytic) {
+        if (config->IsSweep()) std::cout << MODEL_CSV_HEADER << std::endl;
+        for (size_t i{0}; i < scenarios.size(); ++i) {
+            const auto model{ModelStaleRates(scenarios[i])};
+            assert(model);
+            config->IsSweep() ? WriteScenarioModel(std::cout, i, scenarios[i], *model) : PrintModel(std::cout, scenarios[i].miners, *model);
         }
-        for (auto& fut: sim_futures) {
-            const auto stats{fut.get()};
-            assert(stats.size() == stats_total.size());
-            for (int j{0}; j < stats.size(); ++j) {
-                stats_total[j] += stats[j];
-            }
+        return 0;
+    }
+    std::ofstream progress_log;
+    if (config->progress_log) {
+        progress_log.open(*config->progress_log);
+        if (!progress_log) {
+            std::cerr << "Could not open progress log file '" << *config->progress_log << "'." << std::endl;
+            return 1;
         }
-        remaining_tasks -= thread_count;
-        std::cout << '\r' << (SIM_RUNS - remaining_tasks) * 100 / SIM_RUNS << "% progress..";
+        params.progress_log = &progress_log;
     }
-    std::cout << std::endl;
 
-    // Print the stats for each miner by averaging over all simulation runs.
-    const auto days{std::chrono::duration_cast<std::chrono::days>(SIM_DURATION)};
-    std::cout << "After running " << SIM_RUNS << " simulations for " << days << " each, on average:" << std::endl;
-    assert(miners.size() == stats_total.size());
-    for (int i{0}; i < miners.size(); ++i) {
-        const auto& miner{miners[i]};
-        const auto& stats{stats_total[i]};
-        std::cout << "  - Miner " << miner.id << " (" << miner.perc << "% of network hashrate) found " << stats.blocks_found / SIM_RUNS << " blocks i.e. ";
-        std::cout << stats.blocks_share * 100 / SIM_RUNS << "% of blocks. Stale rate: " << stats.stale_rate * 100 / SIM_RUNS << "%.";
-        if (miner.is_selfish) std::cout << " ('selfish mining' strategy)";
-        std::cout << std::endl;
+    // Everything about the sweep, to check it is resumed with the same options and to merge its shards.
+    ShardResults sweep{config->shard.value_or(ShardSpec{0, 1}), seed, config->runs, config->duration, sample_interval, config->retarget_period, config->finality_depth, config->IsSweep(), scenarios, {}};
+    std::optional<SweepProgress> resume;
+    if (checkpoint) {
+        if (!IsSameSweep(*checkpoint, sweep, config->stale_rate_precision)) {
+            std::cerr << "Checkpoint file '" << *config->resume << "' was saved with different options." << std::endl;
+            return 1;
+        }
+        resume = std::move(checkpoint->progress);
+    }
+    std::optional<SweepCheckpoints> checkpoints;
+    if (config->checkpoint) {
+        checkpoints = SweepCheckpoints{config->checkpoint_interval, [&](const SweepProgress& progress) {
+            WriteCheckpoint(*config->checkpoint, sweep, config->stale_rate_precision, progress);
+        }};
     }
+
+    TraceFile trace_file;
+    std::optional<SweepTraces> traces;
+    if (config->trace) {
+        if (!trace_file.Open(*config->trace, TraceHeader{sweep, params.reorg_depth})) return 1;
+        traces = SweepTraces{config->trace_every, [&](size_t i, int run, std::span<const TraceEvent> events) {
+            trace_file.Write(i, run, events);
+        }};
+    }
+
+    // Simulate the scenarios on the backend picked, which gives the same results either way. Logs and returns false if
+    // it can't.
+    const auto run_scenarios{[&](std::ostream& progress, const auto& report) {
+#ifdef SIM_GPU
+        if (config->gpu) return RunScenariosOnGpu(scenarios, params, progress, report);
+#endif
+        RunScenarios(scenarios, params, progress, report, resume, checkpoints, traces);
+        return !traces || trace_file.Close();
+    }};
+    const std::string workers{config->gpu ? "the GPU" : std::to_string(thread_count) + " threads"};
+
+    if (config->shard) {
+        // Only simulate our slice of the runs, and record their stats (samples included) for them to be merged
+        // with the other shards'. The time series is written when merging.
+        const auto& shard{*config->shard};
+        auto& results{sweep};
+        results.stats.resize(scenarios.size());
+        std::cerr << "Running simulations " << params.first_run << " to " << params.first_run + params.runs - 1 << " of " << config->runs << " (shard " << shard.index << "/" << shard.count << ") of "
+                  << scenarios.size() << " scenarios in parallel using " << workers << " (seed " << seed << ")." << std::endl;
+        if (!run_scenarios(std::cerr, [&](size_t i, std::span<const MinerStatsAccumulator> stats, std::span<const MinerStatsAccumulator> samples, const RunCounters&) {
+            results.stats[i].assign(stats.begin(), stats.end());
+            results.stats[i].insert(results.stats[i].end(), samples.begin(), samples.end());
+        })) return 1;
+        const auto path{config->shard_file.value_or("shard-" + std::to_string(shard.index) + "-of-" + std::to_string(shard.count) + ".bin")};
+        std::ofstream file{path, std::ios::binary};
+        WriteShard(file, results);
+        if (!file.flush()) {
+            std::cerr << "Could not write shard file '" << path << "'." << std::endl;
+            return 1;
+        }
+        std::cerr << "Wrote the stats of the shard to '" << path << "'. Merge it with the others with: " << argv[0] << " merge <shard file>..." << std::endl;
+        return 0;
+    }
+
+    std::ofstream time_series;
+    if (config->time_series && !OpenTimeSeries(time_series, *config->time_series)) return 1;
+
+    if (config->IsSweep()) {
+        // Stream the results of each scenario as CSV, one line per miner, and keep progress out of the way.
+        std::cerr << "Running " << config->runs << " simulations of " << scenarios.size() << " scenarios in parallel using " << workers << " (seed " << seed << ")." << std::endl;
+        std::cout << (params.reorg_depth ? DEEP_REORGS_CSV_HEADER : SWEEP_CSV_HEADER) << std::endl;
+        if (!run_scenarios(std::cerr, [&](size_t i, std::span<const MinerStatsAccumulator> stats, std::span<const MinerStatsAccumulator> samples, const RunCounters& counters) {
+            if (sample_interval) WriteTimeSeries(time_series, i, stats.size(), *sample_interval, samples);
+            if constexpr (INSTRUMENT) {
+                std::cerr << "\nScenario " << i << ':' << std::endl;
+                PrintCounters(std::cerr, counters);
+            }
+            params.reorg_depth ? WriteScenarioDeepReorgs(std::cout, i, scenarios[i], counters.deep_reorgs) : WriteScenarioStats(std::cout, i, scenarios[i], stats);
+        })) return 1;
+        return 0;
+    }
+
+    std::cout << "Running " << config->runs << " simulations in parallel using " << workers << " (seed " << seed << ")." << std::endl;
+    std::vector<MinerStatsAccumulator> stats_total;
+    RunCounters counters_total;
+    if (!run_scenarios(std::cout, [&](size_t i, std::span<const MinerStatsAccumulator> stats, std::span<const MinerStatsAccumulator> samples, const RunCounters& counters) {
+        stats_total.assign(stats.begin(), stats.end());
+        counters_total = counters;
+        if (sample_interval) WriteTimeSeries(time_series, i, stats.size(), *sample_interval, samples);
+    })) return 1;
+    // The stats of the miners are skewed by the forks made to last longer when estimating deep reorgs.
+    params.reorg_depth ? PrintDeepReorgs(std::cout, *params.reorg_depth, config->duration, counters_total.deep_reorgs)
+                       : PrintStats(std::cout, scenarios[0], config->duration, stats_total);
+    if constexpr (INSTRUMENT) PrintCounters(std::cout, counters_total);
 }
@@ -1,4 +1,6 @@
+import csv
 import math
+import sys
 import matplotlib.pyplot as plt
 
 # Rate of arrival of blocks in seconds for the exponential distribution
@@ -102,7 +104,43 @@ def plot_benefits(prop_times):
 
     plt.show()
 
+def plot_simulated_stale_rates(csv_path):
+    """Plot the stale rate of each miner against propagation time from the CSV output of
+    a simulation sweep over propagation times (--sweep-propagation), along with that of
+    the analytic model as dashed lines when it was written."""
+    results = {}
+    with open(csv_path, newline="") as f:
+        for row in csv.DictReader(f):
+            if row["propagation_ms"] == "":
+                sys.exit("The sweep must be over propagation times.")
+            label = f"Miner {row['miner']} ({float(row['perc']):g}%)"
+            if row["share"] != "" or row["selfish_share"] != "":
+                label += f" share={row['share']} selfish={row['selfish_share']}"
+            times, rates, cis, models = results.setdefault(label, ([], [], [], []))
+            times.append(int(row["propagation_ms"]) / 1000)
+            rates.append(float(row["stale_rate"]) * 100)
+            cis.append(float(row["stale_rate_ci"]) * 100)
+            # The stale rate of the analytic model, if it describes the scenario.
+            model = row.get("model_stale_rate", "")
+            models.append(float(model) * 100 if model != "" else None)
+
+    fig, ax = plt.subplots()
+    for label, (times, rates, cis, models) in results.items():
+        line = ax.errorbar(times, rates, yerr=cis, label=label, capsize=2)
+        if None not in models:
+            ax.plot(times, models, linestyle="--", color=line[0].get_color())
+    ax.set_xlabel("Propagation time (seconds)")
+    ax.set_ylabel("Simulated stale rate (%)")
+    ax.legend(reverse=True)
+
+    plt.show()
+
 if __name__ == "__main__":
+    # Plot the results of a simulation sweep if given one, the analytical model otherwise.
+    if len(sys.argv) > 1:
+        plot_simulated_stale_rates(sys.argv[1])
+        sys.exit()
+
     # The propagation times (in seconds) to get the stale rate of each pool for.
     prop_times = list(range(20 + 1))
 
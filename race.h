@@ -0,0 +1,391 @@
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "shard.h"
+
+// Races: the runs of networks of honest miners whose blocks reach everyone at once, with nothing changing during the
+// runs, which are what most sweeps simulate. They are simulated by a second copy of the engine of RunHonestNetwork(),
+// on storage of a fixed size set up beforehand and with no branch on the options, so that a GPU can simulate one run
+// per thread (see gpu.h). Given the same seed a race finds the exact same blocks and gives the exact same stats as
+// RunSimulation(), which holds as long as no reorg is as deep as RACE_FINALITY_DEPTH, at which the blocks of a race
+// are final (see FinalizeBlocks()). Tests check it, so that the GPU backend can always be cross-checked against the
+// CPU one.
+//
+// The depth is well below MIN_FINALITY_DEPTH, which is only that deep for strategic miners to keep mining on a
+// branch far behind. Honest miners switch to the best chain as soon as a block of it reaches them, so a reorg only
+// drops the blocks found during a propagation time, and 64 of them is out of reach of any realistic network.
+//
+// Everything a GPU thread calls is constexpr, which nvcc (with --expt-relaxed-constexpr) and hipcc allow to be called
+// from device code as well.
+
+//! The number of blocks a race keeps in memory. A run which needs more is simulated by RunSimulation() instead.
+static constexpr uint32_t RACE_WINDOW{256};
+//! Blocks this deep in the best chain are final during a race and dropped, as with SweepParams::finality_depth. A
+//! quarter of the window, as in SimulationContext: honest networks never reorg anywhere near this deep.
+static constexpr uint32_t RACE_FINALITY_DEPTH{RACE_WINDOW / 4};
+//! The number of blocks in flight at once a race keeps track of. A run which needs more is simulated by
+//! RunSimulation() instead.
+static constexpr uint32_t RACE_MAX_IN_FLIGHT{64};
+//! The number of lanes of the BatchRNG of a BatchedStream, which a RaceStream draws from in turn.
+static constexpr size_t RACE_STREAM_LANES{4};
+
+/** The same values as a BatchedStream with the same seed, generated one at a time instead of in batches: from each
+ * lane of its BatchRNG in turn. This takes a few words of state rather than a batch of values, which a GPU thread
+ * could not afford. */
+class RaceStream
+{
+    uint64_t m_s0[RACE_STREAM_LANES];
+    uint64_t m_s1[RACE_STREAM_LANES];
+    size_t m_lane{0};
+
+public:
+    constexpr explicit RaceStream(uint64_t seedval) noexcept
+    {
+        for (size_t i{0}; i < RACE_STREAM_LANES; ++i) {
+            RNG lane{seedval};
+            m_s0[i] = lane.rand64();
+            m_s1[i] = lane.rand64();
+            seedval = lane.rand64();
+        }
+    }
+
+    /** Same as UniformStream::Next(). */
+    constexpr uint64_t NextUniform() noexcept
+    {
+        const size_t l{m_lane};
+        m_lane = (m_lane + 1) % RACE_STREAM_LANES;
+        const uint64_t s0{m_s0[l]};
+        uint64_t s1{m_s1[l]};
+        const uint64_t result{std::rotl(s0 + s1, 17) + s0};
+        s1 ^= s0;
+        m_s0[l] = std::rotl(s0, 49) ^ s1 ^ (s1 << 21);
+        m_s1[l] = std::rotl(s1, 28);
+        return result;
+    }
+
+    /** Same as ExponentialStream::Next(). */
+    constexpr double NextExponential() noexcept
+    {
+        return -BranchlessLog(1.0 - static_cast<double>(NextUniform() >> 11) * 0x1.0p-53);
+    }
+};
+
+/** The network of a race, as plain arrays in the memory of whichever device simulates it. */
+struct RaceNetwork {
+    uint32_t miner_count;
+    //! The threshold and alias of the column of each miner in the finder sampler (see FinderSampler).
+    const uint64_t* thresholds;
+    const uint32_t* aliases;
+    //! The propagation time of the blocks of each miner, in milliseconds.
+    const int64_t* propagation_ms;
+    //! How long each run lasts, in milliseconds.
+    int64_t duration_ms;
+};
+
+/** The arrays of a RaceNetwork, in host memory. */
+struct RaceTables {
+    std::vector<uint64_t> thresholds;
+    std::vector<uint32_t> aliases;
+    std::vector<int64_t> propagation_ms;
+    int64_t duration_ms;
+
+    explicit RaceTables(std::span<const Miner> miners, std::chrono::milliseconds duration)
+        : duration_ms{duration.count()}
+    {
+        const FinderSampler sampler{miners};
+        for (const auto& column: sampler.Columns()) {
+            thresholds.push_back(column.threshold);
+            aliases.push_back(column.alias);
+        }
+        for (const auto& miner: miners) propagation_ms.push_back(miner.propagation.count());
+    }
+
+    RaceNetwork Network() const
+    {
+        return {static_cast<uint32_t>(aliases.size()), thresholds.data(), aliases.data(), propagation_ms.data(), duration_ms};
+    }
+};
+
+/** An array whose elements are `stride` apart. The state of the races of a batch is interleaved this way, so that
+ * on a GPU neighbouring threads access neighbouring addresses. */
+template<typename T>
+struct Strided {
+    T* data;
+    size_t stride;
+
+    constexpr T* At(size_t i) const { return data + i * stride; }
+    constexpr T& operator[](size_t i) const { return *At(i); }
+};
+
+/** Where a race keeps its state: the blocks kept, in a ring of RACE_WINDOW slots as in BlockTree, the kept heights
+ * of the best chain, in a ring of as many slots as in BestChain, the blocks in flight, and the tip, stale blocks and
+ * blocks in the best chain of each miner. The last two are its results once it is done. */
+struct RaceState {
+    Strided<uint16_t> miner_ids;
+    Strided<int64_t> arrivals;
+    Strided<uint32_t> parents;
+    Strided<uint32_t> heights;
+    Strided<uint32_t> chain;
+    Strided<uint32_t> in_flight;
+    Strided<uint32_t> tips;
+    Strided<int32_t> stale_blocks;
+    Strided<uint32_t> blocks_found;
+};
+
+/** Where a batch of races keep their state, each field of all of them in its own array (see RaceState()), and the
+ * size of the best chain at the end of each. */
+struct RaceBuffers {
+    size_t races;
+    uint16_t* miner_ids;
+    int64_t* arrivals;
+    uint32_t* parents;
+    uint32_t* heights;
+    uint32_t* chain;
+    uint32_t* in_flight;
+    uint32_t* tips;
+    int32_t* stale_blocks;
+    uint32_t* blocks_found;
+    uint32_t* chain_sizes;
+};
+
+/** Lay out the buffers of a batch of races, for networks of the given size, in a single allocation of memory
+ * starting at `base` (which may be null to only get its size). Each buffer is 8-byte aligned. Returns the number of
+ * bytes needed. */
+size_t LayoutRaceBuffers(RaceBuffers& buffers, std::byte* base, size_t races, size_t miner_count)
+{
+    size_t offset{0};
+    const auto place{[&](auto*& buffer, size_t count) {
+        using T = std::remove_reference_t<decltype(*buffer)>;
+        buffer = base ? reinterpret_cast<T*>(base + offset) : nullptr;
+        offset += (count * sizeof(T) + 7) / 8 * 8;
+    }};
+    buffers.races = races;
+    place(buffers.miner_ids, races * RACE_WINDOW);
+    place(buffers.arrivals, races * RACE_WINDOW);
+    place(buffers.parents, races * RACE_WINDOW);
+    place(buffers.heights, races * RACE_WINDOW);
+    place(buffers.chain, races * RACE_WINDOW);
+    place(buffers.in_flight, races * RACE_MAX_IN_FLIGHT);
+    place(buffers.tips, races * miner_count);
+    place(buffers.stale_blocks, races * miner_count);
+    place(buffers.blocks_found, races * miner_count);
+    place(buffers.chain_sizes, races);
+    return offset;
+}
+
+/** The state of one race of a batch. */
+constexpr RaceState GetRaceState(const RaceBuffers& buffers, size_t race)
+{
+    const size_t stride{buffers.races};
+    return {
+        {buffers.miner_ids + race, stride}, {buffers.arrivals + race, stride}, {buffers.parents + race, stride},
+        {buffers.heights + race, stride}, {buffers.chain + race, stride}, {buffers.in_flight + race, stride},
+        {buffers.tips + race, stride}, {buffers.stale_blocks + race, stride}, {buffers.blocks_found + race, stride},
+    };
+}
+
+/** Buffers for a batch of races in host memory. */
+class RaceWorkspace
+{
+    std::vector<uint64_t> m_memory;
+    RaceBuffers m_buffers;
+
+public:
+    explicit RaceWorkspace(size_t races, size_t miner_count)
+        : m_memory(LayoutRaceBuffers(m_buffers, nullptr, races, miner_count) / sizeof(uint64_t))
+    {
+        LayoutRaceBuffers(m_buffers, reinterpret_cast<std::byte*>(m_memory.data()), races, miner_count);
+    }
+
+    const RaceBuffers& Buffers() const { return m_buffers; }
+};
+
+/** Same as FinderSampler::Pick(), from the columns of the network. */
+constexpr uint32_t PickRaceFinder(const RaceNetwork& network, uint64_t random)
+{
+    const auto product{static_cast<unsigned __int128>(random) * network.miner_count};
+    const auto column{static_cast<uint32_t>(product >> 64)};
+    return static_cast<uint64_t>(product) < network.thresholds[column] ? column : network.aliases[column];
+}
+
+/** Simulate a run of the network with the given seed, as RunSimulation() does with a SimulationContext for its
+ * miners whose blocks are final RACE_FINALITY_DEPTH deep. The number of stale blocks and of blocks in the best chain
+ * of each miner are left in the state. Returns the size of the best chain, or 0 if the run needed more blocks or
+ * blocks in flight than a race keeps, which does not happen with realistic propagation times.
+ *
+ * This follows RunHonestNetwork() step by step: changes to either must be made to the other too.
+ */
+constexpr uint32_t RunRace(const RaceNetwork& network, uint64_t seed, const RaceState& race)
+{
+    constexpr uint32_t MASK{RACE_WINDOW - 1};
+    const auto miner_id{[&](uint32_t block) -> uint32_t { return race.miner_ids[block & MASK]; }};
+    const auto arrival{[&](uint32_t block) { return race.arrivals[block & MASK]; }};
+    const auto parent{[&](uint32_t block) { return race.parents[block & MASK]; }};
+    const auto height{[&](uint32_t block) { return race.heights[block & MASK]; }};
+
+    // The blocks from `first` to `size` are kept, and the heights of the best chain from `chain_first` to its tip.
+    uint32_t first{0}, size{1}, chain_first{0}, chain_size{1}, in_flight{0};
+    uint32_t finalize_at{RACE_FINALITY_DEPTH};
+    race.miner_ids[0] = BlockTree::NO_MINER;
+    race.arrivals[0] = 0;
+    race.parents[0] = BlockTree::GENESIS;
+    race.heights[0] = 0;
+    race.chain[0] = BlockTree::GENESIS;
+    for (uint32_t i{0}; i < network.miner_count; ++i) {
+        race.tips[i] = BlockTree::GENESIS;
+        race.stale_blocks[i] = 0;
+        race.blocks_found[i] = 0;
+    }
+    const auto best_tip{[&] { return race.chain[(chain_size - 1) & MASK]; }};
+    const auto contains{[&](uint32_t block) {
+        const auto h{height(block)};
+        return h < chain_size && race.chain[h & MASK] == block;
+    }};
+
+    // BestChain::SetTip().
+    const auto set_tip{[&](uint32_t tip) {
+        uint32_t fork_point{tip};
+        while (!contains(fork_point)) fork_point = parent(fork_point);
+        for (uint32_t h{height(fork_point) + 1}; h < chain_size; ++h) --race.blocks_found[miner_id(race.chain[h & MASK])];
+        chain_size = height(tip) + 1;
+        for (uint32_t i{tip}; i != fork_point; i = parent(i)) {
+            race.chain[height(i) & MASK] = i;
+            ++race.blocks_found[miner_id(i)];
+        }
+    }};
+    // Miner::FastForward(), and Miner::MaybeReorg() to the tip of a longer best chain.
+    const auto leave_branch{[&](uint32_t miner, uint32_t new_tip) {
+        for (uint32_t i{race.tips[miner]}; !contains(i); i = parent(i)) {
+            if (miner_id(i) == miner) ++race.stale_blocks[miner];
+        }
+        race.tips[miner] = new_tip;
+    }};
+    const auto maybe_reorg{[&](uint32_t miner) {
+        if (chain_size > height(race.tips[miner]) + 1) leave_branch(miner, best_tip());
+    }};
+    const auto process_arrivals_before{[&](int64_t time) {
+        while (in_flight > 0) {
+            uint32_t earliest{0};
+            for (uint32_t i{1}; i < in_flight; ++i) {
+                const auto block{race.in_flight[i]}, earliest_block{race.in_flight[earliest]};
+                if (arrival(block) < arrival(earliest_block) || (arrival(block) == arrival(earliest_block) && block < earliest_block)) earliest = i;
+            }
+            const auto block{race.in_flight[earliest]};
+            if (arrival(block) >= time) break;
+            if (height(block) >= chain_size) set_tip(block);
+            race.in_flight[earliest] = race.in_flight[--in_flight];
+        }
+    }};
+
+    RaceStream block_interval{DeriveSeed(seed, 0)}, miner_picker{DeriveSeed(seed, 1)};
+    const auto next_interval{[&] { return static_cast<int64_t>(block_interval.NextExponential() * BLOCK_INTERVAL_MS); }};
+    int64_t block_time{next_interval()};
+    while (block_time < network.duration_ms) {
+        process_arrivals_before(block_time);
+        // FinalizeBlocks().
+        if (size >= finalize_at) {
+            finalize_at = size + RACE_FINALITY_DEPTH;
+            if (chain_size > chain_first + RACE_FINALITY_DEPTH + 1) {
+                const uint32_t final_height{chain_size - 1 - RACE_FINALITY_DEPTH};
+                const uint32_t final_block{race.chain[final_height & MASK]};
+                while (first < final_block && height(first) <= final_height) ++first;
+                for (uint32_t i{0}; i < network.miner_count; ++i) {
+                    if (race.tips[i] < first || height(race.tips[i]) < final_height) leave_branch(i, final_block);
+                }
+                chain_first = final_height;
+            }
+        }
+
+        const auto miner{PickRaceFinder(network, miner_picker.NextUniform())};
+        const auto tip{race.tips[miner]};
+        const bool on_tip{in_flight == 0 && (height(tip) + 1 < chain_size ? contains(tip) : tip == best_tip())};
+        if (on_tip) {
+            race.tips[miner] = best_tip();
+        } else {
+            maybe_reorg(miner);
+        }
+
+        // HonestStrategy::FoundBlock().
+        if (size - first == RACE_WINDOW) return 0;
+        const uint32_t block{size++};
+        race.miner_ids[block & MASK] = static_cast<uint16_t>(miner);
+        race.arrivals[block & MASK] = block_time + network.propagation_ms[miner];
+        race.parents[block & MASK] = race.tips[miner];
+        race.heights[block & MASK] = height(race.tips[miner]) + 1;
+        race.tips[miner] = block;
+
+        const auto next_block_time{block_time + next_interval()};
+        if (in_flight == 0 && arrival(block) < next_block_time) {
+            if (on_tip) {
+                // BestChain::Extend().
+                race.chain[chain_size++ & MASK] = block;
+                ++race.blocks_found[miner];
+            } else if (height(block) >= chain_size) {
+                set_tip(block);
+            }
+        } else {
+            if (in_flight == RACE_MAX_IN_FLIGHT) return 0;
+            race.in_flight[in_flight++] = block;
+        }
+        block_time = next_block_time;
+    }
+    process_arrivals_before(network.duration_ms);
+
+    for (uint32_t i{0}; i < network.miner_count; ++i) maybe_reorg(i);
+    return chain_size;
+}
+
+/** Add the stats of the miner at this position at the end of a race to its accumulator, the same as those
+ * RunSimulation() gives are. */
+constexpr void AddRaceStats(MinerStatsAccumulator& stats, const RaceState& race, uint32_t miner, uint32_t chain_size)
+{
+    const long blocks_found{race.blocks_found[miner]};
+    stats.blocks_found.Add(blocks_found);
+    stats.blocks_share.Add(chain_size == 1 ? 0.0 : static_cast<double>(blocks_found) / (chain_size - 1));
+    stats.stale_rate.Add(blocks_found == 0 ? 0.0 : static_cast<double>(race.stale_blocks[miner]) / blocks_found);
+}
+
+/** Simulate the race at this position in a batch, with the seed of run `first_run + race`. This is what each thread
+ * of the GPU backend's RunRacesKernel() does. */
+constexpr void RunBatchRace(const RaceNetwork& network, const RaceBuffers& buffers, uint64_t seed, int64_t first_run, size_t race)
+{
+    buffers.chain_sizes[race] = RunRace(network, DeriveSeed(seed, first_run + race), GetRaceState(buffers, race));
+}
+
+/** Add up the stats of a miner over a chunk of runs of a batch of races, the i-th of those of each miner of each
+ * chunk. This is what each thread of the GPU backend's ReduceRacesKernel() does. The runs of a chunk are added in
+ * order, as by RunScenarios(), so that the results are the exact same. */
+constexpr MinerStatsAccumulator ReduceBatchRaces(const RaceBuffers& buffers, uint32_t miner_count, size_t i)
+{
+    const size_t first_race{i / miner_count * RUNS_PER_CHUNK};
+    const size_t end_race{first_race + RUNS_PER_CHUNK < buffers.races ? first_race + RUNS_PER_CHUNK : buffers.races};
+    const auto miner{static_cast<uint32_t>(i % miner_count)};
+    MinerStatsAccumulator stats;
+    for (size_t race{first_race}; race < end_race; ++race) {
+        AddRaceStats(stats, GetRaceState(buffers, race), miner, buffers.chain_sizes[race]);
+    }
+    return stats;
+}
+
+/** Record the results of a run simulated by RunSimulation() in the state of a race, for instance of one which did
+ * not fit in it. Returns the size of the best chain. */
+uint32_t SetRaceResults(const SimulationContext& ctx, const RaceState& race)
+{
+    for (size_t i{0}; i < ctx.miners.size(); ++i) {
+        race.stale_blocks[i] = ctx.miners[i].stale_blocks;
+        race.blocks_found[i] = ctx.best_chain.BlocksFound(ctx.miners[i].id);
+    }
+    return static_cast<uint32_t>(ctx.best_chain.size());
+}
+
+/** Whether the runs of this scenario are races: its miners are all honest and their blocks reach everyone at once,
+ * and neither the hashrate nor the difficulty changes during the runs. The stats of races are not sampled, nor are
+ * rare events, and their blocks are final RACE_FINALITY_DEPTH deep. */
+bool IsRace(const Scenario& scenario, const SweepParams& params)
+{
+    return std::ranges::none_of(scenario.miners, &Miner::is_selfish) && scenario.latencies.empty()
+           && scenario.hashrate_changes.empty() && !params.retarget_period && !params.sample_interval
+           && !params.reorg_depth && !params.finality_depth;
+}
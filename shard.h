@@ -0,0 +1,498 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "sweep.h"
+
+//! Identifies shard files and the version of their format, so that nothing else is ever merged.
+static constexpr std::array<char, 8> SHARD_MAGIC{'B', 'P', 'S', 'H', 'A', 'R', 'D', '1'};
+//! Same for checkpoint files, so that nothing else is ever resumed.
+static constexpr std::array<char, 8> CHECKPOINT_MAGIC{'B', 'P', 'C', 'K', 'P', 'T', '0', '1'};
+//! Same for trace files, so that nothing else is ever replayed.
+static constexpr std::array<char, 8> TRACE_MAGIC{'B', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+/** Which runs of a sweep a shard simulates: the index-th of count contiguous slices of the runs of every
+ * scenario. Returns the index of its first run and its number of runs. */
+std::pair<int, int> ShardRuns(int runs, ShardSpec shard)
+{
+    const auto slice_start{[&](unsigned index) { return static_cast<int>(int64_t{runs} * index / shard.count); }};
+    return {slice_start(shard.index), slice_start(shard.index + 1) - slice_start(shard.index)};
+}
+
+/** The stats of a slice of the runs of every scenario of a sweep, as simulated by one shard, or of all the runs
+ * once the shards are merged. Along with them comes everything needed to report them and to check that shards
+ * were simulated with the same parameters. */
+struct ShardResults {
+    ShardSpec shard;
+    uint64_t seed;
+    //! How many runs there are per scenario over all the shards.
+    int runs;
+    std::chrono::milliseconds duration;
+    std::optional<std::chrono::milliseconds> sample_interval;
+    std::optional<uint32_t> retarget_period;
+    //! Blocks this deep are final and dropped (see SimulationContext::finality_depth), which changes the stats.
+    std::optional<uint32_t> finality_depth;
+    bool is_sweep;
+    std::vector<Scenario> scenarios;
+    //! For each scenario, the stats at the end of the runs then those of each sample, one row of miners each.
+    std::vector<std::vector<MinerStatsAccumulator>> stats;
+};
+
+/** Writes values to a shard file. They are stored as they are in memory: shards are meant to be merged on the same
+ * kind of machine they were simulated on. */
+struct ShardWriter {
+    static constexpr bool READING{false};
+    std::ostream& stream;
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    void Value(const T& value) { stream.write(reinterpret_cast<const char*>(&value), sizeof(value)); }
+};
+
+/** Reads values from a shard file, in the order they were written. */
+struct ShardReader {
+    static constexpr bool READING{true};
+    std::istream& stream;
+
+    template<typename T> requires std::is_arithmetic_v<T>
+    void Value(T& value) { stream.read(reinterpret_cast<char*>(&value), sizeof(value)); }
+};
+
+// Each of the types stored in a shard file is written by a Serialize() function, and read by the same one. The
+// values are const when writing.
+
+template<typename Ar, typename T> requires std::is_arithmetic_v<std::remove_const_t<T>>
+void Serialize(Ar& ar, T& value) { ar.Value(value); }
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, std::chrono::milliseconds>
+void Serialize(Ar& ar, T& duration)
+{
+    auto count{duration.count()};
+    ar.Value(count);
+    if constexpr (Ar::READING) duration = std::chrono::milliseconds{count};
+}
+
+template<typename Ar, typename T>
+void Serialize(Ar& ar, std::optional<T>& value);
+template<typename Ar, typename T>
+void Serialize(Ar& ar, const std::optional<T>& value);
+template<typename Ar, typename T>
+void Serialize(Ar& ar, std::vector<T>& values);
+template<typename Ar, typename T>
+void Serialize(Ar& ar, const std::vector<T>& values);
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, SelfishParams>
+void Serialize(Ar& ar, T& params)
+{
+    Serialize(ar, params.gamma);
+    Serialize(ar, params.trail_stubbornness);
+    Serialize(ar, params.lead_stubborn);
+    Serialize(ar, params.equal_fork_stubborn);
+}
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, Miner>
+void Serialize(Ar& ar, T& miner)
+{
+    Serialize(ar, miner.id);
+    Serialize(ar, miner.perc);
+    Serialize(ar, miner.propagation);
+    Serialize(ar, miner.is_selfish);
+    Serialize(ar, miner.selfish_params);
+}
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, LinkLatency>
+void Serialize(Ar& ar, T& link)
+{
+    Serialize(ar, link.sender);
+    Serialize(ar, link.receiver);
+    Serialize(ar, link.latency);
+}
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, HashrateChange>
+void Serialize(Ar& ar, T& change)
+{
+    Serialize(ar, change.time);
+    Serialize(ar, change.miner);
+    Serialize(ar, change.perc);
+    Serialize(ar, change.is_selfish);
+    Serialize(ar, change.selfish_params);
+}
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, Scenario>
+void Serialize(Ar& ar, T& scenario)
+{
+    Serialize(ar, scenario.miners);
+    Serialize(ar, scenario.latencies);
+    Serialize(ar, scenario.hashrate_changes);
+    Serialize(ar, scenario.propagation);
+    Serialize(ar, scenario.share);
+    Serialize(ar, scenario.selfish_share);
+}
+
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, MinerStatsAccumulator>
+void Serialize(Ar& ar, T& stats)
+{
+    for (auto* stat: {&stats.blocks_found, &stats.blocks_share, &stats.stale_rate}) {
+        Serialize(ar, stat->count);
+        Serialize(ar, stat->mean);
+        Serialize(ar, stat->m2);
+    }
+}
+
+/** An optional value is stored as whether it is set, followed by the value if it is. */
+template<typename Ar, typename T>
+void Serialize(Ar& ar, const std::optional<T>& value)
+{
+    static_assert(!Ar::READING);
+    const bool has_value{value.has_value()};
+    Serialize(ar, has_value);
+    if (value) Serialize(ar, *value);
+}
+
+template<typename Ar, typename T>
+void Serialize(Ar& ar, std::optional<T>& value)
+{
+    if constexpr (!Ar::READING) {
+        Serialize(ar, std::as_const(value));
+    } else {
+        bool has_value;
+        Serialize(ar, has_value);
+        value.reset();
+        // Miners can't be default-constructed, but optional values are only ever durations and numbers.
+        if (has_value) Serialize(ar, value.emplace());
+    }
+}
+
+/** A list of values is stored as its size, followed by each value. */
+template<typename Ar, typename T>
+void Serialize(Ar& ar, const std::vector<T>& values)
+{
+    static_assert(!Ar::READING);
+    const uint64_t size{values.size()};
+    Serialize(ar, size);
+    for (const auto& value: values) Serialize(ar, value);
+}
+
+template<typename Ar, typename T>
+void Serialize(Ar& ar, std::vector<T>& values)
+{
+    if constexpr (!Ar::READING) {
+        Serialize(ar, std::as_const(values));
+    } else {
+        uint64_t size{0};
+        Serialize(ar, size);
+        values.clear();
+        // Don't trust the size of a truncated or corrupt file to reserve storage.
+        for (uint64_t i{0}; i < size && ar.stream; ++i) {
+            if constexpr (std::is_same_v<T, Miner>) {
+                values.emplace_back(0, 0.0, 0ms);
+            } else {
+                values.emplace_back();
+            }
+            Serialize(ar, values.back());
+        }
+    }
+}
+
+/** Everything about the sweep which must be the same for all of its shards, that is all but the index of the
+ * shard and the stats. */
+template<typename Ar, typename T> requires std::same_as<std::remove_const_t<T>, ShardResults>
+void SerializeSweep(Ar& ar, T& results)
+{
+    Serialize(ar, results.shard.count);
+    Serialize(ar, results.seed);
+    Serialize(ar, results.runs);
+    Serialize(ar, results.duration);
+    Serialize(ar, results.sample_interval);
+    Serialize(ar, results.retarget_period);
+    Serialize(ar, results.finality_depth);
+    Serialize(ar, results.is_sweep);
+    Serialize(ar, results.scenarios);
+}
+
+/** Everything about the sweep in serialized form, to tell whether two shards or checkpoints are from the same. */
+std::string DescribeSweep(const ShardResults& results)
+{
+    std::ostringstream out;
+    ShardWriter ar{out};
+    SerializeSweep(ar, results);
+    return std::move(out).str();
+}
+
+/** Write the stats of a shard in a compact binary form, to be merged with those of the other shards. */
+void WriteShard(std::ostream& out, const ShardResults& results)
+{
+    ShardWriter ar{out};
+    out.write(SHARD_MAGIC.data(), SHARD_MAGIC.size());
+    Serialize(ar, results.shard.index);
+    SerializeSweep(ar, results);
+    Serialize(ar, results.stats);
+}
+
+/** Read the stats of a shard written by WriteShard(). Logs and returns nothing if it's not a valid shard file. */
+std::optional<ShardResults> ReadShard(std::istream& in, std::string_view name)
+{
+    std::array<char, SHARD_MAGIC.size()> magic{};
+    in.read(magic.data(), magic.size());
+    if (!in || magic != SHARD_MAGIC) {
+        std::cerr << "'" << name << "' is not a shard file." << std::endl;
+        return {};
+    }
+    ShardReader ar{in};
+    ShardResults results{};
+    Serialize(ar, results.shard.index);
+    SerializeSweep(ar, results);
+    Serialize(ar, results.stats);
+    // Every scenario has its stats, as many rows of them as there are samples, plus the final ones.
+    const size_t rows{1 + SampleCount(results.duration, results.sample_interval)};
+    const bool consistent{results.shard.index < results.shard.count && results.stats.size() == results.scenarios.size()
+                          && std::ranges::all_of(std::views::iota(size_t{0}, results.stats.size()), [&](size_t i) {
+                                 return results.stats[i].size() == rows * results.scenarios[i].miners.size();
+                             })};
+    if (!in || in.peek() != std::istream::traits_type::eof() || !consistent) {
+        std::cerr << "Shard file '" << name << "' is truncated or corrupt." << std::endl;
+        return {};
+    }
+    return results;
+}
+
+/** Merge the stats of all the shards of a sweep, in any order. Logs and returns nothing if some are missing, or
+ * if they are not from the same sweep. */
+std::optional<ShardResults> MergeShards(std::span<const ShardResults> shards)
+{
+    if (shards.empty()) {
+        std::cerr << "No shard to merge." << std::endl;
+        return {};
+    }
+    const auto sweep{DescribeSweep(shards[0])};
+    const auto count{shards[0].shard.count};
+    std::vector<const ShardResults*> by_index(count);
+    for (const auto& shard: shards) {
+        if (DescribeSweep(shard) != sweep) {
+            std::cerr << "Shard " << shard.shard.index << "/" << shard.shard.count << " is not from the same sweep as shard "
+                      << shards[0].shard.index << "/" << count << "." << std::endl;
+            return {};
+        }
+        if (by_index[shard.shard.index]) {
+            std::cerr << "Shard " << shard.shard.index << "/" << count << " is given twice." << std::endl;
+            return {};
+        }
+        by_index[shard.shard.index] = &shard;
+    }
+    if (const auto missing{std::ranges::find(by_index, nullptr)}; missing != by_index.end()) {
+        std::cerr << "Shard " << missing - by_index.begin() << "/" << count << " is missing." << std::endl;
+        return {};
+    }
+
+    // Merge in the order of the runs, as a single machine would have.
+    ShardResults merged{*by_index[0]};
+    merged.shard = ShardSpec{0, 1};
+    for (const auto* shard: std::span{by_index}.subspan(1)) {
+        for (size_t i{0}; i < merged.stats.size(); ++i) {
+            for (size_t j{0}; j < merged.stats[i].size(); ++j) {
+                merged.stats[i][j].Merge(shard->stats[i][j]);
+            }
+        }
+    }
+    return merged;
+}
+
+/** The progress of a sweep saved to a file, along with the sweep itself to check it's resumed with the same
+ * parameters. */
+struct Checkpoint {
+    //! The sweep being simulated, or the shard of it. Its stats are those of the progress.
+    ShardResults sweep;
+    //! Whether to stop early, which changes where the sweep ends.
+    std::optional<double> stale_rate_precision;
+    SweepProgress progress;
+};
+
+/** Save the progress of a sweep to a file. It is written next to it first then moved in place, so that the file
+ * is never left half-written if the process is killed. Logs and returns false if it can't be written. */
+bool WriteCheckpoint(const std::string& path, const ShardResults& sweep, std::optional<double> stale_rate_precision, const SweepProgress& progress)
+{
+    const auto temp_path{path + ".tmp"};
+    {
+        std::ofstream out{temp_path, std::ios::binary | std::ios::trunc};
+        ShardWriter ar{out};
+        out.write(CHECKPOINT_MAGIC.data(), CHECKPOINT_MAGIC.size());
+        Serialize(ar, sweep.shard.index);
+        SerializeSweep(ar, sweep);
+        Serialize(ar, stale_rate_precision);
+        Serialize(ar, progress.merged_chunks);
+        Serialize(ar, progress.stats);
+        if (!out.flush()) {
+            std::cerr << "Could not write checkpoint file '" << temp_path << "'." << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Could not move checkpoint file '" << temp_path << "' to '" << path << "'." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/** Read the progress of a sweep saved by WriteCheckpoint(). Logs and returns nothing if it's not a valid checkpoint
+ * file. */
+std::optional<Checkpoint> ReadCheckpoint(const std::string& path)
+{
+    std::ifstream in{path, std::ios::binary};
+    std::array<char, CHECKPOINT_MAGIC.size()> magic{};
+    in.read(magic.data(), magic.size());
+    if (!in || magic != CHECKPOINT_MAGIC) {
+        std::cerr << "'" << path << "' is not a checkpoint file." << std::endl;
+        return {};
+    }
+    ShardReader ar{in};
+    Checkpoint checkpoint{};
+    auto& sweep{checkpoint.sweep};
+    auto& progress{checkpoint.progress};
+    Serialize(ar, sweep.shard.index);
+    SerializeSweep(ar, sweep);
+    Serialize(ar, checkpoint.stale_rate_precision);
+    Serialize(ar, progress.merged_chunks);
+    Serialize(ar, progress.stats);
+    const size_t rows{1 + SampleCount(sweep.duration, sweep.sample_interval)};
+    const bool valid_shard{sweep.shard.index < sweep.shard.count};
+    const int shard_runs{valid_shard ? ShardRuns(sweep.runs, sweep.shard).second : 0};
+    const int chunks_per_scenario{(shard_runs + RUNS_PER_CHUNK - 1) / RUNS_PER_CHUNK};
+    const bool consistent{valid_shard && progress.merged_chunks.size() == sweep.scenarios.size()
+                          && progress.stats.size() == sweep.scenarios.size()
+                          && std::ranges::all_of(std::views::iota(size_t{0}, progress.stats.size()), [&](size_t i) {
+                                 return progress.stats[i].size() == rows * sweep.scenarios[i].miners.size()
+                                     && progress.merged_chunks[i] >= 0 && progress.merged_chunks[i] <= chunks_per_scenario;
+                             })};
+    if (!in || in.peek() != std::istream::traits_type::eof() || !consistent) {
+        std::cerr << "Checkpoint file '" << path << "' is truncated or corrupt." << std::endl;
+        return {};
+    }
+    return checkpoint;
+}
+
+/** Whether a checkpoint was saved by the same sweep, or the same shard of it, with the same options: finality depth
+ * and early stop included, as they change its stats. */
+bool IsSameSweep(const Checkpoint& checkpoint, const ShardResults& sweep, std::optional<double> stale_rate_precision)
+{
+    return DescribeSweep(checkpoint.sweep) == DescribeSweep(sweep) && checkpoint.sweep.shard.index == sweep.shard.index
+        && checkpoint.stale_rate_precision == stale_rate_precision;
+}
+
+/** Everything needed to simulate the traced runs of a sweep again: the sweep itself, without its stats, and the
+ * options which change what happens during the runs but not their stats. */
+struct TraceHeader {
+    ShardResults sweep;
+    std::optional<uint32_t> reorg_depth;
+};
+
+/** The events of a run of a scenario, as traced. The run is identified by its index among all the runs. */
+struct TracedRun {
+    uint32_t scenario;
+    int32_t run;
+    std::vector<TraceEvent> events;
+};
+
+/** Write the events of the traced runs of a sweep to a file, as the workers hand them over (see SweepTraces). The
+ * file starts with the header, then each run is written at once, in the order they end: its scenario, its index and
+ * its number of events, followed by the events as they are in memory. */
+class TraceFile
+{
+    std::string m_path;
+    std::ofstream m_file;
+    std::mutex m_mutex;
+
+public:
+    /** Create the file and write the header. Logs and returns false if it can't. */
+    bool Open(const std::string& path, const TraceHeader& header)
+    {
+        m_path = path;
+        m_file.open(path, std::ios::binary | std::ios::trunc);
+        ShardWriter ar{m_file};
+        m_file.write(TRACE_MAGIC.data(), TRACE_MAGIC.size());
+        SerializeSweep(ar, header.sweep);
+        Serialize(ar, header.reorg_depth);
+        if (!m_file) {
+            std::cerr << "Could not write trace file '" << path << "'." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /** Append the events of a traced run. May be called from any thread. */
+    void Write(size_t scenario, int run, std::span<const TraceEvent> events)
+    {
+        const std::lock_guard lock{m_mutex};
+        ShardWriter ar{m_file};
+        const auto index{static_cast<uint32_t>(scenario)};
+        const auto run_index{static_cast<int32_t>(run)};
+        const uint64_t count{events.size()};
+        Serialize(ar, index);
+        Serialize(ar, run_index);
+        Serialize(ar, count);
+        m_file.write(reinterpret_cast<const char*>(events.data()), static_cast<std::streamsize>(events.size_bytes()));
+    }
+
+    /** Make sure everything was written. Logs and returns false if it wasn't. */
+    bool Close()
+    {
+        m_file.close();
+        if (!m_file) {
+            std::cerr << "Could not write trace file '" << m_path << "'." << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+/** Read the header of a trace file written by TraceFile. Logs and returns nothing if it's not a valid trace file. */
+std::optional<TraceHeader> ReadTraceHeader(std::istream& in, std::string_view name)
+{
+    std::array<char, TRACE_MAGIC.size()> magic{};
+    in.read(magic.data(), magic.size());
+    if (!in || magic != TRACE_MAGIC) {
+        std::cerr << "'" << name << "' is not a trace file." << std::endl;
+        return {};
+    }
+    ShardReader ar{in};
+    TraceHeader header{};
+    SerializeSweep(ar, header.sweep);
+    Serialize(ar, header.reorg_depth);
+    if (!in || header.sweep.scenarios.empty()) {
+        std::cerr << "Trace file '" << name << "' is truncated or corrupt." << std::endl;
+        return {};
+    }
+    return header;
+}
+
+/** Read the next traced run of a trace file, after its header. Returns false at the end of the file, or if it is
+ * truncated or corrupt in which case it logs and the stream fails. */
+bool ReadTracedRun(std::istream& in, TracedRun& traced, std::string_view name)
+{
+    if (in.peek() == std::istream::traits_type::eof()) return false;
+    ShardReader ar{in};
+    uint64_t count{0};
+    Serialize(ar, traced.scenario);
+    Serialize(ar, traced.run);
+    Serialize(ar, count);
+    // Don't trust the size of a truncated or corrupt file to reserve storage.
+    traced.events.clear();
+    while (in && traced.events.size() < count) {
+        const size_t start{traced.events.size()};
+        traced.events.resize(start + std::min<uint64_t>(count - start, 1 << 16));
+        in.read(reinterpret_cast<char*>(traced.events.data() + start), static_cast<std::streamsize>((traced.events.size() - start) * sizeof(TraceEvent)));
+    }
+    if (!in) {
+        std::cerr << "Trace file '" << name << "' is truncated or corrupt." << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -1,231 +1,1893 @@
 #include <algorithm>
+#include <bit>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <functional>
 #include <optional>
 #include <limits>
 #include <memory>
 #include <random>
 #include <ranges>
 #include <span>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "stats.h"
 #include "xoroshiro128++.h"
 
+// Build with -DSIM_INSTRUMENT=1 to count what the engine does during each run (see RunCounters), or with
+// -DSIM_INSTRUMENT=2 to also time its main steps. Without it, none of this is compiled in.
+#ifndef SIM_INSTRUMENT
+#define SIM_INSTRUMENT 0
+#endif
+#if SIM_INSTRUMENT >= 2 && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 using namespace std::chrono_literals;
 
+//! Whether the engine counts events, reorgs and blocks in flight during each run.
+static constexpr bool INSTRUMENT{SIM_INSTRUMENT >= 1};
+//! Whether it also measures how long its main steps take.
+static constexpr bool INSTRUMENT_TIMERS{SIM_INSTRUMENT >= 2};
+
 //! Expected time between blocks. Used as parameter for the exponential distribution we are sampling from.
 static constexpr std::chrono::seconds BLOCK_INTERVAL{600};
-//! We use integers in [0;100] for percentages. This is the multiplier to map them to [0; uint64_t::MAX].
-static constexpr uint64_t PERC_MULTIPLIER{std::numeric_limits<uint64_t>::max() / 100};
+//! Same as above, as the mean of the distribution in milliseconds.
+static constexpr double BLOCK_INTERVAL_MS(std::chrono::milliseconds(BLOCK_INTERVAL).count());
+//! The difficulty changes by at most this factor at each retarget, as in Bitcoin.
+static constexpr double MAX_RETARGET_FACTOR{4.0};
 //! Arrival time to use for unpublished blocks by a selfish miner.
 static constexpr std::chrono::milliseconds SELFISH_ARRIVAL{std::chrono::milliseconds::max()};
 
-struct Block {
-    //! Which miner created this block.
-    unsigned miner_id;
-    //! At what point will all other miners receive this block.
-    std::chrono::milliseconds arrival;
+//! Position of a block in the BlockTree, which uniquely identifies it.
+using BlockIndex = uint32_t;
+
+/** A sequence of values addressed by their position from the start, of which only the most recent ones may be
+ * kept. Dropping the oldest values frees their slot for the next ones, so that a sequence which keeps growing only
+ * ever needs room for as many values as are kept at once. Storage is a power of two slots, grown when full.
+ */
+template<typename T>
+class RingBuffer {
+    std::vector<T> m_slots;
+    //! Position of a value modulo the number of slots, which is a power of two.
+    size_t m_mask{0};
+    //! Position of the oldest value kept, and one past the most recent.
+    size_t m_first{0};
+    size_t m_end{0};
+
+public:
+    //! The value at this position, which must be kept. Not checked, as blocks are looked up all the time.
+    const T& operator[](size_t pos) const { return m_slots[pos & m_mask]; }
+    T& operator[](size_t pos) { return m_slots[pos & m_mask]; }
+    const T& back() const { return (*this)[m_end - 1]; }
+
+    //! One past the position of the most recent value, as for a vector which kept all of them.
+    size_t size() const { return m_end; }
+    //! Position of the oldest value kept.
+    size_t first() const { return m_first; }
+
+    void push_back(const T& value) {
+        if (m_end - m_first == m_slots.size()) Grow(m_slots.size() + 1);
+        m_slots[m_end++ & m_mask] = value;
+    }
+
+    /** Drop or append values so that the most recent one is at `end - 1`. Appended values are set to `value`. */
+    void resize(size_t end, const T& value = {}) {
+        assert(end >= m_first);
+        if (end - m_first > m_slots.size()) Grow(end - m_first);
+        for (; m_end < end; ++m_end) m_slots[m_end & m_mask] = value;
+        m_end = end;
+    }
+
+    /** Make room for keeping this many values at once. */
+    void reserve(size_t capacity) {
+        if (capacity > m_slots.size()) Grow(capacity);
+    }
+
+    /** Forget about the values before this position. */
+    void DropBefore(size_t pos) {
+        assert(pos >= m_first && pos <= m_end);
+        m_first = pos;
+    }
+
+    /** Drop all values and start again from the given position, keeping the allocated storage. */
+    void clear(size_t first = 0) { m_first = m_end = first; }
+
+private:
+    void Grow(size_t capacity) {
+        std::vector<T> slots(std::bit_ceil(capacity));
+        const size_t mask{slots.size() - 1};
+        for (size_t pos{m_first}; pos < m_end; ++pos) slots[pos & mask] = m_slots[pos & m_mask];
+        m_slots = std::move(slots);
+        m_mask = mask;
+    }
+};
+
+/** All the blocks found during a simulation, shared by all miners. Blocks are only ever appended and each
+ * points to its parent, forming a tree rooted at the genesis block. A miner's local chain is the path from
+ * its tip back to the genesis, so switching to another chain never requires copying any block.
+ *
+ * A block is identified by its position in the tree, so two blocks are the same if and only if they have the same
+ * index. Each of their fields is stored in its own array, so that walking a chain to count the blocks of a miner
+ * only touches the parents and miner ids: 6 bytes per block, 18 in total instead of 24 for a struct of them.
+ *
+ * The oldest blocks may be dropped once they can't matter anymore (see FinalizeBlocks()), in which case only the
+ * blocks from First() on are kept. Blocks keep their index, and the genesis stays a valid sentinel.
+ */
+class BlockTree {
+    //! Which miner created each block.
+    std::vector<uint16_t> m_miner_ids;
+    //! At what point each block will have reached all other miners.
+    std::vector<std::chrono::milliseconds> m_arrivals;
+    //! Position of the block each one builds on. The genesis block is its own parent.
+    std::vector<BlockIndex> m_parents;
+    //! Number of blocks between each one and the genesis block.
+    std::vector<uint32_t> m_heights;
+    //! The blocks are stored in a ring buffer (see RingBuffer), all fields at the same slot.
+    size_t m_mask{0};
+    size_t m_first{0};
+    size_t m_size{0};
+
+public:
+    //! The genesis block is always the first one.
+    static constexpr BlockIndex GENESIS{0};
+    //! Miner id of the genesis block, which was not created by any miner.
+    static constexpr uint16_t NO_MINER{std::numeric_limits<uint16_t>::max()};
+
+    BlockTree() { clear(); }
+
+    /** Add a block found by the given miner on top of the given parent. Returns its position in the tree. */
+    BlockIndex Append(unsigned miner_id, std::chrono::milliseconds arrival, BlockIndex parent) {
+        assert(parent >= First() && parent < size() && miner_id < NO_MINER);
+        if (m_size - m_first == m_parents.size()) Grow(m_parents.size() + 1);
+        const size_t slot{m_size & m_mask};
+        m_miner_ids[slot] = static_cast<uint16_t>(miner_id);
+        m_arrivals[slot] = arrival;
+        m_parents[slot] = parent;
+        m_heights[slot] = Height(parent) + 1;
+        return static_cast<BlockIndex>(m_size++);
+    }
+
+    // Blocks must be kept, which is not checked as they are looked up all the time.
+    unsigned MinerId(BlockIndex block) const { return m_miner_ids[block & m_mask]; }
+    std::chrono::milliseconds Arrival(BlockIndex block) const { return m_arrivals[block & m_mask]; }
+    BlockIndex Parent(BlockIndex block) const { return m_parents[block & m_mask]; }
+    uint32_t Height(BlockIndex block) const { return m_heights[block & m_mask]; }
+
+    /** Publish a block, which will have reached all other miners at the given time. */
+    void SetArrival(BlockIndex block, std::chrono::milliseconds arrival) { m_arrivals[block & m_mask] = arrival; }
+
+    //! Number of blocks ever appended, including the genesis and the dropped ones.
+    size_t size() const { return m_size; }
+    //! The oldest block kept.
+    BlockIndex First() const { return static_cast<BlockIndex>(m_first); }
+
+    /** Make room for this many blocks at once. */
+    void reserve(size_t capacity) {
+        if (capacity > m_parents.size()) Grow(capacity);
+    }
+
+    /** Drop the blocks before this one. None of them must be looked at anymore. */
+    void DropBefore(BlockIndex block) {
+        assert(block >= m_first && block <= m_size);
+        m_first = block;
+    }
+
+    /** Drop all blocks but the genesis, keeping the allocated storage. The genesis block is always received
+     * immediately. */
+    void clear() {
+        m_first = m_size = 0;
+        if (m_parents.empty()) Grow(1);
+        m_miner_ids[0] = NO_MINER;
+        m_arrivals[0] = 0s;
+        m_parents[0] = GENESIS;
+        m_heights[0] = 0;
+        m_size = 1;
+    }
+
+private:
+    /** Move the blocks kept to storage for at least this many. */
+    void Grow(size_t capacity) {
+        const size_t slots{std::bit_ceil(capacity)}, mask{slots - 1};
+        const auto move_to{[&](auto& field) {
+            std::remove_reference_t<decltype(field)> moved(slots);
+            for (size_t i{m_first}; i < m_size; ++i) moved[i & mask] = field[i & m_mask];
+            field = std::move(moved);
+        }};
+        move_to(m_miner_ids);
+        move_to(m_arrivals);
+        move_to(m_parents);
+        move_to(m_heights);
+        m_mask = mask;
+    }
+};
+
+/** The chain with the most work among all published blocks, as the list of its blocks indexed by height.
+ * This allows to tell in constant time whether a block is part of the best chain. The number of blocks of each
+ * miner in the chain is kept up to date as it changes, so it can be queried in constant time too.
+ *
+ * Only the blocks from First() on may be kept, the ones below being final (see FinalizeBlocks()). They are still
+ * counted in the size of the chain and in the number of blocks of their miner.
+ */
+class BestChain {
+    RingBuffer<BlockIndex> m_chain;
+    //! Number of blocks in the chain found by each miner, indexed by miner id.
+    std::vector<uint32_t> m_blocks_found;
+
+public:
+    BestChain() { m_chain.push_back(BlockTree::GENESIS); }
+
+    explicit BestChain(const BlockTree& tree, BlockIndex tip): BestChain() {
+        SetTip(tree, tip);
+    }
+
+    BlockIndex Tip() const { return m_chain.back(); }
+
+    //! The block of the best chain at this height, which must be at most its tip's and at least First().
+    BlockIndex operator[](size_t height) const { return m_chain[height]; }
+
+    //! Number of blocks in the best chain, including the genesis.
+    size_t size() const { return m_chain.size(); }
+    //! Height of the lowest block kept.
+    size_t First() const { return m_chain.first(); }
+
+    void reserve(size_t capacity, size_t miner_count) {
+        m_chain.reserve(capacity);
+        if (m_blocks_found.size() < miner_count) m_blocks_found.resize(miner_count);
+    }
+
+    /** Go back to the genesis block, keeping the allocated storage. */
+    void clear() {
+        m_chain.clear();
+        m_chain.push_back(BlockTree::GENESIS);
+        std::ranges::fill(m_blocks_found, 0);
+    }
+
+    /** Forget about the blocks below this height, which will never be switched away from. */
+    void DropBelow(size_t height) { m_chain.DropBefore(height); }
+
+    /** Start over from the given block at the given height, forgetting about the chain below it. The number of
+     * blocks found by each miner is left as is, and so only meaningful for changes past this block. */
+    void Rebase(BlockIndex block, size_t height) {
+        m_chain.clear(height);
+        m_chain.push_back(block);
+    }
+
+    bool Contains(const BlockTree& tree, BlockIndex block) const {
+        const auto height{tree.Height(block)};
+        return height < m_chain.size() && m_chain[height] == block;
+    }
+
+    /** Number of blocks found by this miner in the best chain. */
+    uint32_t BlocksFound(unsigned miner_id) const {
+        return miner_id < m_blocks_found.size() ? m_blocks_found[miner_id] : 0;
+    }
+
+    /** Append a block on top of the tip. */
+    void Extend(const BlockTree& tree, BlockIndex block) {
+        assert(tree.Parent(block) == Tip());
+        m_chain.push_back(block);
+        const auto miner_id{tree.MinerId(block)};
+        if (miner_id >= m_blocks_found.size()) m_blocks_found.resize(miner_id + 1);
+        ++m_blocks_found[miner_id];
+    }
+
+    /** Switch to the chain ending at the given tip. Only the blocks past the fork point are touched. */
+    void SetTip(const BlockTree& tree, BlockIndex tip) {
+        BlockIndex fork_point{tip};
+        while (!Contains(tree, fork_point)) fork_point = tree.Parent(fork_point);
+        for (size_t height{tree.Height(fork_point) + 1}; height < m_chain.size(); ++height) {
+            --m_blocks_found[tree.MinerId(m_chain[height])];
+        }
+        m_chain.resize(tree.Height(tip) + 1);
+        for (BlockIndex i{tip}; i != fork_point; i = tree.Parent(i)) {
+            m_chain[tree.Height(i)] = i;
+            const auto miner_id{tree.MinerId(i)};
+            if (miner_id >= m_blocks_found.size()) m_blocks_found.resize(miner_id + 1);
+            ++m_blocks_found[miner_id];
+        }
+    }
+};
 
-    explicit Block(unsigned id, std::chrono::milliseconds time): miner_id{id}, arrival{time} {}
+/** Something happening at a given time which may change the state of the miners. */
+struct Event {
+    enum class Type : uint8_t {
+        //! The next block was found, by a miner which is yet to be picked.
+        BlockFound,
+        //! A published block reaches all the miners.
+        BlockArrival,
+        //! A published block reaches a strategic miner, when latencies differ between pairs of miners.
+        BlockReceived,
+        //! The hashrate of some miners changes, as scheduled.
+        ScheduledChange,
+    };
 
-    //! Create the genesis block, not created by any miner and always received immediately.
-    static Block Genesis() {
-        return Block(std::numeric_limits<unsigned>::max(), 0s);
+    std::chrono::milliseconds time;
+    Type type;
+    //! The miner receiving the block, for BlockReceived events.
+    uint16_t receiver{0};
+    //! The arriving block, for arrival events.
+    BlockIndex block;
+
+    //! Events happen in chronological order. A block found at the same time as another one arrives is found without
+    //! knowledge of the arriving block.
+    auto operator<=>(const Event& other) const = default;
+};
+
+/** Pending events, the earliest one first. Unlike std::priority_queue, its storage can be reserved and is kept
+ * when it is cleared. */
+class EventQueue {
+    std::vector<Event> m_heap;
+
+public:
+    void push(const Event& event) {
+        m_heap.push_back(event);
+        std::push_heap(m_heap.begin(), m_heap.end(), std::greater<Event>{});
+    }
+
+    Event pop() {
+        std::pop_heap(m_heap.begin(), m_heap.end(), std::greater<Event>{});
+        const Event event{m_heap.back()};
+        m_heap.pop_back();
+        return event;
     }
 
-    bool operator==(const Block& other) const {
-        // FIXME: should we have a block uid for when a single miner finds two blocks in a row with the same timestamp?
-        return miner_id == other.miner_id && arrival == other.arrival;
+    /** Move the pending event of this type to the time returned by the given function of its current time. Linear
+     * in the number of pending events. */
+    template<typename F>
+    void Reschedule(Event::Type type, F new_time) {
+        const auto event{std::ranges::find(m_heap, type, &Event::type)};
+        assert(event != m_heap.end());
+        event->time = new_time(event->time);
+        std::make_heap(m_heap.begin(), m_heap.end(), std::greater<Event>{});
     }
+
+    const Event& top() const { return m_heap.front(); }
+    bool empty() const { return m_heap.empty(); }
+    void reserve(size_t capacity) { m_heap.reserve(capacity); }
+    void clear() { m_heap.clear(); }
+};
+
+/** Variants of the selfish mining strategy. The defaults give the strategy from the 2013 "Majority is not enough"
+ * paper in its worst case, the others implement its gamma parameter and the "stubborn" variants from the 2016
+ * "Stubborn Mining" paper (https://eprint.iacr.org/2015/796), which can be combined.
+ */
+struct SelfishParams {
+    //! Share of the honest hashrate mining on top of our block during a 1-block race (gamma in the 2013 paper).
+    float gamma{0.0};
+    //! How many blocks behind the best chain we keep mining on our own branch, hoping to catch up ("trail
+    //! stubborn", T_j in the 2016 paper). With 0 we give up as soon as the best chain is longer.
+    uint8_t trail_stubbornness{0};
+    //! When about to lose a lead of 2 or more, reveal only enough blocks to match the best chain instead of all
+    //! of them ("lead stubborn", L in the 2016 paper).
+    bool lead_stubborn{false};
+    //! When finding a block during a 1-block race, keep it private instead of publishing it to win the race
+    //! ("equal-fork stubborn", F in the 2016 paper).
+    bool equal_fork_stubborn{false};
 };
 
 struct Miner {
     //! Miner identifier used to track which miner created a certain block.
     unsigned id;
-    //! Share of the total network hashrate controlled by the miner, as an integer between 0 and 100.
-    uint64_t perc;
+    //! Share of the total network hashrate controlled by the miner, as a percentage.
+    double perc;
     //! The time for blocks produced by this miner to reach all other miners.
     std::chrono::milliseconds propagation;
-    //! Local chain on the miner's full node. May differ slightly between miners due to propagation time.
-    std::vector<Block> chain;
-    //! The next time this miner will find a block, sampled from an exponential distribution parameterized by its share of total network hashrate.
-    std::chrono::milliseconds next_block;
+    //! Tip of the local chain on the miner's full node. May differ slightly between miners due to propagation time.
+    BlockIndex tip;
     //! Number of blocks this miner created that were reorged out.
     int stale_blocks;
-    //! Whether this miner follows a (worst case) selfish mining strategy as described in section 3.2 of https://arxiv.org/pdf/1311.0243.
+    //! Number of blocks at the tip of the local chain this miner did not publish yet. Only selfish miners ever
+    //! withhold blocks. Called `privateBranchLen` in the 2013 paper's algorithm.
+    uint32_t private_blocks;
+    //! Whether this miner follows a selfish mining strategy as described in section 3.2 of https://arxiv.org/pdf/1311.0243,
+    //! implemented by SelfishStrategy. Otherwise it follows HonestStrategy.
     bool is_selfish;
+    //! Which variant of the selfish mining strategy this miner follows, if it is selfish.
+    SelfishParams selfish_params;
 
-    explicit Miner(unsigned id_, uint64_t perc_, std::chrono::milliseconds prop, bool selfish = false)
-        : id{id_}, perc{perc_}, propagation{prop}, chain{{Block::Genesis()}}, stale_blocks{0}, is_selfish{selfish}
+    explicit Miner(unsigned id_, double perc_, std::chrono::milliseconds prop, bool selfish = false, SelfishParams params = {})
+        : id{id_}, perc{perc_}, propagation{prop}, tip{BlockTree::GENESIS}, stale_blocks{0}, private_blocks{0}, is_selfish{selfish}, selfish_params{params}
     {}
 
-    /** Add a block found at the given block time to this miner's local chain. */
-    void FoundBlock(std::chrono::milliseconds block_time, size_t best_chain_size) {
-        if (is_selfish) {
-            // A selfish miner always mines on top of its private chain, except in the case of a 1-block
-            // race whereby if he wins the race he'll publish both blocks.
-            const bool is_race{SelfishBlocks() == 1 && best_chain_size == chain.size()};
-            if (is_race) {
-                chain.back().arrival = block_time + propagation;
-                chain.emplace_back(id, block_time + propagation);
-            } else {
-                chain.emplace_back(id, SELFISH_ARRIVAL);
-            }
-        } else {
-            chain.emplace_back(id, block_time + propagation);
+    /** Number of blocks in this miner's local chain, including the genesis. */
+    size_t ChainSize(const BlockTree& tree) const {
+        return tree.Height(tip) + 1;
+    }
+
+    /** Length of a selfish miner's private branch. */
+    size_t SelfishBlocks() const { return private_blocks; }
+
+    /** Mine on top of the given block, for instance to set up a miner's state. Unlike the other ways of changing a
+     * miner's tip, this counts the private blocks on the new chain. */
+    void SetTip(const BlockTree& tree, BlockIndex new_tip) {
+        tip = new_tip;
+        private_blocks = 0;
+        // Private blocks are always ever at the end of the chain.
+        for (BlockIndex i{tip}; tree.Arrival(i) == SELFISH_ARRIVAL; i = tree.Parent(i)) {
+            ++private_blocks;
         }
     }
 
-    /** Count the number of not-yet-propagated blocks in this miner's local chain. */
-    int UnpublishedBlocks(std::chrono::milliseconds cur_time) const {
-        int unpublished_blocks{0};
-        for (const auto& block: std::views::reverse(chain)) {
-            // Arrival time is monotonic, don't bother doing useless work.
-            if (block.arrival <= cur_time) {
-                break;
-            }
-            unpublished_blocks++;
+    /** Get the tip of the chain from this miner, except for the block that were not yet propagated. */
+    BlockIndex PublishedTip(const BlockTree& tree, std::chrono::milliseconds cur_time) const {
+        BlockIndex i{tip};
+        while (tree.Arrival(i) > cur_time) i = tree.Parent(i);
+        return i;
+    }
+
+    /** Number of our blocks which would become stale if we switched to the best chain now, which we do if it is
+     * longer than ours. */
+    int PendingStaleBlocks(const BlockTree& tree, const BestChain& best_chain) const {
+        // Of course we assume all blocks are at the same difficulty.
+        if (best_chain.size() <= ChainSize(tree)) return 0;
+
+        // Find the point of agreement between the two chains. Our blocks past this point are stale.
+        int pending{0};
+        for (BlockIndex i{tip}; !best_chain.Contains(tree, i); i = tree.Parent(i)) {
+            if (tree.MinerId(i) == id) pending++;
         }
-        return unpublished_blocks;
+        return pending;
     }
 
-    /** The earliest block published by this miner that has not yet propagated to the network, if any. */
-    std::optional<std::chrono::milliseconds> NextArrival(std::chrono::milliseconds cur_time) const {
-        std::optional<std::chrono::milliseconds> earliest_arrival{};
-        for (const auto& block: std::views::reverse(chain)) {
-            // Arrival time is monotonic.
-            if (block.arrival <= cur_time) {
-                break;
+    /** Switch to the best fully-propagated chain if it is longer than ours. */
+    void MaybeReorg(const BlockTree& tree, const BestChain& best_chain) {
+        if (best_chain.size() <= ChainSize(tree)) return;
+        stale_blocks += PendingStaleBlocks(tree, best_chain);
+
+        // Adopt the best chain.
+        tip = best_chain.Tip();
+        private_blocks = 0;
+    }
+
+    /** Mine on top of the given block instead of our tip, at the same height. Our blocks on the branch we leave
+     * are stale. */
+    void SwitchTo(const BlockTree& tree, BlockIndex new_tip) {
+        assert(tree.Height(new_tip) == tree.Height(tip));
+        for (BlockIndex i{tip}, j{new_tip}; i != j; i = tree.Parent(i), j = tree.Parent(j)) {
+            if (tree.MinerId(i) == id) stale_blocks++;
+        }
+        tip = new_tip;
+        private_blocks = 0;
+    }
+
+    /** Switch to a longer chain ending at the given tip. Our blocks on the branch we leave are stale. The best
+     * chain is used as a landmark to find the fork point without walking down the common part of the chains. */
+    void ReorgTo(const BlockTree& tree, const BestChain& best_chain, BlockIndex new_tip) {
+        assert(tree.Height(new_tip) > tree.Height(tip));
+        for (BlockIndex i{tip}, j{new_tip}; i != j; ) {
+            if (tree.Height(i) < tree.Height(j)) {
+                if (!best_chain.Contains(tree, j)) {
+                    j = tree.Parent(j);
+                } else if (best_chain.Contains(tree, i)) {
+                    break; // Both are on the best chain, ours is the fork point.
+                } else {
+                    j = best_chain[tree.Height(i)];
+                }
+                continue;
             }
-            earliest_arrival = block.arrival;
+            // A block at least as high as the other chain's and not part of it is on the branch we leave.
+            if (tree.MinerId(i) == id) stale_blocks++;
+            i = tree.Parent(i);
         }
-        return earliest_arrival;
+        tip = new_tip;
+        private_blocks = 0;
     }
 
-    /** Length of a selfish miner's private branch. Called `privateBranchLen` in the paper's algorithm. */
-    size_t SelfishBlocks() const {
-        size_t selfish_blocks{0};
-        for (const auto& block: std::views::reverse(chain)) {
-            // Selfish blocks are always ever at the end of the chain.
-            if (block.arrival != SELFISH_ARRIVAL) {
-                break;
+    /** Switch to a final block of the best chain, higher than our tip, before the blocks below it are dropped. Our
+     * blocks which are not part of the best chain are stale, as they would be once we caught up with it. */
+    void FastForward(const BlockTree& tree, const BestChain& best_chain, BlockIndex final_block) {
+        assert(best_chain.Contains(tree, final_block) && tree.Height(final_block) >= tree.Height(tip));
+        for (BlockIndex i{tip}; !best_chain.Contains(tree, i); i = tree.Parent(i)) {
+            if (tree.MinerId(i) == id) stale_blocks++;
+        }
+        tip = final_block;
+        private_blocks = 0;
+    }
+
+    /** Count of blocks found by this miner in the best chain. */
+    long BlocksFound(const BestChain& best_chain) const {
+        return best_chain.BlocksFound(id);
+    }
+
+    /** Compute the share of the blocks in the best chain found by this miner. */
+    double BlocksFoundShare(const BestChain& best_chain) const {
+        if (best_chain.size() == 1) return 0.0;
+        return static_cast<double>(BlocksFound(best_chain)) / (best_chain.size() - 1); // Don't count the genesis
+    }
+
+    /** Proportion of stale blocks per block found by this miner. */
+    double StaleRate(const BestChain& best_chain) const {
+        const long found_blocks{BlocksFound(best_chain)};
+        if (found_blocks == 0) return 0.0;
+        return static_cast<double>(stale_blocks) / found_blocks;
+    }
+};
+
+/** A change to the share of the hashrate and strategy of a miner, at the same time of every run. For instance a
+ * miner joins the network by going from a share of 0, leaves it by going to 0, or switches to selfish mining. */
+struct HashrateChange {
+    std::chrono::milliseconds time;
+    unsigned miner;
+    //! The new share of the network hashrate of the miner, in the same unit as the initial shares.
+    double perc;
+    //! The new strategy of the miner.
+    bool is_selfish;
+    SelfishParams selfish_params;
+};
+
+/** The time it takes for blocks to travel from a miner to another one, overriding the sender's propagation time. */
+struct LinkLatency {
+    unsigned sender;
+    unsigned receiver;
+    std::chrono::milliseconds latency;
+};
+
+/** The time it takes for blocks to travel between every pair of miners, so that for instance well-connected large
+ * pools can see each other's blocks sooner than the rest of the network. By default a miner's blocks reach every
+ * other miner after its propagation time. Only the links which override it are stored, by sender, so that networks
+ * of thousands of miners don't need a latency for each pair.
+ */
+class LatencyMatrix {
+    //! The latency from each sender to the receivers without a link of their own.
+    std::vector<std::chrono::milliseconds> m_propagation;
+    //! The links overriding it, sorted by sender then receiver, and where those of each sender start.
+    std::vector<LinkLatency> m_links;
+    std::vector<uint32_t> m_first_link;
+    //! For each sender, the time for its blocks to reach all other miners.
+    std::vector<std::chrono::milliseconds> m_reach_all;
+    //! The longest latency between any two miners.
+    std::chrono::milliseconds m_max{0};
+    //! Whether every sender's blocks reach all other miners at once.
+    bool m_uniform{true};
+
+public:
+    explicit LatencyMatrix(std::span<const Miner> miners, std::span<const LinkLatency> links = {})
+        : m_propagation(miners.size()), m_first_link(miners.size() + 1), m_reach_all(miners.size())
+    {
+        std::ranges::transform(miners, m_propagation.begin(), &Miner::propagation);
+        // A link set twice has the last latency set, which stays after the other once sorted.
+        std::vector<LinkLatency> sorted(links.begin(), links.end());
+        std::ranges::stable_sort(sorted, {}, [](const auto& link) { return std::pair{link.sender, link.receiver}; });
+        for (const auto& link: sorted) {
+            assert(link.sender < miners.size() && link.receiver < miners.size() && link.sender != link.receiver);
+            if (!m_links.empty() && m_links.back().sender == link.sender && m_links.back().receiver == link.receiver) {
+                m_links.back() = link;
+                continue;
             }
-            ++selfish_blocks;
+            m_links.push_back(link);
+            ++m_first_link[link.sender + 1];
+        }
+        for (size_t sender{0}; sender < miners.size(); ++sender) {
+            m_first_link[sender + 1] += m_first_link[sender];
+            const auto sender_links{Links(sender)};
+            // The propagation time applies to the receivers without a link, if any is left.
+            const bool default_latency{sender_links.size() + 1 < miners.size()};
+            auto& reach_all{m_reach_all[sender]};
+            reach_all = default_latency ? m_propagation[sender] : 0ms;
+            for (const auto& link: sender_links) reach_all = std::max(reach_all, link.latency);
+            m_max = std::max(m_max, reach_all);
+            m_uniform = m_uniform && (!default_latency || m_propagation[sender] == reach_all)
+                        && std::ranges::all_of(sender_links, [&](const auto& link) { return link.latency == reach_all; });
         }
-        return selfish_blocks;
     }
 
-    /** Get the chain from this miner, except for the block that were not yet propagated. */
-    std::span<const Block> PublishedChain(std::chrono::milliseconds cur_time) const {
-        int unpublished_blocks{UnpublishedBlocks(cur_time)};
-        return std::span{chain}.first(chain.size() - unpublished_blocks);
+    std::chrono::milliseconds operator()(unsigned sender, unsigned receiver) const {
+        // A miner knows about its own blocks right away.
+        if (sender == receiver) return 0ms;
+        // Only a handful of senders have links, to a handful of receivers.
+        for (uint32_t i{m_first_link[sender]}; i < m_first_link[sender + 1]; ++i) {
+            if (m_links[i].receiver == receiver) return m_links[i].latency;
+        }
+        return m_propagation[sender];
     }
 
-    /** Replace our chain if another miner's fully-propagated one is longer. */
-    void MaybeReorg(std::span<const Block> best_chain) {
-        // Of course we assume all blocks are at the same difficulty.
-        if (best_chain.size() <= chain.size()) return;
+    /** The links overriding the propagation time of this sender, by receiver. */
+    std::span<const LinkLatency> Links(unsigned sender) const {
+        return std::span{m_links}.subspan(m_first_link[sender], m_first_link[sender + 1] - m_first_link[sender]);
+    }
 
-        // Find the point of agreement between the two chains.
-        for (size_t i{chain.size()}; i > 0; --i) {
-            if (chain.back() == best_chain[i - 1]) {
-                break;
+    /** The time for blocks from this sender to reach all other miners. */
+    std::chrono::milliseconds ReachAll(unsigned sender) const { return m_reach_all[sender]; }
+
+    /** The longest latency between any two miners. */
+    std::chrono::milliseconds Max() const { return m_max; }
+
+    /** Whether every miner's blocks reach all other miners at once, in which case all miners agree on the best
+     * chain and latencies between pairs don't need to be tracked. */
+    bool IsUniform() const { return m_uniform; }
+
+    /** When a published block reaches the given miner. Its arrival is when it reached all miners. */
+    std::chrono::milliseconds ReceivedAt(const BlockTree& tree, BlockIndex block, unsigned receiver) const {
+        const auto sender{tree.MinerId(block)};
+        return tree.Arrival(block) - m_reach_all[sender] + (*this)(sender, receiver);
+    }
+};
+
+/** Tell which published blocks a miner received at a given time, when latencies differ between pairs of miners.
+ *
+ * Rather than processing the arrival of every block at every miner, which would cost O(n) per block for n miners,
+ * honest miners only look for the best chain they can see when they find a block. Their tip serves as a cache of
+ * the best chain they saw last time: only the blocks above it need to be looked at, and we start from the highest.
+ * Blocks are indexed by height for this purpose. Only the blocks still in flight are ever invisible to a miner,
+ * so there is only a handful to go through whatever the number of miners.
+ */
+class ArrivalIndex {
+    //! The last block indexed at each height. Each block then points to the previous one at the same height.
+    RingBuffer<BlockIndex> m_last_at_height;
+    //! For each block, the previous one at the same height. The genesis is used as a sentinel.
+    RingBuffer<BlockIndex> m_prev_at_height;
+
+public:
+    ArrivalIndex() { clear(); }
+
+    void reserve(size_t capacity) {
+        m_last_at_height.reserve(capacity);
+        m_prev_at_height.reserve(capacity);
+    }
+
+    /** Forget about all blocks but the genesis, keeping the allocated storage. */
+    void clear() {
+        m_last_at_height.clear();
+        m_prev_at_height.clear();
+        m_last_at_height.push_back(BlockTree::GENESIS);
+        m_prev_at_height.push_back(BlockTree::GENESIS);
+    }
+
+    /** Forget about the blocks dropped from the tree and the heights below the given one, which must not be
+     * looked at anymore. The blocks above that height must all be kept in the tree. Must be called after Update(). */
+    void DropBefore(const BlockTree& tree, size_t height) {
+        assert(m_prev_at_height.size() == tree.size());
+        m_prev_at_height.DropBefore(tree.First());
+        m_last_at_height.DropBefore(height);
+    }
+
+    /** Index the blocks appended to the tree since the last call. */
+    void Update(const BlockTree& tree) {
+        for (auto i{static_cast<BlockIndex>(m_prev_at_height.size())}; i < tree.size(); ++i) {
+            const auto height{tree.Height(i)};
+            if (height == m_last_at_height.size()) {
+                m_last_at_height.push_back(BlockTree::GENESIS);
             }
-            if (chain.back().miner_id == id) stale_blocks++;
-            chain.pop_back();
+            m_prev_at_height.push_back(m_last_at_height[height]);
+            m_last_at_height[height] = i;
         }
+    }
 
-        // Adopt the best chain.
-        assert(best_chain.size() > chain.size()); // Checked above.
-        for (size_t i{chain.size()}; i < best_chain.size(); ++i) {
-            chain.push_back(best_chain[i]);
+    /** Whether the given miner received this block strictly before the given time, along with all its ancestors.
+     * A block arriving at the same time as another one is found was not known to its finder. */
+    static bool Received(const BlockTree& tree, const LatencyMatrix& latencies, BlockIndex block, unsigned receiver,
+                         std::chrono::milliseconds time) {
+        for (BlockIndex i{block}; i != BlockTree::GENESIS; i = tree.Parent(i)) {
+            if (tree.Arrival(i) == SELFISH_ARRIVAL) return false;
+            // Blocks are published after their parent, so if this one was published long enough ago for it to
+            // reach everyone, so were all its ancestors.
+            const auto published{tree.Arrival(i) - latencies.ReachAll(tree.MinerId(i))};
+            if (published + latencies.Max() < time) return true;
+            if (published + latencies(tree.MinerId(i), receiver) >= time) return false;
+        }
+        return true;
+    }
+
+    /** The tip of the best chain the given miner can see at this time, or its own tip if none is longer. Among
+     * chains of the same size, the one which reached it first is picked. Must be called after Update(). */
+    BlockIndex BestVisibleTip(const BlockTree& tree, const LatencyMatrix& latencies, const Miner& miner,
+                              std::chrono::milliseconds time) const {
+        assert(m_prev_at_height.size() == tree.size());
+        for (auto height{m_last_at_height.size() - 1}; height > tree.Height(miner.tip); --height) {
+            BlockIndex first_seen{BlockTree::GENESIS};
+            for (BlockIndex i{m_last_at_height[height]}; i != BlockTree::GENESIS; i = m_prev_at_height[i]) {
+                if (!Received(tree, latencies, i, miner.id, time)) continue;
+                // Blocks are visited from the last to the first indexed, which breaks ties.
+                if (first_seen == BlockTree::GENESIS || latencies.ReceivedAt(tree, i, miner.id) <= latencies.ReceivedAt(tree, first_seen, miner.id)) {
+                    first_seen = i;
+                }
+            }
+            if (first_seen != BlockTree::GENESIS) return first_seen;
+        }
+        return miner.tip;
+    }
+};
+
+/** Mining strategies, as policies for the simulation engine. A strategy decides on top of which block a miner
+ * mines and when it publishes its blocks. The engine is specialized for the strategies of the miners on the
+ * network once per run, so that honest miners don't pay for the logic of others.
+ */
+
+/** Mine on top of the best chain, switching to it when it gets longer than ours, and publish blocks right away. */
+struct HonestStrategy {
+    /** Add a block found at the given block time to this miner's local chain. */
+    static void FoundBlock(Miner& miner, BlockTree& tree, const BestChain& /*best_chain*/, std::chrono::milliseconds block_time)
+    {
+        miner.tip = tree.Append(miner.id, block_time + miner.propagation, miner.tip);
+    }
+};
+
+/** Keep found blocks private and selectively reveal them, in order to make the rest of the network waste its
+ * hashrate. The strategy implemented here follows the one described in the 2013 "Majority is not enough"
+ * research paper (https://arxiv.org/pdf/1311.0243), and its stubborn variants depending on the miner's
+ * SelfishParams. Gamma is implemented by the engine, as it is about which block honest miners mine on.
+ */
+struct SelfishStrategy {
+    /** Whether this miner is racing the best chain with a block of its own at the same height (state 0' in the
+     * 2013 paper). */
+    static bool IsRacing(const Miner& miner, const BlockTree& tree, const BestChain& best_chain)
+    {
+        return miner.ChainSize(tree) == best_chain.size() && tree.MinerId(miner.tip) == miner.id
+            && !best_chain.Contains(tree, miner.tip);
+    }
+
+    /** Whether to keep mining on our own branch although the best chain is longer. */
+    static bool KeepsTrailing(const Miner& miner, const BlockTree& tree, const BestChain& best_chain)
+    {
+        const size_t chain_size{miner.ChainSize(tree)};
+        return best_chain.size() > chain_size && best_chain.size() - chain_size <= miner.selfish_params.trail_stubbornness
+            && tree.MinerId(miner.tip) == miner.id && !best_chain.Contains(tree, miner.tip);
+    }
+
+    /** Publish all of this miner's private blocks. */
+    static void RevealAll(Miner& miner, BlockTree& tree, std::chrono::milliseconds cur_time)
+    {
+        for (BlockIndex i{miner.tip}; miner.private_blocks > 0; --miner.private_blocks, i = tree.Parent(i)) {
+            tree.SetArrival(i, cur_time + miner.propagation);
         }
     }
 
-    /** If this miner follows the selfish mining strategy, choose whether to selectively reveal some
-     * blocks. The strategy implemented here follows the one described in the 2013 "Majority is not enough"
-     * research paper in the worst case scenario, ie Gamma=0 (in the case of a 1-block race no other miner
-     * mines on top of a selfish miner's block). Paper available at https://arxiv.org/pdf/1311.0243.
-     */
-    void MaybeSelfishReveal(std::span<const Block> best_chain, std::chrono::milliseconds cur_time) {
-        if (!is_selfish) return;
+    /** Add a block found at the given block time to this miner's local chain. */
+    static void FoundBlock(Miner& miner, BlockTree& tree, const BestChain& best_chain, std::chrono::milliseconds block_time)
+    {
+        // Switch to the best chain if it got longer since we last found a block, unless we are stubborn.
+        if (!KeepsTrailing(miner, tree, best_chain)) miner.MaybeReorg(tree, best_chain);
+
+        // A selfish miner always mines on top of its private chain, except in the case of a 1-block
+        // race whereby if he wins the race he'll publish both blocks. A trailing miner which catches up with
+        // the best chain publishes its branch to start a race.
+        const bool is_race{IsRacing(miner, tree, best_chain)};
+        miner.tip = tree.Append(miner.id, SELFISH_ARRIVAL, miner.tip);
+        ++miner.private_blocks;
+        if ((is_race && !miner.selfish_params.equal_fork_stubborn) || (!is_race && miner.ChainSize(tree) == best_chain.size())) {
+            RevealAll(miner, tree, block_time);
+        }
+    }
 
-        // If their chain is already longer than ours, we have to switch. The selfish blocks will be
-        // overwritten by MaybeReorg().
-        if (best_chain.size() > chain.size()) return;
+    /** Choose whether to selectively reveal some blocks. Returns the most recent of the revealed blocks, if any. */
+    static std::optional<BlockIndex> MaybeReveal(Miner& miner, BlockTree& tree, const BestChain& best_chain, std::chrono::milliseconds cur_time)
+    {
+        // If their chain is already longer than ours, we have to switch (unless we are stubborn). The
+        // selfish blocks will be overwritten by MaybeReorg().
+        const size_t best_chain_size{best_chain.size()};
+        if (best_chain_size > miner.ChainSize(tree)) return {};
 
         // If our chain is still at least the same size, we keep mining on it. Note that even when they
         // are the same size, we may be mining on top of a different block still in the case of a 1-block
         // race.
         // If they are catching up, reveal as many blocks as they have just found.
-        const size_t selfish_count{SelfishBlocks()};
-        const size_t current_lead{chain.size() - best_chain.size()};
+        const size_t selfish_count{miner.SelfishBlocks()};
+        const size_t current_lead{miner.ChainSize(tree) - best_chain_size};
         if (selfish_count > current_lead) {
             size_t reveal_count{selfish_count - current_lead};
             // Special case: if we had a significant lead and they are almost caught up reveal everything
             // now to avoid a race.
-            if (selfish_count > 1 && current_lead == 1) {
+            if (selfish_count > 1 && current_lead == 1 && !miner.selfish_params.lead_stubborn) {
                 reveal_count = selfish_count;
             }
-            // Broadcast as many blocks as necessary by setting their arrival time.
-            for (size_t i{0}; i < reveal_count; ++i) {
-                chain.at(chain.size() - selfish_count + i).arrival = cur_time + propagation;
+            // Broadcast as many blocks as necessary (the oldest ones first) by setting their arrival time.
+            BlockIndex revealed{miner.tip};
+            for (size_t j{0}; j < selfish_count - reveal_count; ++j) revealed = tree.Parent(revealed);
+            for (BlockIndex i{revealed}, j{0}; j < reveal_count; ++j, i = tree.Parent(i)) {
+                tree.SetArrival(i, cur_time + miner.propagation);
             }
+            miner.private_blocks -= reveal_count;
+            return revealed;
         }
+        return {};
     }
 
-    /** Let this miner know about the longest published chain. */
-    void NotifyBestChain(std::span<const Block> best_chain, std::chrono::milliseconds cur_time) {
-        MaybeSelfishReveal(best_chain, cur_time);
-        MaybeReorg(best_chain);
+    /** Let this miner know about the longest published chain. Returns the most recent block it published
+     * in response, if any. */
+    static std::optional<BlockIndex> OnBestChain(Miner& miner, BlockTree& tree, const BestChain& best_chain, std::chrono::milliseconds cur_time)
+    {
+        const auto revealed{MaybeReveal(miner, tree, best_chain, cur_time)};
+        if (!KeepsTrailing(miner, tree, best_chain)) miner.MaybeReorg(tree, best_chain);
+        return revealed;
     }
+};
+
+/** Draw the time between the last and the next block from the given exponential distribution. */
+std::chrono::milliseconds NextBlockInterval(RNG& rng)
+{
+    const auto exporand{std::llround(rng.exporand(std::chrono::nanoseconds(BLOCK_INTERVAL).count()))};
+    assert(exporand >= 0.0); // Must not go backward.
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(exporand));
+}
+
+/** Same as above, from a batch of pre-generated draws, for blocks found every `mean_ms` on average. */
+std::chrono::milliseconds NextBlockInterval(ExponentialStream& stream, double mean_ms)
+{
+    const auto exporand{stream.Next()};
+    assert(exporand >= 0.0); // Must not go backward.
+    return std::chrono::milliseconds{static_cast<int64_t>(exporand * mean_ms)};
+}
 
-    /** Count of published blocks found by this miner. */
-    long BlocksFound(std::chrono::milliseconds cur_time) const {
-        return std::count_if(chain.begin(), chain.end(), [&](const Block& b) {
-            return b.miner_id == id && b.arrival <= cur_time;
-        });
+/** Same as above, at the initial difficulty and hashrate. */
+std::chrono::milliseconds NextBlockInterval(ExponentialStream& stream)
+{
+    const auto exporand{stream.Next()};
+    assert(exporand >= 0.0); // Must not go backward.
+    return std::chrono::milliseconds{static_cast<int64_t>(exporand * BLOCK_INTERVAL_MS)};
+}
+
+//! How often to draw the time until the next block from the short intervals, which keep a fork going, when
+//! sampling rare events (see NextTiltedBlockInterval()). Every other draw of a fork makes its weight up to
+//! 1 / (1 - REORG_TILT) times larger, and forks go through several: much higher and the weights vary too much for
+//! their average to be of any use.
+static constexpr double REORG_TILT{0.3};
+
+/** Same as above, for estimating the probability of rare events by importance sampling. The interval is drawn below
+ * `window` with probability REORG_TILT, and from its actual distribution otherwise. The draw is then less likely
+ * by a factor its density over the mixture's, which `weight` is multiplied by: the mixture is defensive, so this
+ * factor is at most 1 / (1 - REORG_TILT) whatever the window. */
+std::chrono::milliseconds NextTiltedBlockInterval(ExponentialStream& stream, UniformStream& uniform, double mean_ms,
+                                                  std::chrono::milliseconds window, double& weight)
+{
+    const double window_ms(window.count());
+    const double p_short{-std::expm1(-window_ms / mean_ms)};
+    const double u{static_cast<double>(uniform.Next() >> 11) * 0x1p-53};
+    const double interval{u < REORG_TILT ? -mean_ms * std::log1p(-u / REORG_TILT * p_short) : stream.Next() * mean_ms};
+    assert(interval >= 0.0); // Must not go backward.
+    weight /= (1.0 - REORG_TILT) + (interval < window_ms ? REORG_TILT / p_short : 0.0);
+    return std::chrono::milliseconds{static_cast<int64_t>(interval)};
+}
+
+/** When the next block is found, if the expected time between blocks changed by this ratio at the given time. As
+ * block intervals are memoryless, rescaling the time left is the same as drawing it anew at the new rate. */
+std::chrono::milliseconds RescaleBlockTime(std::chrono::milliseconds block_time, std::chrono::milliseconds now, double ratio)
+{
+    return now + std::chrono::milliseconds{static_cast<int64_t>((block_time - now).count() * ratio)};
+}
+
+/** Draw which miner found a block in constant time whatever the number of miners, using Walker's alias method.
+ * Each miner is given a column, all columns being equally likely to be picked. A column is split between the
+ * miner it belongs to and another one (its alias) such as the overall probability of picking each miner is its
+ * share of the network hashrate. Shares do not need to add up to exactly 100%, they are normalized.
+ */
+class FinderSampler {
+public:
+    struct Column {
+        //! Probability of picking the miner this column belongs to rather than its alias, mapped to [0; uint64_t::MAX].
+        uint64_t threshold;
+        //! Position of the alias in the list of miners.
+        uint32_t alias;
+    };
+
+private:
+    std::vector<Column> m_columns;
+    //! Scratch space to build the columns, kept so that rebuilding them does not allocate.
+    std::vector<double> m_scaled;
+    std::vector<uint32_t> m_small, m_large;
+
+public:
+    explicit FinderSampler(std::span<const Miner> miners) { Rebuild(miners); }
+
+    /** Set the probabilities of picking each miner from their current shares of the hashrate. Does not allocate
+     * unless there are more miners than the last time. */
+    void Rebuild(std::span<const Miner> miners) {
+        const size_t count{miners.size()};
+        double total_perc{0.0};
+        for (const auto& miner: miners) total_perc += miner.perc;
+        assert(count > 0 && total_perc > 0.0);
+
+        // Scale the probabilities such as a miner with an average share of the hashrate has a probability of 1.
+        // Miners below that fill their column up with the excess of miners above it (Vose's construction).
+        auto& scaled{m_scaled};
+        auto& small{m_small};
+        auto& large{m_large};
+        scaled.resize(count);
+        small.clear();
+        large.clear();
+        small.reserve(count);
+        large.reserve(count);
+        for (uint32_t i{0}; i < count; ++i) {
+            scaled[i] = miners[i].perc * count / total_perc;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        m_columns.resize(count);
+        while (!small.empty() && !large.empty()) {
+            const auto small_index{small.back()}, large_index{large.back()};
+            small.pop_back();
+            m_columns[small_index] = {ToThreshold(scaled[small_index]), large_index};
+            scaled[large_index] = (scaled[large_index] + scaled[small_index]) - 1.0;
+            if (scaled[large_index] < 1.0) {
+                large.pop_back();
+                small.push_back(large_index);
+            }
+        }
+        // Whatever is left has a probability of 1, up to rounding errors.
+        for (const auto i: large) m_columns[i] = {std::numeric_limits<uint64_t>::max(), i};
+        for (const auto i: small) m_columns[i] = {std::numeric_limits<uint64_t>::max(), i};
     }
 
-    /** Compute the share of (published) blocks found by this miner. */
-    double BlocksFoundShare(std::chrono::milliseconds cur_time) const {
-        size_t published_blocks{chain.size() - UnpublishedBlocks(cur_time)};
-        long found_blocks{BlocksFound(cur_time)};
-        return static_cast<double>(found_blocks) / (published_blocks - 1); // -1 for the genesis
+    /** Map a uniformly distributed integer to the position of a miner. The high bits of the product with the
+     * number of columns select a column, the low bits are uniformly distributed within it. */
+    size_t Pick(uint64_t random) const {
+        const auto product{static_cast<unsigned __int128>(random) * m_columns.size()};
+        const auto& column{m_columns[static_cast<size_t>(product >> 64)]};
+        // Without a branch, as which way it would go is random.
+        const size_t index{static_cast<size_t>(&column - m_columns.data())};
+        const size_t keep{static_cast<uint64_t>(product) < column.threshold};
+        return column.alias ^ ((index ^ column.alias) & (0 - keep));
     }
 
-    /** Proportion of stale blocks per block found by this miner. */
-    double StaleRate(std::chrono::milliseconds cur_time) const {
-        long found_blocks{BlocksFound(cur_time)};
-        if (found_blocks == 0) return 0.0;
-        return static_cast<double>(stale_blocks) / found_blocks;
+    /** The column of each miner, in the same order as the miners. */
+    std::span<const Column> Columns() const { return m_columns; }
+
+    /** Probability of picking the miner at this position. Only useful for tests. */
+    double Probability(size_t index) const {
+        double prob{0.0};
+        for (size_t i{0}; i < m_columns.size(); ++i) {
+            const double keep{std::ldexp(static_cast<double>(m_columns[i].threshold), -64)};
+            if (i == index) prob += keep;
+            if (m_columns[i].alias == index) prob += 1.0 - keep;
+        }
+        return prob / m_columns.size();
+    }
+
+private:
+    static uint64_t ToThreshold(double prob) {
+        if (prob >= 1.0) return std::numeric_limits<uint64_t>::max();
+        return static_cast<uint64_t>(std::ldexp(prob, 64));
     }
 };
 
-/** Draw the time between the last and the next block from the given exponential distribution. */
-std::chrono::milliseconds NextBlockInterval(RNG& rng)
+/** Pick which miner found the last block based on its hashrate and a uniform distribution. Returns its
+ * position in the list of miners the sampler was created with. */
+size_t PickFinder(const FinderSampler& sampler, RNG& rng)
 {
-    const auto exporand{std::llround(rng.exporand(std::chrono::nanoseconds(BLOCK_INTERVAL).count()))};
-    assert(exporand >= 0.0); // Must not go backward.
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(exporand));
+    return sampler.Pick(rng.rand64());
+}
+
+/** Same as above, from a batch of pre-generated uniform integers. */
+size_t PickFinder(const FinderSampler& sampler, UniformStream& stream)
+{
+    return sampler.Pick(stream.Next());
+}
+
+/** Statistics about a miner's revenue in function of the best chain. */
+struct MinerStats {
+    //! The count of blocks found by this miner in the best chain.
+    long blocks_found;
+    //! The ratio of blocks found by this miner in the best chain.
+    double blocks_share;
+    //! The ratio of blocks found in the best chain over stale blocks for this miner.
+    double stale_rate;
+
+    /** Compute revenue statistics for this miner given the best chain. */
+    explicit MinerStats(const Miner& miner, const BestChain& best_chain)
+        : blocks_found{miner.BlocksFound(best_chain)}, blocks_share{miner.BlocksFoundShare(best_chain)},
+          stale_rate{miner.StaleRate(best_chain)}
+    {}
+
+    /** Same as above in the middle of a run, when the miner may not have switched to the best chain yet. */
+    explicit MinerStats(const Miner& miner, const BlockTree& tree, const BestChain& best_chain)
+        : MinerStats(miner, best_chain)
+    {
+        const int stale_blocks{miner.stale_blocks + miner.PendingStaleBlocks(tree, best_chain)};
+        stale_rate = blocks_found == 0 ? 0.0 : static_cast<double>(stale_blocks) / blocks_found;
+    }
+
+    explicit MinerStats(): blocks_found{0}, blocks_share{0.0}, stale_rate{0.0} {}
+};
+
+/** Statistics about a miner's revenue over many simulation runs. */
+struct MinerStatsAccumulator {
+    RunningStats blocks_found;
+    RunningStats blocks_share;
+    RunningStats stale_rate;
+
+    void Add(const MinerStats& stats)
+    {
+        blocks_found.Add(stats.blocks_found);
+        blocks_share.Add(stats.blocks_share);
+        stale_rate.Add(stats.stale_rate);
+    }
+
+    void Merge(const MinerStatsAccumulator& other)
+    {
+        blocks_found.Merge(other.blocks_found);
+        blocks_share.Merge(other.blocks_share);
+        stale_rate.Merge(other.stale_rate);
+    }
+};
+
+/** A timestamp for the instrumentation timers: the CPU's time stamp counter where there is one, nanoseconds
+ * otherwise. */
+uint64_t ReadTicks()
+{
+#if SIM_INSTRUMENT >= 2 && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/** Add the ticks elapsed during its lifetime to a counter, if the timers are compiled in. A no-op otherwise. */
+class ScopedTimer {
+    uint64_t& m_ticks;
+    uint64_t m_start;
+
+public:
+    explicit ScopedTimer(uint64_t& ticks): m_ticks{ticks}, m_start{INSTRUMENT_TIMERS ? ReadTicks() : 0} {}
+    ~ScopedTimer() { if constexpr (INSTRUMENT_TIMERS) m_ticks += ReadTicks() - m_start; }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+/** How many blocks the best chain dropped when it switched from the previous tip to its current one. */
+uint64_t ReorgDepth(const BlockTree& tree, const BestChain& best_chain, BlockIndex previous_tip)
+{
+    uint64_t depth{0};
+    for (BlockIndex i{previous_tip}; !best_chain.Contains(tree, i); i = tree.Parent(i)) ++depth;
+    return depth;
+}
+
+/** What the engine did during a run, or a set of runs once merged. Only recorded in instrumented builds (see
+ * INSTRUMENT), to tell which shapes of networks make a run slow. */
+struct RunCounters {
+    //! How many runs these counters are the sum of.
+    uint64_t runs{0};
+    //! Events processed: blocks found, blocks reaching all or some miners, and scheduled changes.
+    uint64_t events{0};
+    //! How many times the best chain switched to another branch, and how many blocks it dropped in total.
+    uint64_t reorgs{0};
+    uint64_t reorged_blocks{0};
+    //! The most blocks dropped from the best chain at once.
+    uint64_t max_reorg_depth{0};
+    //! How many blocks are currently published but did not reach all miners, and the most at once.
+    uint64_t in_flight{0};
+    uint64_t max_in_flight{0};
+    //! Ticks (see ReadTicks()) spent picking block finders, updating the best chain as blocks arrive, and letting
+    //! miners catch up with it or react to it.
+    uint64_t pick_finder_ticks{0};
+    uint64_t best_chain_ticks{0};
+    uint64_t notify_ticks{0};
+    //! How many reorgs of at least the depth of interest happen per run, each weighted, when sampling rare events
+    //! (see SimulationContext::reorg_depth). Recorded in every build in this case.
+    RunningStats deep_reorgs{};
+
+    void SetInFlight(uint64_t count)
+    {
+        in_flight = count;
+        max_in_flight = std::max(max_in_flight, count);
+    }
+
+    /** Record the best chain switching to a new tip, dropping this many blocks (see ReorgDepth()). */
+    void OnNewTip(uint64_t depth)
+    {
+        if (depth == 0) return;
+        ++reorgs;
+        reorged_blocks += depth;
+        max_reorg_depth = std::max(max_reorg_depth, depth);
+    }
+
+    /** Add the counters of a run to those of the previous ones. */
+    void Merge(const RunCounters& other)
+    {
+        runs += other.runs;
+        events += other.events;
+        reorgs += other.reorgs;
+        reorged_blocks += other.reorged_blocks;
+        max_reorg_depth = std::max(max_reorg_depth, other.max_reorg_depth);
+        max_in_flight = std::max(max_in_flight, other.max_in_flight);
+        pick_finder_ticks += other.pick_finder_ticks;
+        best_chain_ticks += other.best_chain_ticks;
+        notify_ticks += other.notify_ticks;
+        deep_reorgs.Merge(other.deep_reorgs);
+    }
+};
+
+/** Something which happened during a run, as recorded when tracing it. Events have a fixed width, so that
+ * recording one is only appending it to a buffer and traces can be written and indexed as they are in memory. They
+ * are recorded in the order the engine processes them, which is chronological. */
+struct TraceEvent {
+    enum class Type : uint8_t {
+        //! A miner found a block.
+        Found,
+        //! A miner published a block, along with the blocks below it it withheld if any. They reach everyone at the
+        //! block's arrival time.
+        Published,
+        //! A block reached a strategic miner, or everyone (NO_MINER) in which case it may extend the best chain.
+        Received,
+        //! The best chain switched to the branch of a block which just reached everyone, dropping some of its blocks.
+        Reorg,
+    };
+    //! When it happened during the run, in milliseconds.
+    int64_t time_ms;
+    BlockIndex block;
+    //! Who found, published or received the block.
+    uint16_t miner;
+    Type type;
+    //! For reorgs, how many blocks the best chain dropped, saturated at 255 (deeper than any finality depth allows).
+    uint8_t depth;
+
+    bool operator==(const TraceEvent&) const = default;
+};
+static_assert(sizeof(TraceEvent) == 16);
+
+struct SimulationContext;
+
+/** Where the events of a traced run are recorded. Workers keep one around for all their runs, so recording an
+ * event is appending it to a buffer which is only ever reallocated for the first runs. */
+struct RunTrace {
+    std::vector<TraceEvent> events;
+    //! Called with the state of the run right after this many events were recorded, if set, to inspect it when
+    //! replaying the run.
+    size_t inspect_at{std::numeric_limits<size_t>::max()};
+    std::function<void(const SimulationContext&)> inspect;
+};
+
+/** Number of times the stats are sampled during a run of this duration, at every interval strictly before its end. */
+size_t SampleCount(std::chrono::milliseconds duration, std::optional<std::chrono::milliseconds> interval)
+{
+    if (!interval) return 0;
+    assert(*interval > 0ms);
+    return static_cast<size_t>((duration - 1ms) / *interval);
+}
+
+/** Everything a simulation run needs. Workers keep one around and reuse it for all their runs, so that runs do
+ * not allocate once the storage was sized for the first one.
+ */
+struct SimulationContext {
+    //! State of the miners at the start of every run.
+    std::vector<Miner> initial_miners;
+    //! How long each run lasts.
+    std::chrono::milliseconds duration;
+    //! State of the miners during the current run, reset to `initial_miners` at the start of each run.
+    std::vector<Miner> miners;
+    //! Honest miners only need to know about the best chain when they find a block, at which point they
+    //! switch to it if it is longer than theirs. Selfish miners on the other hand need to be notified as soon
+    //! as it changes as they may act upon the information, for instance by revealing some of their private
+    //! blocks.
+    std::vector<Miner*> selfish_miners;
+    //! Whether any miner is selfish at some point of the run, which needs the full event loop.
+    bool has_selfish_miners;
+    //! All the blocks found during the current run. Miners only keep track of the tip of their local chain.
+    BlockTree tree;
+    //! The best chain among all the published blocks, updated as blocks arrive.
+    BestChain best_chain;
+    //! Blocks found and blocks arriving which are yet to be processed.
+    EventQueue events;
+    //! Blocks which did not reach all miners yet, in networks without selfish miners.
+    std::vector<BlockIndex> in_flight;
+    //! Draws which miner found a block according to their share of the hashrate.
+    FinderSampler finder_sampler;
+    //! The time it takes for blocks to travel between each pair of miners.
+    LatencyMatrix latencies;
+    //! Whether latencies differ between pairs of miners, in which case each miner has its own view of the network
+    //! and the fields below are used. Otherwise all miners agree on the best chain.
+    bool pairwise_latencies;
+    //! Which blocks each honest miner received at a given time.
+    ArrivalIndex arrivals;
+    //! The best chain each strategic miner received, indexed by miner (unused for honest miners).
+    std::vector<BestChain> views;
+    //! Record the stats of every miner at this interval during the run, if set.
+    std::optional<std::chrono::milliseconds> sample_interval;
+    //! The stats of every miner at each sample time of the current run, one row of miners per sample.
+    std::vector<MinerStats> samples;
+    //! What the engine did during the current run, in instrumented builds.
+    RunCounters counters;
+    //! Record the events of the current run here, if set. It costs a branch per event otherwise.
+    RunTrace* trace{nullptr};
+
+    //! Changes to the hashrate of the miners during each run, in chronological order.
+    std::vector<HashrateChange> schedule;
+    //! Adjust the difficulty every this many blocks, if set. It is constant otherwise.
+    std::optional<uint32_t> retarget_period;
+    //! Sum of the shares of all the miners at the start of a run. The initial difficulty is set for this hashrate
+    //! to find a block every BLOCK_INTERVAL on average.
+    double initial_perc{0.0};
+    //! Consider the blocks this deep in the best chain final and drop them, if set, so that the memory used by a
+    //! run does not grow with its duration. See FinalizeBlocks().
+    std::optional<uint32_t> finality_depth;
+    //! Size of the tree at which to finalize blocks next.
+    size_t finalize_at;
+    //! Estimate how often the best chain reorgs at least this many blocks at once, if set, by importance sampling:
+    //! during a fork in a network of honest miners, the next block is drawn to be found before the last one reached
+    //! everyone more often than it actually is (see NextTiltedBlockInterval()), so that forks last longer. Each deep
+    //! reorg is then weighted by how much more likely the draws of its fork actually are than they were made to be.
+    //!
+    //! A block found while the network agrees on its tip starts a cycle, which a fork may follow, independent of
+    //! the previous ones. So the weight only needs to cover the current cycle, which keeps its variance in check
+    //! however long the runs. As forks made to last longer also shift the start of the following cycles, the deep
+    //! reorgs of a run are scaled by its duration over the weighted sum of the durations of its cycles. The stats
+    //! of the miners are those of the runs as simulated, skewed by the longer forks.
+    std::optional<uint32_t> reorg_depth;
+    //! The weight of the current cycle, the weighted sum of the reorgs at least `reorg_depth` deep of the run and
+    //! the weighted sum of the durations of its cycles, in milliseconds.
+    double weight;
+    double deep_reorgs;
+    double weighted_ms;
+
+    // How fast blocks are found during the current run. Only changes at the change points of the schedule and at
+    // retargets. The engine is specialized for runs where it never does, which don't pay for any of it.
+
+    //! Sum of the current shares of all the miners.
+    double network_perc;
+    //! Difficulty relative to the initial one.
+    double difficulty;
+    //! Expected time between blocks at the current hashrate and difficulty, in milliseconds.
+    double block_interval_ms;
+    //! Position in the schedule of the next change to apply.
+    size_t next_change;
+    //! Height of the last block of the current retarget period, and when its first block is considered found.
+    size_t retarget_height;
+    std::chrono::milliseconds period_start;
+
+    explicit SimulationContext(std::vector<Miner> miners_, std::chrono::milliseconds duration_, std::span<const LinkLatency> links = {},
+                               std::optional<std::chrono::milliseconds> sample_interval_ = {},
+                               std::span<const HashrateChange> changes = {}, std::optional<uint32_t> retarget_period_ = {},
+                               std::optional<uint32_t> finality_depth_ = {}, std::optional<uint32_t> reorg_depth_ = {})
+        : initial_miners{std::move(miners_)}, duration{duration_}, miners{initial_miners}, finder_sampler{initial_miners},
+          latencies{initial_miners, links}, pairwise_latencies{!latencies.IsUniform()}, views(initial_miners.size()),
+          sample_interval{sample_interval_}, samples(SampleCount() * initial_miners.size()),
+          schedule(changes.begin(), changes.end()), retarget_period{retarget_period_}, finality_depth{finality_depth_},
+          reorg_depth{reorg_depth_}
+    {
+        // A miner's propagation time is for its blocks to reach all others, which latencies to some may change.
+        if (!links.empty()) {
+            for (auto& miner: initial_miners) miner.propagation = latencies.ReachAll(miner.id);
+            std::ranges::copy(initial_miners, miners.begin());
+        }
+        std::ranges::stable_sort(schedule, {}, &HashrateChange::time);
+        assert(!retarget_period || *retarget_period > 0);
+        assert(!finality_depth || *finality_depth > 0);
+        assert(!reorg_depth || *reorg_depth > 0);
+
+        // Make room for every miner which may be selfish at some point in the list of selfish miners.
+        std::vector<bool> may_be_selfish(miners.size());
+        for (const auto& change: schedule) {
+            assert(change.miner < miners.size());
+            may_be_selfish[change.miner] = may_be_selfish[change.miner] || change.is_selfish;
+        }
+        for (size_t i{0}; i < miners.size(); ++i) {
+            // Blocks are attributed to miners by position.
+            assert(miners[i].id == i);
+            may_be_selfish[i] = may_be_selfish[i] || miners[i].is_selfish;
+            initial_perc += miners[i].perc;
+        }
+        const auto strategic_count{std::ranges::count(may_be_selfish, true)};
+        selfish_miners.reserve(strategic_count);
+        for (auto& miner: miners) {
+            if (miner.is_selfish) selfish_miners.push_back(&miner);
+        }
+        has_selfish_miners = strategic_count > 0;
+        assert(miners.size() < BlockTree::NO_MINER);
+
+        // The number of blocks found during a run follows a Poisson distribution. Make room for way more
+        // than we'll ever need in practice, so reallocating is only a theoretical possibility. Blocks are found
+        // faster when the hashrate goes up. With retargets, it is at most as many times higher than the lowest
+        // the difficulty adjusted to, and the best chain rather than all blocks grows at the expected rate:
+        // leave room for as many stale blocks.
+        double peak_perc{initial_perc}, low_perc{initial_perc}, perc{initial_perc};
+        std::vector<double> percs(miners.size());
+        std::ranges::transform(miners, percs.begin(), &Miner::perc);
+        for (const auto& change: schedule) {
+            perc += change.perc - std::exchange(percs[change.miner], change.perc);
+            peak_perc = std::max(peak_perc, perc);
+            low_perc = std::min(low_perc, perc);
+        }
+        const double rate_factor{retarget_period ? 2 * peak_perc / low_perc : peak_perc / initial_perc};
+        const auto expected_blocks{static_cast<double>(duration / BLOCK_INTERVAL) * rate_factor};
+        // When blocks are finalized, those which are kept span twice the finality depth before the oldest are
+        // dropped. Leave room for as many stale blocks there too.
+        auto max_blocks{static_cast<size_t>(expected_blocks + 10 * std::sqrt(expected_blocks)) + 16};
+        if (finality_depth) max_blocks = std::min(max_blocks, 4 * size_t{*finality_depth});
+        tree.reserve(max_blocks);
+        best_chain.reserve(max_blocks, miners.size());
+        arrivals.reserve(max_blocks);
+        for (size_t i{0}; i < miners.size(); ++i) {
+            if (may_be_selfish[i]) views[i].reserve(max_blocks, miners.size());
+        }
+        // At most there is a block found event and an arrival for a block (or a set of revealed blocks) per
+        // miner in flight, along with its reception by every strategic miner, and the next scheduled change.
+        events.reserve((miners.size() + 1) * (strategic_count + 1) + 1);
+        in_flight.reserve(miners.size() + 1);
+        Reset();
+    }
+
+    size_t SampleCount() const { return ::SampleCount(duration, sample_interval); }
+
+    /** At what time of the run the given sample is taken. */
+    std::chrono::milliseconds SampleTime(size_t sample) const { return *sample_interval * (sample + 1); }
+
+    /** When the next scheduled change happens, if any is left. */
+    std::chrono::milliseconds NextChangeTime() const {
+        return next_change < schedule.size() ? schedule[next_change].time : std::chrono::milliseconds::max();
+    }
+
+    // Selfish miners are tracked by address.
+    SimulationContext(const SimulationContext&) = delete;
+    SimulationContext& operator=(const SimulationContext&) = delete;
+
+    /** Record an event of the current run, if it is traced. */
+    void Trace(TraceEvent::Type type, std::chrono::milliseconds time, BlockIndex block, unsigned miner, uint64_t depth = 0) {
+        if (trace) [[unlikely]] Record(TraceEvent{time.count(), block, static_cast<uint16_t>(miner), type, static_cast<uint8_t>(std::min<uint64_t>(depth, 255))});
+    }
+
+    // Kept out of the engine's loops, which only pay for checking whether the run is traced.
+    [[gnu::noinline, gnu::cold]] void Record(const TraceEvent& event) {
+        trace->events.push_back(event);
+        if (trace->events.size() == trace->inspect_at) trace->inspect(*this);
+    }
+
+    /** Start a new run from scratch. */
+    void Reset() {
+        std::ranges::copy(initial_miners, miners.begin());
+        tree.clear();
+        best_chain.clear();
+        events.clear();
+        in_flight.clear();
+        arrivals.clear();
+        if (schedule.empty()) {
+            for (const auto* miner: selfish_miners) views[miner->id].clear();
+        } else {
+            // Undo the changes of the last run.
+            finder_sampler.Rebuild(miners);
+            selfish_miners.clear();
+            for (auto& miner: miners) {
+                if (miner.is_selfish) selfish_miners.push_back(&miner);
+            }
+            for (auto& view: views) view.clear();
+        }
+        network_perc = initial_perc;
+        difficulty = 1.0;
+        block_interval_ms = BLOCK_INTERVAL_MS;
+        next_change = 0;
+        retarget_height = retarget_period ? *retarget_period : std::numeric_limits<size_t>::max();
+        period_start = 0ms;
+        finalize_at = finality_depth ? *finality_depth : std::numeric_limits<size_t>::max();
+        weight = 1.0;
+        deep_reorgs = 0.0;
+        weighted_ms = static_cast<double>(duration.count());
+        counters = RunCounters{.runs = 1};
+        if (trace) trace->events.clear();
+    }
+};
+
+/** Keep the best chain up to date with a block which just reached all miners. Returns whether it changed. */
+bool OnBlockArrival(const BlockTree& tree, BestChain& best_chain, BlockIndex block)
+{
+    // Among chains of the same size, keep the one which arrived first (matching Bitcoin Core's first-seen
+    // rule).
+    if (tree.Height(block) < best_chain.size()) return false;
+    best_chain.SetTip(tree, block);
+    return true;
+}
+
+/** Same as above for the best chain of the network, recording its reorgs and the time it takes in instrumented
+ * builds, the deep ones when sampling rare events, and the arrival when tracing. */
+bool OnBestChainArrival(SimulationContext& ctx, BlockIndex block)
+{
+    ScopedTimer timer{ctx.counters.best_chain_ticks};
+    const auto previous_tip{ctx.best_chain.Tip()};
+    const bool changed{OnBlockArrival(ctx.tree, ctx.best_chain, block)};
+    ctx.Trace(TraceEvent::Type::Received, ctx.tree.Arrival(block), block, BlockTree::NO_MINER);
+    if (!changed) return false;
+    // Walking back to the previous tip is only worth it when something records the depth of the reorg.
+    if (!INSTRUMENT && !ctx.reorg_depth && !ctx.trace) return true;
+    const auto depth{ReorgDepth(ctx.tree, ctx.best_chain, previous_tip)};
+    if constexpr (INSTRUMENT) ctx.counters.OnNewTip(depth);
+    if (ctx.reorg_depth && depth >= *ctx.reorg_depth) ctx.deep_reorgs += ctx.weight;
+    if (ctx.trace && depth > 0) ctx.Trace(TraceEvent::Type::Reorg, ctx.tree.Arrival(block), block, ctx.tree.MinerId(block), depth);
+    return true;
+}
+
+/** Pick which miner found the next block, timing it in instrumented builds. */
+Miner& PickFinder(SimulationContext& ctx, UniformStream& stream)
+{
+    ScopedTimer timer{ctx.counters.pick_finder_ticks};
+    return ctx.miners[PickFinder(ctx.finder_sampler, stream)];
+}
+
+/** Update the expected time between blocks after the network hashrate or the difficulty changed. Returns the ratio
+ * of the new one to the previous one. */
+double UpdateBlockInterval(SimulationContext& ctx)
+{
+    assert(ctx.network_perc > 0.0);
+    const double previous{ctx.block_interval_ms};
+    ctx.block_interval_ms = BLOCK_INTERVAL_MS * ctx.difficulty * ctx.initial_perc / ctx.network_perc;
+    return ctx.block_interval_ms / previous;
+}
+
+/** Adjust the difficulty if the best chain just completed a retarget period, so that blocks are found every
+ * BLOCK_INTERVAL on average at the current hashrate. Like in Bitcoin it is based on how long the period took,
+ * and bounded by MAX_RETARGET_FACTOR. The time a block reached all miners stands for its timestamp.
+ *
+ * The difficulty is set for the whole network at once, rather than for each chain. As chains only ever compete
+ * for a few blocks, competing blocks at the same height are assumed to have the same difficulty: the longest
+ * chain is still the one with the most work. The new difficulty applies from the next block interval drawn.
+ */
+void MaybeRetarget(SimulationContext& ctx)
+{
+    if (ctx.best_chain.size() <= ctx.retarget_height) return;
+    const auto period{*ctx.retarget_period};
+    const double expected{BLOCK_INTERVAL_MS * period};
+    do {
+        const auto end{ctx.tree.Arrival(ctx.best_chain[ctx.retarget_height])};
+        const auto actual{std::clamp(static_cast<double>((end - ctx.period_start).count()), expected / MAX_RETARGET_FACTOR, expected * MAX_RETARGET_FACTOR)};
+        ctx.difficulty *= expected / actual;
+        ctx.period_start = end;
+        ctx.retarget_height += period;
+    } while (ctx.best_chain.size() > ctx.retarget_height);
+    UpdateBlockInterval(ctx);
+}
+
+/** Record the stats of every miner at the given sample time, as if the run ended now. */
+void RecordSample(SimulationContext& ctx, size_t sample)
+{
+    const auto row{std::span{ctx.samples}.subspan(sample * ctx.miners.size(), ctx.miners.size())};
+    for (size_t i{0}; i < ctx.miners.size(); ++i) {
+        row[i] = MinerStats(ctx.miners[i], ctx.tree, ctx.best_chain);
+    }
+}
+
+/** How blocks propagate between miners, as policies for the simulation engine. */
+
+/** Every miner's blocks reach all other miners at once, so all miners agree on the best chain. */
+struct UniformPropagation {
+    /** Let an honest miner switch to the best chain it received before finding a block at this time. */
+    static void CatchUp(SimulationContext& ctx, Miner& miner, std::chrono::milliseconds /*time*/)
+    {
+        ScopedTimer timer{ctx.counters.notify_ticks};
+        miner.MaybeReorg(ctx.tree, ctx.best_chain);
+    }
+
+    /** The best chain as seen by a strategic miner. */
+    static const BestChain& View(SimulationContext& ctx, const Miner& /*miner*/) { return ctx.best_chain; }
+
+    /** Schedule the arrival of a newly published block. */
+    static void Publish(SimulationContext& ctx, BlockIndex block)
+    {
+        ctx.events.push(Event{ctx.tree.Arrival(block), Event::Type::BlockArrival, 0, block});
+        if constexpr (INSTRUMENT) ctx.counters.SetInFlight(ctx.counters.in_flight + 1);
+    }
+};
+
+/** Latencies differ between pairs of miners, so each has its own view of the network. Honest miners look up the
+ * best chain they received when they find a block, strategic miners are notified when a block reaches them.
+ * The best chain among all the blocks which reached everyone is still tracked, for the stats of the run and races.
+ */
+struct PairwisePropagation {
+    static void CatchUp(SimulationContext& ctx, Miner& miner, std::chrono::milliseconds time)
+    {
+        ScopedTimer timer{ctx.counters.notify_ticks};
+        ctx.arrivals.Update(ctx.tree);
+        const auto tip{ctx.arrivals.BestVisibleTip(ctx.tree, ctx.latencies, miner, time)};
+        if (tip != miner.tip) miner.ReorgTo(ctx.tree, ctx.best_chain, tip);
+    }
+
+    static const BestChain& View(SimulationContext& ctx, const Miner& miner) { return ctx.views[miner.id]; }
+
+    static void Publish(SimulationContext& ctx, BlockIndex block)
+    {
+        UniformPropagation::Publish(ctx, block);
+        // Strategic miners consider their own blocks part of the public chain once they reached everyone.
+        for (const auto* miner: ctx.selfish_miners) {
+            const auto time{ctx.tree.MinerId(block) == miner->id ? ctx.tree.Arrival(block) : ctx.latencies.ReceivedAt(ctx.tree, block, miner->id)};
+            ctx.events.push(Event{time, Event::Type::BlockReceived, static_cast<uint16_t>(miner->id), block});
+        }
+    }
+};
+
+/** Drop the blocks which can't matter anymore, once the tree grew by the finality depth since the last time, so that
+ * only O(depth) blocks are kept in memory however long the run. Called before a block is found.
+ *
+ * The block of the best chain at the finality depth is assumed to be final: no branch forking off below it will
+ * ever be switched to, which holds as long as no reorg is as deep (instrumented builds report the deepest one). The
+ * blocks of the best chain below it are already counted for their miners, and those outside of it are stale. The
+ * tree drops its oldest blocks up to the first one above it, and the chains index only the heights from it. The
+ * miners still mining below it, honest ones which did not find a block in a while, switch to it right away. They
+ * would when they find their next block anyway, and so count the same stale blocks.
+ */
+template<typename Propagation>
+void FinalizeBlocks(SimulationContext& ctx)
+{
+    auto& tree{ctx.tree};
+    auto& best_chain{ctx.best_chain};
+    const auto depth{*ctx.finality_depth};
+    ctx.finalize_at = tree.size() + depth;
+    if (best_chain.size() <= best_chain.First() + depth + 1) return;
+    const size_t height{best_chain.size() - 1 - depth};
+    const BlockIndex final_block{best_chain[height]};
+
+    // Blocks are appended on top of recent ones, so from the first one above the final block all the following
+    // ones are too but for a few stale ones, which are kept.
+    BlockIndex first{tree.First()};
+    while (first < final_block && tree.Height(first) <= height) ++first;
+    for (auto& miner: ctx.miners) {
+        if (miner.tip < first || tree.Height(miner.tip) < height) miner.FastForward(tree, best_chain, final_block);
+    }
+    if constexpr (std::is_same_v<Propagation, PairwisePropagation>) {
+        ctx.arrivals.Update(tree);
+        // The views of miners becoming strategic later on are set from the best chain they received by then.
+        for (size_t i{0}; i < ctx.miners.size(); ++i) {
+            auto& view{ctx.views[i]};
+            if (ctx.miners[i].is_selfish) {
+                assert(view.size() > height && view[height] == final_block);
+                view.DropBelow(height);
+            } else {
+                view.Rebase(final_block, height);
+            }
+        }
+    }
+    best_chain.DropBelow(height);
+    tree.DropBefore(first);
+    if constexpr (std::is_same_v<Propagation, PairwisePropagation>) ctx.arrivals.DropBefore(tree, height);
+}
+
+/** Apply the changes scheduled at this time, which must be the next ones. The finder sampler is rebuilt once
+ * for all of them. A miner becoming selfish starts from the best chain it received, one becoming honest publishes
+ * its private blocks. Returns the ratio of the new expected time between blocks to the previous one. */
+template<typename Propagation>
+double ApplyScheduledChanges(SimulationContext& ctx, std::chrono::milliseconds time)
+{
+    assert(ctx.NextChangeTime() == time);
+    for (; ctx.NextChangeTime() == time; ++ctx.next_change) {
+        const auto& change{ctx.schedule[ctx.next_change]};
+        Miner& miner{ctx.miners[change.miner]};
+        ctx.network_perc += change.perc - miner.perc;
+        miner.perc = change.perc;
+        miner.selfish_params = change.selfish_params;
+        if (change.is_selfish == miner.is_selfish) continue;
+
+        miner.is_selfish = change.is_selfish;
+        if (miner.is_selfish) {
+            ctx.selfish_miners.push_back(&miner);
+            if constexpr (std::is_same_v<Propagation, PairwisePropagation>) {
+                // The blocks in flight to it are only taken into account once a block on top of them reaches it.
+                ctx.arrivals.Update(ctx.tree);
+                ctx.views[miner.id].SetTip(ctx.tree, ctx.arrivals.BestVisibleTip(ctx.tree, ctx.latencies, miner, time));
+            }
+        } else {
+            std::erase(ctx.selfish_miners, &miner);
+            if (miner.private_blocks > 0) {
+                SelfishStrategy::RevealAll(miner, ctx.tree, time);
+                Propagation::Publish(ctx, miner.tip);
+                ctx.Trace(TraceEvent::Type::Published, time, miner.tip, miner.id);
+            }
+        }
+    }
+    ctx.finder_sampler.Rebuild(ctx.miners);
+    return UpdateBlockInterval(ctx);
+}
+
+/** Run the simulation for a network with strategic miners, all following the given strategy while the others are
+ * honest, and blocks propagating according to the given policy. Stats are sampled during the run if SAMPLE is
+ * set, and the hashrate or difficulty may change if CHANGES is set. See RunSimulation(). */
+template<typename Strategy, typename Propagation, bool SAMPLE, bool CHANGES>
+void RunEventLoop(SimulationContext& ctx, ExponentialStream& block_interval, UniformStream& miner_picker)
+{
+    auto& miners{ctx.miners};
+    auto& tree{ctx.tree};
+    auto& best_chain{ctx.best_chain};
+    auto& events{ctx.events};
+
+    // There is only two events that may change the state of miners (including the selfish ones): a block
+    // is found, or a block is received. Instead of iterating through every ms where nothing will happen,
+    // process them in chronological order. Since we are starting from 0, the first block is found after
+    // just one block interval.
+    const auto next_interval{[&] {
+        return CHANGES ? NextBlockInterval(block_interval, ctx.block_interval_ms) : NextBlockInterval(block_interval);
+    }};
+    events.push(Event{next_interval(), Event::Type::BlockFound, 0, 0});
+    if (CHANGES && !ctx.schedule.empty()) events.push(Event{ctx.NextChangeTime(), Event::Type::ScheduledChange, 0, 0});
+    // The strategic miners' block racing with the tip of the best chain, if any (the genesis can't be one).
+    BlockIndex contender{BlockTree::GENESIS};
+    const auto notify{[&](Miner& miner, std::chrono::milliseconds time) {
+        ScopedTimer timer{ctx.counters.notify_ticks};
+        if (const auto revealed{Strategy::OnBestChain(miner, tree, Propagation::View(ctx, miner), time)}) {
+            Propagation::Publish(ctx, *revealed);
+            ctx.Trace(TraceEvent::Type::Published, time, *revealed, miner.id);
+        }
+    }};
+
+    // Sample the stats before processing the events happening at or after the sample time.
+    size_t next_sample{0};
+    const auto record_samples_before{[&](std::chrono::milliseconds time) {
+        for (; next_sample < ctx.SampleCount() && ctx.SampleTime(next_sample) <= time; ++next_sample) {
+            RecordSample(ctx, next_sample);
+        }
+    }};
+
+    // Run the simulation. There is always a pending block found event, so the queue is never empty.
+    while (events.top().time < ctx.duration) {
+        const Event event{events.pop()};
+        if constexpr (SAMPLE) record_samples_before(event.time);
+        if constexpr (INSTRUMENT) ++ctx.counters.events;
+
+        switch (event.type) {
+        case Event::Type::BlockFound: {
+            if (tree.size() >= ctx.finalize_at) FinalizeBlocks<Propagation>(ctx);
+            // Pick which miner found this block. If the best chain got longer since it last found one, it was
+            // mining on top of it.
+            Miner& miner{PickFinder(ctx, miner_picker)};
+            if (miner.is_selfish) {
+                Strategy::FoundBlock(miner, tree, Propagation::View(ctx, miner), event.time);
+            } else {
+                Propagation::CatchUp(ctx, miner, event.time);
+                // During a race, a share (gamma) of the honest hashrate mines on top of the strategic miner's block.
+                if (contender != BlockTree::GENESIS && miner.tip != contender && miner.ChainSize(tree) == best_chain.size()) {
+                    const double gamma{miners[tree.MinerId(contender)].selfish_params.gamma};
+                    if (gamma > 0 && static_cast<double>(miner_picker.Next()) < gamma * 0x1p64) {
+                        miner.SwitchTo(tree, contender);
+                    }
+                }
+                HonestStrategy::FoundBlock(miner, tree, best_chain, event.time);
+            }
+            ctx.Trace(TraceEvent::Type::Found, event.time, miner.tip, miner.id);
+            if (tree.Arrival(miner.tip) != SELFISH_ARRIVAL) {
+                Propagation::Publish(ctx, miner.tip);
+                ctx.Trace(TraceEvent::Type::Published, event.time, miner.tip, miner.id);
+            }
+            events.push(Event{event.time + next_interval(), Event::Type::BlockFound, 0, 0});
+            break;
+        }
+        case Event::Type::BlockArrival: {
+            if constexpr (INSTRUMENT) --ctx.counters.in_flight;
+            if (!OnBestChainArrival(ctx, event.block)) {
+                // A strategic miner's block which ties with the best chain (a race) is a contender for honest
+                // miners to mine on.
+                if (tree.Height(event.block) + 1 == best_chain.size() && miners[tree.MinerId(event.block)].is_selfish) {
+                    contender = event.block;
+                }
+                break;
+            }
+            contender = BlockTree::GENESIS;
+            if constexpr (CHANGES) MaybeRetarget(ctx);
+            // Strategic miners share this view of the network unless they receive blocks on their own.
+            if constexpr (std::is_same_v<Propagation, UniformPropagation>) {
+                for (auto* miner: ctx.selfish_miners) notify(*miner, event.time);
+            }
+            break;
+        }
+        case Event::Type::BlockReceived: {
+            Miner& miner{miners[event.receiver]};
+            const bool changed{OnBlockArrival(tree, ctx.views[miner.id], event.block)};
+            ctx.Trace(TraceEvent::Type::Received, event.time, event.block, miner.id);
+            if (changed) notify(miner, event.time);
+            break;
+        }
+        case Event::Type::ScheduledChange: {
+            if constexpr (CHANGES) {
+                const double ratio{ApplyScheduledChanges<Propagation>(ctx, event.time)};
+                events.Reschedule(Event::Type::BlockFound, [&](auto block_time) { return RescaleBlockTime(block_time, event.time, ratio); });
+                if (ctx.next_change < ctx.schedule.size()) events.push(Event{ctx.NextChangeTime(), Event::Type::ScheduledChange, 0, 0});
+            }
+            break;
+        }
+        }
+    }
+    if constexpr (SAMPLE) record_samples_before(ctx.duration);
 }
 
-/** Pick which miner found the last block based on its hashrate and a uniform distribution. */
-Miner& PickFinder(std::vector<Miner>& miners, RNG& rng)
+/** Run the simulation for a network of honest miners only, blocks propagating according to the given policy,
+ * stats sampled during the run if SAMPLE is set and the hashrate or difficulty changing if CHANGES is set. See
+ * RunSimulation().
+ *
+ * Nobody reacts to a block arrival in this case, so arrivals only need to be processed before the next block
+ * is found. Most of the time the last block has reached everyone by then: the whole network agrees on a single
+ * tip and the block simply extends the best chain. Only when a block is found while others are still in flight
+ * (a potential race) do we need to keep track of the blocks in flight, of which there is only ever a handful.
+ *
+ * When sampling rare events, the time until the next block is tilted during a fork: when it is found while others
+ * are in flight, or while the best chain's tip is contested by a block of the same height which arrived after it.
+ */
+template<typename Propagation, bool SAMPLE, bool CHANGES>
+void RunHonestNetwork(SimulationContext& ctx, ExponentialStream& block_interval, UniformStream& miner_picker)
 {
-    uint64_t random{rng.rand64()}, i{0};
-    for (auto& miner: miners) {
-        i += miner.perc * PERC_MULTIPLIER;
-        if (i > random) return miner;
+    auto& tree{ctx.tree};
+    auto& best_chain{ctx.best_chain};
+    auto& in_flight{ctx.in_flight};
+    const bool tilt{ctx.reorg_depth.has_value()};
+    // Height of the last block which arrived at the height of the tip of the best chain, after it.
+    size_t contested_height{std::numeric_limits<size_t>::max()};
+    // When the current cycle started, when tilting forks. The durations of the cycles add up to that of the run, so
+    // only the difference their weight makes is added to it.
+    std::chrono::milliseconds cycle_start{0ms};
+    const auto end_cycle{[&](std::chrono::milliseconds time) {
+        ctx.weighted_ms += (ctx.weight - 1.0) * static_cast<double>((time - cycle_start).count());
+        ctx.weight = 1.0;
+        cycle_start = time;
+    }};
+
+    // Process the blocks in flight which arrive before the given time, in the same order as the event queue.
+    const auto process_arrivals_before{[&](std::chrono::milliseconds time) {
+        while (!in_flight.empty()) {
+            const auto earliest{std::ranges::min_element(in_flight, [&](BlockIndex a, BlockIndex b) {
+                return std::pair{tree.Arrival(a), a} < std::pair{tree.Arrival(b), b};
+            })};
+            if (tree.Arrival(*earliest) >= time) break;
+            if (OnBestChainArrival(ctx, *earliest)) {
+                if constexpr (CHANGES) MaybeRetarget(ctx);
+            } else if (tree.Height(*earliest) + 1 == best_chain.size()) {
+                contested_height = tree.Height(*earliest);
+            }
+            if constexpr (INSTRUMENT) ++ctx.counters.events;
+            *earliest = in_flight.back();
+            in_flight.pop_back();
+        }
+    }};
+
+    // Sample the stats once all the blocks arriving before the sample time were processed.
+    size_t next_sample{0};
+    const auto record_samples_before{[&](std::chrono::milliseconds time) {
+        for (; next_sample < ctx.SampleCount() && ctx.SampleTime(next_sample) <= time; ++next_sample) {
+            process_arrivals_before(ctx.SampleTime(next_sample));
+            RecordSample(ctx, next_sample);
+        }
+    }};
+
+    // Apply the changes scheduled before the next block is found (and the end of the run), which change when it is.
+    auto next_change_time{ctx.NextChangeTime()};
+    const auto apply_changes_before{[&](std::chrono::milliseconds& block_time) {
+        while (next_change_time < std::min(block_time, ctx.duration)) {
+            block_time = RescaleBlockTime(block_time, next_change_time, ApplyScheduledChanges<Propagation>(ctx, next_change_time));
+            next_change_time = ctx.NextChangeTime();
+            if constexpr (INSTRUMENT) ++ctx.counters.events;
+        }
+    }};
+    const auto next_interval{[&] {
+        return CHANGES ? NextBlockInterval(block_interval, ctx.block_interval_ms) : NextBlockInterval(block_interval);
+    }};
+
+    std::chrono::milliseconds block_time{next_interval()};
+    if constexpr (CHANGES) apply_changes_before(block_time);
+    while (block_time < ctx.duration) {
+        if constexpr (SAMPLE) record_samples_before(block_time);
+        process_arrivals_before(block_time);
+        if (tree.size() >= ctx.finalize_at) FinalizeBlocks<Propagation>(ctx);
+
+        // Pick which miner found this block. If the best chain got longer since it last found one, it was
+        // mining on top of it.
+        Miner& miner{PickFinder(ctx, miner_picker)};
+        // Most of the time no block is in flight and the miner is mining on the tip of the best chain, or switches
+        // to it without leaving any block of its own behind. Its block then simply extends the best chain.
+        bool on_tip{false};
+        if constexpr (std::is_same_v<Propagation, UniformPropagation>) {
+            on_tip = in_flight.empty() && (miner.ChainSize(tree) < best_chain.size() ? best_chain.Contains(tree, miner.tip) : miner.tip == best_chain.Tip());
+        }
+        if (on_tip) {
+            miner.tip = best_chain.Tip();
+        } else {
+            Propagation::CatchUp(ctx, miner, block_time);
+        }
+        HonestStrategy::FoundBlock(miner, tree, best_chain, block_time);
+        ctx.Trace(TraceEvent::Type::Found, block_time, miner.tip, miner.id);
+        ctx.Trace(TraceEvent::Type::Published, block_time, miner.tip, miner.id);
+
+        // If no other block is in flight and this one reaches everyone before the next one is found, it is
+        // the new best chain. Otherwise let it race with the others. It must also arrive before the next change,
+        // which may make the next block be found sooner, and the next sample is taken when sampling.
+        // When sampling rare events, the time until the next one is tilted during a fork, and a cycle ends otherwise.
+        const bool in_fork{!in_flight.empty() || contested_height + 1 == best_chain.size()};
+        if (tilt && !in_fork) end_cycle(block_time);
+        const auto next_block_time{block_time + (tilt && in_fork && tree.Arrival(miner.tip) > block_time
+            ? NextTiltedBlockInterval(block_interval, miner_picker, ctx.block_interval_ms, tree.Arrival(miner.tip) - block_time, ctx.weight)
+            : next_interval())};
+        bool arrives_first{in_flight.empty() && tree.Arrival(miner.tip) < next_block_time};
+        if constexpr (CHANGES) arrives_first &= tree.Arrival(miner.tip) < next_change_time;
+        if constexpr (SAMPLE) {
+            arrives_first &= next_sample == ctx.SampleCount() || tree.Arrival(miner.tip) < ctx.SampleTime(next_sample);
+        }
+        if (arrives_first) {
+            if (on_tip) {
+                best_chain.Extend(tree, miner.tip);
+                ctx.Trace(TraceEvent::Type::Received, tree.Arrival(miner.tip), miner.tip, BlockTree::NO_MINER);
+            } else {
+                OnBestChainArrival(ctx, miner.tip);
+            }
+            if constexpr (CHANGES) MaybeRetarget(ctx);
+        } else {
+            in_flight.push_back(miner.tip);
+        }
+        if constexpr (INSTRUMENT) {
+            // The block being found and, if it reached everyone at once, its arrival.
+            ctx.counters.events += arrives_first ? 2 : 1;
+            ctx.counters.SetInFlight(in_flight.size());
+        }
+        block_time = next_block_time;
+        if constexpr (CHANGES) apply_changes_before(block_time);
+    }
+    if constexpr (SAMPLE) record_samples_before(ctx.duration);
+    process_arrivals_before(ctx.duration);
+    if (tilt) end_cycle(ctx.duration);
+}
+
+/** Run the engine specialized for the strategies and latencies on the network. See RunSimulation(). */
+template<bool SAMPLE, bool CHANGES>
+void RunEngine(SimulationContext& ctx, ExponentialStream& block_interval, UniformStream& miner_picker)
+{
+    if (!ctx.has_selfish_miners) {
+        if (ctx.pairwise_latencies) {
+            RunHonestNetwork<PairwisePropagation, SAMPLE, CHANGES>(ctx, block_interval, miner_picker);
+        } else {
+            RunHonestNetwork<UniformPropagation, SAMPLE, CHANGES>(ctx, block_interval, miner_picker);
+        }
+    } else if (ctx.pairwise_latencies) {
+        RunEventLoop<SelfishStrategy, PairwisePropagation, SAMPLE, CHANGES>(ctx, block_interval, miner_picker);
+    } else {
+        RunEventLoop<SelfishStrategy, UniformPropagation, SAMPLE, CHANGES>(ctx, block_interval, miner_picker);
     }
-    assert(!"The miners' percentages must add up to 100.");
+}
+
+/** Simulate the Bitcoin mining process for a given amount of time with the given miners, each having its
+ * own share of network hashrate and block propagation time.
+ *
+ * The propagation time is a simplification: it is the time before which a miner's block has not reached
+ * any other miner and after which it has reached all other miners. The latency of links between pairs of
+ * miners can be set on top of it, in which case each miner mines on the best chain it received.
+ *
+ * The mining process is accurately modeled: we draw the time between the last and next block from an
+ * exponential distribution, then draw which miner found this block based on its hashrate and a uniform
+ * distribution. The hashrate and strategy of miners may change at scheduled times during the run, and the
+ * difficulty be adjusted to the network hashrate every retarget period. Otherwise both are constant.
+ *
+ * This assumes today's Bitcoin Core behaviour: a miner will mine on top of its own block immediately and will
+ * only switch to a propagated chain if it's longer (competing blocks are assumed to have the same difficulty,
+ * see MaybeRetarget()). Miners can optionally be set to adopt the "selfish mining" strategy in SetupMiners().
+ *
+ * All randomness is derived from `seed`: running a simulation twice with the same seed gives the same result.
+ * The stats of each miner at the end of the simulation are written to `stats`, in the same order as the miners
+ * in the context. If the context has a sample interval, the stats of each miner at every interval during the run
+ * are written to its `samples`.
+ */
+void RunSimulation(SimulationContext& ctx, uint64_t seed, std::span<MinerStats> stats)
+{
+    ctx.Reset();
+    assert(stats.size() == ctx.miners.size());
+
+    // Random number generators used to respectively pick the time before the next block interval and
+    // pick which miner found the last block. Values are generated by batches. Both are derived from the
+    // run's seed so a run can always be reproduced.
+    ExponentialStream block_interval{DeriveSeed(seed, 0)};
+    UniformStream miner_picker{DeriveSeed(seed, 1)};
+
+    // Pick the engine specialized for the strategies and latencies on the network, whether to sample stats and
+    // whether the rate at which blocks are found may change, once for the whole run.
+    const bool changes{!ctx.schedule.empty() || ctx.retarget_period};
+    if (ctx.sample_interval) {
+        changes ? RunEngine<true, true>(ctx, block_interval, miner_picker) : RunEngine<true, false>(ctx, block_interval, miner_picker);
+    } else {
+        changes ? RunEngine<false, true>(ctx, block_interval, miner_picker) : RunEngine<false, false>(ctx, block_interval, miner_picker);
+    }
+
+    // Account for the stale blocks of the honest miners which did not find a block since the last reorg.
+    for (auto& miner: ctx.miners) {
+        miner.MaybeReorg(ctx.tree, ctx.best_chain);
+    }
+
+    // The blocks of each miner in the best chain were counted as it changed.
+    for (size_t i{0}; i < ctx.miners.size(); ++i) {
+        stats[i] = MinerStats(ctx.miners[i], ctx.best_chain);
+    }
+    if (ctx.reorg_depth) ctx.counters.deep_reorgs.Add(ctx.deep_reorgs * static_cast<double>(ctx.duration.count()) / ctx.weighted_ms);
 }
 
 /** Utility function useful in tests or for debugging. */
-void PrintChain(const Miner& miner)
+void PrintChain(const BlockTree& tree, const Miner& miner)
 {
+    std::vector<BlockIndex> chain;
+    for (BlockIndex i{miner.tip}; i != BlockTree::GENESIS; i = tree.Parent(i)) {
+        chain.push_back(i);
+    }
+    chain.push_back(BlockTree::GENESIS);
+
     std::cout << "Miner " << miner.id << " chain: ";
-    for (const auto&b : miner.chain) {
-        std::cout << "(" << b.miner_id << ", " << b.arrival << "), ";
+    for (const auto i: std::views::reverse(chain)) {
+        std::cout << "(" << tree.MinerId(i) << ", " << tree.Arrival(i) << "), ";
     }
     std::cout << std::endl;
 }
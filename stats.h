@@ -0,0 +1,47 @@
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+/** Mean and variance of a sample, computed as values come in (Welford's algorithm). Two such accumulators can
+ * be merged (Chan et al.'s parallel algorithm), so each chunk of simulation runs can have its own and they can
+ * be combined at the end. Both are constexpr so that they can also run on GPUs (see gpu.h).
+ */
+struct RunningStats {
+    //! Number of values in the sample.
+    uint64_t count{0};
+    //! Mean of the sample.
+    double mean{0.0};
+    //! Sum of the squared differences to the mean.
+    double m2{0.0};
+
+    constexpr void Add(double value)
+    {
+        ++count;
+        const double delta{value - mean};
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    constexpr void Merge(const RunningStats& other)
+    {
+        if (other.count == 0) return;
+        const auto total{count + other.count};
+        const double delta{other.mean - mean};
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+        count = total;
+    }
+
+    /** Unbiased estimate of the variance of the distribution the sample is drawn from. */
+    double Variance() const
+    {
+        return count > 1 ? m2 / (count - 1) : 0.0;
+    }
+
+    /** Half-width of the confidence interval around the mean, as a number of standard errors (1.96 for 95%). */
+    double ConfidenceInterval(double z = 1.96) const
+    {
+        if (count < 2) return std::numeric_limits<double>::infinity();
+        return z * std::sqrt(Variance() / count);
+    }
+};
@@ -0,0 +1,532 @@
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+
+//! Runs are split in chunks of this size, the unit of work of a thread.
+static constexpr int RUNS_PER_CHUNK{64};
+
+//! Don't stop early before this many runs, as the variance estimate is not reliable on small samples.
+static constexpr int MIN_RUNS_TO_STOP{1'024};
+
+/** A network to simulate, along with the values of the swept parameters it was generated from, if any. */
+struct Scenario {
+    std::vector<Miner> miners;
+    std::vector<LinkLatency> latencies;
+    std::vector<HashrateChange> hashrate_changes;
+    std::optional<std::chrono::milliseconds> propagation;
+    std::optional<double> share;
+    std::optional<double> selfish_share;
+};
+
+/** Get the scenarios to simulate for this config: every combination of the swept parameters applied to its
+ * network, or only the network itself if it's not a sweep. Combinations whose shares exceed 100% are skipped. */
+std::vector<Scenario> MakeScenarios(const Config& config)
+{
+    // Iterate over a single unset value for the parameters which are not swept.
+    const auto axis{[](const auto& values) {
+        std::vector<std::optional<typename std::decay_t<decltype(values)>::value_type>> axis{values.begin(), values.end()};
+        if (axis.empty()) axis.emplace_back();
+        return axis;
+    }};
+    double total_perc{0.0};
+    for (const auto& miner: config.miners) total_perc += miner.perc;
+
+    std::vector<Scenario> scenarios;
+    for (const auto& propagation: axis(config.sweep_propagation)) {
+        for (const auto& share: axis(config.sweep_share)) {
+            for (const auto& selfish_share: axis(config.sweep_selfish)) {
+                Scenario scenario{config.miners, config.latencies, config.hashrate_changes, propagation, share, selfish_share};
+                auto& miners{scenario.miners};
+                const double fixed_perc{share.value_or(0.0) + selfish_share.value_or(0.0)};
+                if (fixed_perc > 100) continue;
+
+                // Express the shares as percentages of the whole network, and scale those which are not set
+                // to fill what's left by the swept ones.
+                const double others_perc{total_perc - (share ? miners[0].perc : 0.0)};
+                for (auto& miner: miners) {
+                    if (propagation) miner.propagation = *propagation;
+                    if (share && miner.id == 0) {
+                        miner.perc = *share;
+                    } else if ((share || selfish_share) && others_perc > 0) {
+                        miner.perc = miner.perc / others_perc * (100 - fixed_perc);
+                    }
+                }
+                if (selfish_share) {
+                    miners.emplace_back(miners.size(), *selfish_share, propagation.value_or(miners[0].propagation), true);
+                }
+                scenarios.push_back(std::move(scenario));
+            }
+        }
+    }
+    return scenarios;
+}
+
+/** Whether the confidence interval around every miner's stale rate is narrower than the precision, if set, and the
+ * sample large enough to tell. */
+bool PreciseEnough(std::span<const MinerStatsAccumulator> stats, std::optional<double> precision)
+{
+    if (!precision || stats[0].stale_rate.count < MIN_RUNS_TO_STOP) return false;
+    return std::ranges::all_of(stats, [&](const auto& miner_stats) {
+        return miner_stats.stale_rate.ConfidenceInterval() < *precision;
+    });
+}
+
+/** The stale rate of every miner of a scenario by the closed-form approximation of plot_stale_rate/plot.py, which
+ * is near instant to compute. A miner's block goes stale either if another miner found one which had not reached
+ * it yet and the others then extend that one, or if another miner finds one before ours reached it and then extends
+ * its own. Deeper forks are ignored, so it is only accurate for propagation times much shorter than the block
+ * interval. Returns nothing if the network has selfish miners or changes during the runs, which it can't describe.
+ */
+std::optional<std::vector<double>> ModelStaleRates(const Scenario& scenario)
+{
+    const auto& miners{scenario.miners};
+    if (!scenario.hashrate_changes.empty() || std::ranges::any_of(miners, &Miner::is_selfish)) return {};
+    double total_perc{0.0};
+    for (const auto& miner: miners) total_perc += miner.perc;
+    if (!(total_perc > 0)) return {};
+    // How long the blocks of each miner take to reach the others, as seen by the simulation, in block intervals.
+    const size_t count{miners.size()};
+    const LatencyMatrix latencies{miners, scenario.latencies};
+    const auto to_blocks{[](std::chrono::milliseconds delay) { return static_cast<double>(delay.count()) / BLOCK_INTERVAL_MS; }};
+    std::vector<double> shares(count), delays(count);
+    for (size_t i{0}; i < count; ++i) {
+        shares[i] = miners[i].perc / total_perc;
+        delays[i] = to_blocks(miners[i].propagation);
+    }
+    // The odds that another miner finds a block before ours reached it, and then the next one.
+    const auto stale_after_odds{[&](size_t other, double delay) { return -std::expm1(-shares[other] * delay) * shares[other]; }};
+
+    // Sum over the other miners as if no link overrode their propagation times, then correct for the links. Blocks
+    // reaching us only depend on the propagation time of their miner, so that sum is computed once for all. Ours
+    // reaching others only depend on our propagation time, which many miners of large networks share, so that sum
+    // is computed once per propagation time rather than once per miner.
+    double arrivals{0.0};
+    for (size_t i{0}; i < count; ++i) arrivals += shares[i] * delays[i];
+    std::map<int64_t, double> stale_after_by_propagation;
+    // For each miner, how many blocks others found which had not reached it yet, and the odds it goes stale after.
+    std::vector<double> race_rates(count), stale_after(count);
+    for (size_t i{0}; i < count; ++i) {
+        race_rates[i] = arrivals - shares[i] * delays[i];
+        auto [it, inserted]{stale_after_by_propagation.try_emplace(miners[i].propagation.count(), 0.0)};
+        if (inserted) {
+            for (size_t j{0}; j < count; ++j) it->second += stale_after_odds(j, delays[i]);
+        }
+        stale_after[i] = it->second - stale_after_odds(i, delays[i]);
+    }
+    for (unsigned sender{0}; sender < count; ++sender) {
+        for (const auto& link: latencies.Links(sender)) {
+            race_rates[link.receiver] += shares[sender] * (to_blocks(link.latency) - delays[sender]);
+            stale_after[sender] += stale_after_odds(link.receiver, to_blocks(link.latency)) - stale_after_odds(link.receiver, delays[sender]);
+        }
+    }
+
+    std::vector<double> stale_rates(count);
+    for (size_t i{0}; i < count; ++i) {
+        // A block found we had not heard of yet makes ours stale unless we find the next one.
+        stale_rates[i] = -std::expm1(-race_rates[i]) * (1 - shares[i]) + stale_after[i];
+    }
+    return stale_rates;
+}
+
+/** Whether every miner's stale rate is within the tolerance, if set, of the model's with 95% confidence, and the
+ * sample large enough to tell, in which case more runs would only confirm the model. */
+bool AgreesWithModel(std::span<const MinerStatsAccumulator> stats, const std::optional<std::vector<double>>& model, std::optional<double> tolerance)
+{
+    if (!tolerance || !model || stats[0].stale_rate.count < MIN_RUNS_TO_STOP) return false;
+    assert(model->size() == stats.size());
+    for (size_t i{0}; i < stats.size(); ++i) {
+        const auto& stale_rate{stats[i].stale_rate};
+        if (std::abs(stale_rate.mean - (*model)[i]) + stale_rate.ConfidenceInterval() > *tolerance) return false;
+    }
+    return true;
+}
+
+//! Networks of more miners than this are reported by classes of miners (see ClassifyMiners()), not miner by miner.
+static constexpr size_t MAX_MINERS_LISTED{32};
+
+/** The stats of the miners of a scenario with about the same share of the hashrate or propagation time, to report
+ * on networks of thousands of miners at once. */
+struct MinerClass {
+    //! The range of the values of the miners of the class, from `lower` included. Both are 0 for miners without any.
+    double lower;
+    double upper;
+    //! How many miners are in the class, and their share of the hashrate in total.
+    size_t miners{0};
+    double perc{0.0};
+    //! The share of the blocks of the best chain they found in total.
+    double blocks_share{0.0};
+    //! Their mean stale rate weighted by their share of the hashrate, about as if they were a single miner, and the
+    //! range of their stale rates.
+    double stale_rate{0.0};
+    double min_stale_rate{std::numeric_limits<double>::infinity()};
+    double max_stale_rate{-std::numeric_limits<double>::infinity()};
+    //! Same as the stale rate, by the model, if it describes the scenario.
+    std::optional<double> model_stale_rate;
+};
+
+/** Group the honest miners of a scenario by the value of `key` for each of them, between consecutive powers of
+ * `base`, for instance by decade of their share of the hashrate. Miners whose value is 0 have their own class. The
+ * stats may be left empty to only classify the stale rates of the model. Returns the classes which have any miner,
+ * by increasing values. */
+std::vector<MinerClass> ClassifyMiners(std::span<const Miner> miners, std::span<const MinerStatsAccumulator> stats,
+                                       const std::optional<std::vector<double>>& model, const std::function<double(const Miner&)>& key, double base)
+{
+    assert((stats.empty() || stats.size() == miners.size()) && (!model || model->size() == miners.size()) && base > 1);
+    // Along with each class, the sum of the model's stale rates weighted the same as the simulated ones.
+    struct Sums {
+        MinerClass cls;
+        double model_stale_rate{0.0};
+    };
+    std::map<int, Sums> classes;
+    for (size_t i{0}; i < miners.size(); ++i) {
+        if (miners[i].is_selfish) continue;
+        const double value{key(miners[i])};
+        // Tolerate rounding errors at the powers of the base themselves.
+        const int exponent{value > 0 ? static_cast<int>(std::floor(std::log(value) / std::log(base) + 1e-9)) : std::numeric_limits<int>::min()};
+        auto [it, inserted]{classes.try_emplace(exponent)};
+        auto& sums{it->second};
+        if (inserted) {
+            sums.cls.lower = value > 0 ? std::pow(base, exponent) : 0.0;
+            sums.cls.upper = value > 0 ? std::pow(base, exponent + 1) : 0.0;
+        }
+        // Miners find blocks, and so have stale ones, in proportion to their hashrate.
+        const double weight{miners[i].perc};
+        auto& cls{sums.cls};
+        ++cls.miners;
+        cls.perc += weight;
+        if (model) sums.model_stale_rate += weight * (*model)[i];
+        if (stats.empty()) continue;
+        const double stale_rate{stats[i].stale_rate.mean};
+        cls.blocks_share += stats[i].blocks_share.mean;
+        cls.stale_rate += weight * stale_rate;
+        cls.min_stale_rate = std::min(cls.min_stale_rate, stale_rate);
+        cls.max_stale_rate = std::max(cls.max_stale_rate, stale_rate);
+    }
+
+    std::vector<MinerClass> result;
+    for (auto& [exponent, sums]: classes) {
+        auto& cls{sums.cls};
+        cls.stale_rate = cls.perc > 0 ? cls.stale_rate / cls.perc : 0.0;
+        if (model) cls.model_stale_rate = cls.perc > 0 ? sums.model_stale_rate / cls.perc : 0.0;
+        result.push_back(cls);
+    }
+    return result;
+}
+
+/** Parameters of a sweep over a set of scenarios. */
+struct SweepParams {
+    //! How long to run each simulation for.
+    std::chrono::milliseconds duration;
+    //! How many simulations to run per scenario.
+    int runs;
+    //! Seed from which the randomness of every run is derived.
+    uint64_t seed;
+    //! How many threads to run the simulations on.
+    unsigned threads;
+    //! Stop simulating a scenario once the confidence interval around every miner's stale rate is narrower.
+    std::optional<double> stale_rate_precision;
+    //! Also record the stats of every miner at this interval during each run, if set.
+    std::optional<std::chrono::milliseconds> sample_interval{};
+    //! Adjust the difficulty every this many blocks, if set. It is constant otherwise.
+    std::optional<uint32_t> retarget_period{};
+    //! Index of the first run to simulate, when only a slice of them is. Runs of the slice use the seeds of their
+    //! index among all the runs.
+    int first_run{0};
+    //! Drop the blocks this deep in the best chain during each run, if set.
+    std::optional<uint32_t> finality_depth{};
+    //! Estimate how often reorgs at least this deep happen by importance sampling, if set. The estimate is part
+    //! of the counters. See SimulationContext::reorg_depth.
+    std::optional<uint32_t> reorg_depth{};
+    //! Stop simulating a scenario once every miner's stale rate agrees with the model within this, if set (see
+    //! AgreesWithModel()). Runs are then only spent where the model doesn't describe the network well.
+    std::optional<double> model_tolerance{};
+    //! Also write the progress to this stream as CSV, if set (see ProgressMeter).
+    std::ostream* progress_log{nullptr};
+};
+
+/** Whether to stop simulating a scenario early given its stats so far and the stale rates of its model, if any. */
+bool StopEarly(std::span<const MinerStatsAccumulator> stats, const std::optional<std::vector<double>>& model, const SweepParams& params)
+{
+    return PreciseEnough(stats, params.stale_rate_precision) || AgreesWithModel(stats, model, params.model_tolerance);
+}
+
+/** How far a sweep got: for each scenario, how many of its chunks of runs were merged in order, and their stats. As
+ * runs are deterministic, a sweep resumed from there gives the same results as if it was never interrupted. */
+struct SweepProgress {
+    std::vector<int> merged_chunks;
+    //! The stats at the end of the runs of the merged chunks, followed by those of each sample.
+    std::vector<std::vector<MinerStatsAccumulator>> stats;
+};
+
+/** Periodically hand over the progress of a sweep, for instance to save it to a file. */
+struct SweepCheckpoints {
+    std::chrono::milliseconds interval;
+    std::function<void(const SweepProgress&)> save;
+};
+
+//! Rates are averaged over about this long, so the time left follows changes of pace without jumping around.
+static constexpr std::chrono::seconds PROGRESS_RATE_WINDOW{5};
+
+//! Header of the CSV progress log, one line per report. The time left is empty until it can be estimated.
+static constexpr std::string_view PROGRESS_CSV_HEADER{"elapsed_ms,runs,total_runs,blocks,runs_per_s,blocks_per_s,left_ms"};
+
+/** Report how far a sweep got from the counts of runs and blocks simulated so far, which the workers keep
+ * updating on their own: the share of the runs done, how many runs and blocks are simulated per second, and how
+ * long it should take to simulate the others. The report is printed on a single line rewritten every time and, if
+ * a log is set, appended to it as CSV for scripts to follow.
+ *
+ * Rates are exponentially weighted moving averages over about PROGRESS_RATE_WINDOW, so the time left adapts when
+ * runs get faster or slower, for instance from one scenario to the next, rather than assuming the pace of the
+ * whole sweep so far.
+ */
+class ProgressMeter
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::ostream& m_out;
+    std::ostream* m_log;
+    int64_t m_total_runs;
+    Clock::time_point m_start, m_last;
+    int64_t m_last_runs;
+    uint64_t m_last_blocks{0};
+    double m_runs_per_s{0.0}, m_blocks_per_s{0.0};
+    bool m_has_rates{false};
+    size_t m_line_size{0};
+
+public:
+    /** Start measuring, with this many runs already done (for instance before a sweep was resumed). */
+    ProgressMeter(std::ostream& out, std::ostream* log, int64_t total_runs, int64_t runs = 0, Clock::time_point now = Clock::now())
+        : m_out{out}, m_log{log}, m_total_runs{total_runs}, m_start{now}, m_last{now}, m_last_runs{runs}
+    {
+        assert(total_runs > 0);
+        if (m_log) *m_log << PROGRESS_CSV_HEADER << std::endl;
+    }
+
+    /** Report the progress given the counts of runs done and blocks simulated so far. */
+    void Report(int64_t runs, uint64_t blocks, Clock::time_point now = Clock::now())
+    {
+        const double elapsed_s{std::chrono::duration<double>(now - m_last).count()};
+        if (elapsed_s > 0) {
+            const double runs_per_s{(runs - m_last_runs) / elapsed_s}, blocks_per_s{(blocks - m_last_blocks) / elapsed_s};
+            // The older the rates the less they weigh, whatever the time between reports.
+            const double decay{m_has_rates ? std::exp(-elapsed_s / std::chrono::duration<double>(PROGRESS_RATE_WINDOW).count()) : 0.0};
+            m_runs_per_s = decay * m_runs_per_s + (1 - decay) * runs_per_s;
+            m_blocks_per_s = decay * m_blocks_per_s + (1 - decay) * blocks_per_s;
+            m_has_rates = true;
+            m_last = now;
+            m_last_runs = runs;
+            m_last_blocks = blocks;
+        }
+        const std::optional<std::chrono::milliseconds> left{TimeLeft(runs)};
+
+        std::ostringstream line;
+        line << runs * 100 / m_total_runs << "% progress";
+        if (m_has_rates) {
+            line << ", " << static_cast<int64_t>(m_runs_per_s) << " runs/s, " << static_cast<int64_t>(m_blocks_per_s) << " blocks/s";
+        }
+        if (left) line << ", " << std::chrono::duration_cast<std::chrono::seconds>(*left) << " left";
+        line << "..";
+        // Clear what is left of a longer previous line.
+        const std::string text{std::move(line).str()};
+        m_out << '\r' << text << std::string(m_line_size > text.size() ? m_line_size - text.size() : 0, ' ') << std::flush;
+        m_line_size = text.size();
+
+        if (m_log) {
+            *m_log << std::chrono::duration_cast<std::chrono::milliseconds>(now - m_start).count() << ',' << runs << ','
+                   << m_total_runs << ',' << blocks << ',' << m_runs_per_s << ',' << m_blocks_per_s << ',';
+            if (left) *m_log << left->count();
+            *m_log << std::endl;
+        }
+    }
+
+    /** Count this many runs as done without simulating them, as when stopping early, so that they don't weigh in the
+     * rates. */
+    void Skip(int64_t runs) { m_last_runs += runs; }
+
+    /** How long it should take to simulate the runs left at the current pace, if it is known. */
+    std::optional<std::chrono::milliseconds> TimeLeft(int64_t runs) const
+    {
+        if (runs >= m_total_runs) return 0ms;
+        if (!(m_runs_per_s > 0)) return {};
+        return std::chrono::milliseconds{static_cast<int64_t>((m_total_runs - runs) / m_runs_per_s * 1'000)};
+    }
+
+    /** End the progress line. */
+    void Finish() { m_out << std::endl; }
+};
+
+/** Trace some of the runs of a sweep, handing over the events of each, for instance to write them to a file. */
+struct SweepTraces {
+    //! Trace the runs whose index among all the runs is a multiple of this.
+    int every;
+    //! Called by the workers once each traced run is over, so it must be thread-safe.
+    std::function<void(size_t scenario, int run, std::span<const TraceEvent> events)> write;
+};
+
+/** Simulate every scenario on a pool of worker threads. Chunks of runs are scheduled scenario after scenario,
+ * so workers only ever wait for each other at the very end of the sweep, not at the end of every scenario.
+ *
+ * Run i of every scenario uses the same seed, derived from the sweep's. Beside making the result only depend on
+ * the seed and not on how runs were spread over threads, this makes differences between scenarios less noisy.
+ *
+ * The stats of each scenario are passed to report() as soon as it is done, in the order of the scenarios. If
+ * they are sampled during the runs, the samples are passed too, one row of miners per sample time, along with
+ * what the engine did over all the runs in instrumented builds (see INSTRUMENT) or when sampling rare events.
+ * Progress is printed to the given stream by a ProgressMeter. The workers only count the runs and blocks they
+ * simulate, with relaxed atomic increments which never wait for the thread reporting them.
+ *
+ * If checkpoints are set, the progress of the sweep is saved at their interval and once at the end, and the sweep
+ * can later be resumed from it. On resume, the merged chunks are not simulated again but every scenario is still
+ * reported.
+ *
+ * If traces are set, the events of the runs they pick are recorded by each worker in a buffer of its own, and
+ * handed over at the end of each of these runs.
+ */
+void RunScenarios(std::span<const Scenario> scenarios, const SweepParams& params, std::ostream& progress,
+                  const std::function<void(size_t scenario, std::span<const MinerStatsAccumulator> stats,
+                                           std::span<const MinerStatsAccumulator> samples, const RunCounters& counters)>& report,
+                  const std::optional<SweepProgress>& resume = {}, const std::optional<SweepCheckpoints>& checkpoints = {},
+                  const std::optional<SweepTraces>& traces = {})
+{
+    const int chunks_per_scenario{(params.runs + RUNS_PER_CHUNK - 1) / RUNS_PER_CHUNK};
+    const int chunk_count{chunks_per_scenario * static_cast<int>(scenarios.size())};
+    std::atomic<int> next_chunk{0};
+    std::atomic<uint64_t> simulated_blocks{0};
+    // The stats at the end of the runs come first, followed by those of each sample.
+    const size_t rows{1 + SampleCount(params.duration, params.sample_interval)};
+    // Each chunk only has its stats while it is simulated and until they are merged, which for networks of thousands
+    // of miners would not fit in memory for all the chunks at once.
+    std::vector<std::vector<MinerStatsAccumulator>> chunk_stats(chunk_count);
+    std::vector<RunCounters> chunk_counters(chunk_count);
+    std::vector<std::atomic<bool>> chunk_done(chunk_count), scenario_done(scenarios.size());
+    std::vector<std::atomic<int64_t>> scenario_runs(scenarios.size());
+
+    // The stats of each scenario are merged as soon as each of its chunks and all the chunks before it are done,
+    // starting from where the sweep got if it is resumed. The early stopping criterion is checked after each merged
+    // chunk, so where we stop only depends on the seed too.
+    SweepProgress state;
+    if (resume) {
+        state = *resume;
+    } else {
+        state.merged_chunks.assign(scenarios.size(), 0);
+        state.stats.resize(scenarios.size());
+        for (size_t i{0}; i < scenarios.size(); ++i) {
+            state.stats[i].resize(rows * scenarios[i].miners.size());
+        }
+    }
+    assert(state.merged_chunks.size() == scenarios.size() && state.stats.size() == scenarios.size());
+    const auto final_stats{[&](size_t scenario) {
+        return std::span<const MinerStatsAccumulator>{state.stats[scenario]}.first(scenarios[scenario].miners.size());
+    }};
+    const std::vector<int> first_chunks{state.merged_chunks};
+    std::vector<std::optional<std::vector<double>>> models(scenarios.size());
+    if (params.model_tolerance) std::ranges::transform(scenarios, models.begin(), ModelStaleRates);
+    for (size_t i{0}; i < scenarios.size(); ++i) {
+        assert(state.stats[i].size() == rows * scenarios[i].miners.size() && first_chunks[i] <= chunks_per_scenario);
+        const bool done{first_chunks[i] == chunks_per_scenario || StopEarly(final_stats(i), models[i], params)};
+        scenario_done[i].store(done, std::memory_order_relaxed);
+        scenario_runs[i].store(std::min(params.runs, first_chunks[i] * RUNS_PER_CHUNK), std::memory_order_relaxed);
+    }
+    // The runs of a scenario which stopped early are done too, those skipped included, so that the progress ends at
+    // 100% and the time left only counts the runs which will be simulated.
+    const auto completed_runs{[&] {
+        int64_t runs{0};
+        for (size_t i{0}; i < scenarios.size(); ++i) {
+            runs += scenario_done[i].load(std::memory_order_relaxed) ? params.runs : scenario_runs[i].load(std::memory_order_relaxed);
+        }
+        return runs;
+    }};
+    const int64_t total_runs{int64_t{params.runs} * static_cast<int64_t>(scenarios.size())};
+    ProgressMeter meter{progress, params.progress_log, total_runs, completed_runs()};
+
+    // Start one worker per thread. Each of them keeps picking the next chunk of simulations to run until there
+    // is none left, so a long run never holds up the others. The stats of each chunk are recorded separately,
+    // then merged in order.
+    std::vector<std::thread> workers;
+    for (unsigned t{0}; t < params.threads; ++t) {
+        workers.emplace_back([&] {
+            std::optional<SimulationContext> ctx;
+            size_t ctx_scenario{0};
+            std::vector<MinerStats> stats;
+            RunTrace trace;
+            for (int chunk; (chunk = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunk_count; ) {
+                const size_t scenario{static_cast<size_t>(chunk / chunks_per_scenario)};
+                // Skip the chunks merged before the sweep was resumed.
+                if (chunk % chunks_per_scenario < first_chunks[scenario]) continue;
+                if (!ctx || ctx_scenario != scenario) {
+                    const auto& network{scenarios[scenario]};
+                    ctx.emplace(network.miners, params.duration, network.latencies, params.sample_interval, network.hashrate_changes, params.retarget_period, params.finality_depth, params.reorg_depth);
+                    ctx_scenario = scenario;
+                    stats.resize(scenarios[scenario].miners.size());
+                }
+                auto& totals{chunk_stats[chunk]};
+                if (!scenario_done[scenario].load(std::memory_order_relaxed)) totals.resize(rows * stats.size());
+                const int first_run{chunk % chunks_per_scenario * RUNS_PER_CHUNK};
+                const int end_run{std::min(params.runs, first_run + RUNS_PER_CHUNK)};
+                for (int run{first_run}; run < end_run && !scenario_done[scenario].load(std::memory_order_relaxed); ++run) {
+                    const bool traced{traces && (params.first_run + run) % traces->every == 0};
+                    ctx->trace = traced ? &trace : nullptr;
+                    RunSimulation(*ctx, DeriveSeed(params.seed, params.first_run + run), stats);
+                    if (traced) traces->write(scenario, params.first_run + run, trace.events);
+                    for (size_t j{0}; j < stats.size(); ++j) {
+                        totals[j].Add(stats[j]);
+                    }
+                    for (size_t j{0}; j < ctx->samples.size(); ++j) {
+                        totals[stats.size() + j].Add(ctx->samples[j]);
+                    }
+                    if (INSTRUMENT || params.reorg_depth) chunk_counters[chunk].Merge(ctx->counters);
+                    scenario_runs[scenario].fetch_add(1, std::memory_order_relaxed);
+                    simulated_blocks.fetch_add(ctx->best_chain.size() - 1, std::memory_order_relaxed);
+                }
+                chunk_done[chunk].store(true, std::memory_order_release);
+            }
+        });
+    }
+
+    std::vector<RunCounters> scenario_counters(scenarios.size());
+    auto last_checkpoint{std::chrono::steady_clock::now()};
+    for (size_t reported{0}; reported < scenarios.size(); ) {
+        std::this_thread::sleep_for(200ms);
+        for (size_t i{reported}; i < scenarios.size(); ++i) {
+            auto& merged{state.merged_chunks[i]};
+            while (!scenario_done[i].load(std::memory_order_relaxed) && merged < chunks_per_scenario
+                   && chunk_done[i * chunks_per_scenario + merged].load(std::memory_order_acquire)) {
+                auto& totals{chunk_stats[i * chunks_per_scenario + merged]};
+                for (size_t j{0}; j < state.stats[i].size(); ++j) {
+                    state.stats[i][j].Merge(totals[j]);
+                }
+                std::vector<MinerStatsAccumulator>{}.swap(totals);
+                scenario_counters[i].Merge(chunk_counters[i * chunks_per_scenario + merged]);
+                if (++merged == chunks_per_scenario || StopEarly(final_stats(i), models[i], params)) {
+                    meter.Skip(params.runs - scenario_runs[i].load(std::memory_order_relaxed));
+                    scenario_done[i].store(true, std::memory_order_relaxed);
+                }
+            }
+        }
+        for (; reported < scenarios.size() && scenario_done[reported].load(std::memory_order_relaxed); ++reported) {
+            const std::span<const MinerStatsAccumulator> all_stats{state.stats[reported]};
+            report(reported, final_stats(reported), all_stats.subspan(scenarios[reported].miners.size()), scenario_counters[reported]);
+        }
+        meter.Report(completed_runs(), simulated_blocks.load(std::memory_order_relaxed));
+        if (checkpoints && std::chrono::steady_clock::now() - last_checkpoint >= checkpoints->interval) {
+            checkpoints->save(state);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+    }
+    meter.Finish();
+    if (checkpoints) checkpoints->save(state);
+
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
@@ -1,17 +1,24 @@
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <concepts>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <new>
+#include <numeric>
 #include <ranges>
 
-#include "simulation.h"
+#include "allocations.h"
+#include "gpu.h"
 
 // Analyze a sample of the distribution of blocks found per miners, to check we are indistinguishable from
 // the expected distribution. Here we generate a 100 millions blocks with a 100 miners each with 1% of the
 // network hashrate. The number of blocks found by a miner is a binomial distribution with p=0.01 and n=100 million.
-// We therefore expect a sample mean of 1 million and a standard deviation of 1000. This requires libc++ to compile.
+// We therefore expect a sample mean of 1 million and a standard deviation of 1000.
 void MinerPickerSample()
 {
     std::random_device rd;
@@ -21,19 +28,18 @@ void MinerPickerSample()
     std::vector<Miner> miners;
     for (int i{0}; i < 100; ++i) {
         miners.emplace_back(i, 1, 0s);
-        miners.back().chain.pop_back(); // drop the genesis block
-        miners.back().chain.reserve((TOTAL_BLOCK_COUNT + 99) / 100);
     }
 
+    const FinderSampler sampler{miners};
+    std::vector<size_t> found_blocks(miners.size());
     for (int i{0}; i < TOTAL_BLOCK_COUNT; ++i) {
-        auto& miner{PickFinder(miners, rng)};
-        miner.FoundBlock(0ms, 0);
+        found_blocks[PickFinder(sampler, rng)]++;
     }
 
     double mean{0.0}, squared_mean{0.0};
     std::map<size_t, int> block_counts;
     for (const auto& miner: miners) {
-        const auto block_count{miner.chain.size()};
+        const auto block_count{found_blocks[miner.id]};
         mean += block_count;
         squared_mean += block_count * block_count;
         auto pair{block_counts.try_emplace(block_count, 0)};
@@ -43,7 +49,7 @@ void MinerPickerSample()
     squared_mean /= static_cast<double>(miners.size());
 
     const double variance{squared_mean - mean * mean};
-    std::vector sorted_block_counts = miners | std::views::transform([](const Miner& m){ return m.chain.size(); }) | std::ranges::to<std::vector<double>>();
+    std::vector<double> sorted_block_counts(found_blocks.begin(), found_blocks.end());
     std::ranges::sort(sorted_block_counts);
     const double median{(sorted_block_counts[48] + sorted_block_counts[49]) / 2.0};
     std::cout << std::fixed << "Mean " << mean << ", std dev " << std::sqrt(variance) << ", median " << median << std::endl;
@@ -68,7 +74,7 @@ void MinerPickerSample()
 void MinerPickerSmallBig()
 {
     std::random_device rd;
-    RNG rng{rd()};
+    UniformStream rng{rd()};
     constexpr int SAMPLE_COUNT{10'000};
     constexpr int SAMPLE_SIZE{1'000};
     constexpr int TOTAL_BLOCK_COUNT{100};
@@ -79,24 +85,21 @@ void MinerPickerSmallBig()
     miners.emplace_back(2, 20, 0s);
     miners.emplace_back(3, 15, 0s);
     miners.emplace_back(4, 35, 0s);
-    for (auto& miner: miners) {
-        miner.chain.reserve((TOTAL_BLOCK_COUNT + 99) / 100);
-        miner.chain.pop_back(); // drop the genesis block
-    }
 
+    const FinderSampler sampler{miners};
     std::vector<double> sample_means(miners.size()), sample_squared_means(miners.size());
+    std::vector<size_t> found_blocks(miners.size());
     for (int k{0}; k < SAMPLE_COUNT; ++k) {
         std::vector<double> means(miners.size());
         for (int j{0}; j < SAMPLE_SIZE; ++j) {
             for (int i{0}; i < TOTAL_BLOCK_COUNT; ++i) {
-                auto& miner{PickFinder(miners, rng)};
-                miner.FoundBlock(0ms, 0);
+                found_blocks[PickFinder(sampler, rng)]++;
             }
 
             for (size_t i{0}; i < miners.size(); ++i) {
-                const auto block_count{miners[i].chain.size()};
+                const auto block_count{found_blocks[i]};
                 means[i] += block_count;
-                miners[i].chain.clear();
+                found_blocks[i] = 0;
             }
         }
 
@@ -131,6 +134,7 @@ void SimpleSim()
     miners.emplace_back(2, 20, 0s);
     miners.emplace_back(3, 15, 0s);
     miners.emplace_back(4, 35, 0s);
+    const FinderSampler sampler{miners};
 
     std::vector<double> sample_means(miners.size()), sample_squared_means(miners.size());
     for (int counter1{0}; counter1 < SAMPLE_COUNT; ++counter1) {
@@ -139,31 +143,34 @@ void SimpleSim()
             // Reproduce a simplified version of the simulation in main.cpp. No selfish mining and steps of 1s.
             std::random_device rd;
             RNG block_interval{rd()}, miner_picker{rd()};
+            BlockTree tree;
+            BestChain best_chain;
             std::chrono::milliseconds next_block_time{NextBlockInterval(block_interval)};
             for (std::chrono::milliseconds cur_time{0}; cur_time < SIM_DURATION; cur_time += 1s) {
                 while (cur_time >= next_block_time) {
-                    Miner& miner{PickFinder(miners, miner_picker)};
-                    miner.FoundBlock(next_block_time, /*best_chain_size=*/0); // best chain size 0 since no selfish mining
+                    Miner& miner{miners[PickFinder(sampler, miner_picker)]};
+                    HonestStrategy::FoundBlock(miner, tree, best_chain, next_block_time);
                     next_block_time += NextBlockInterval(block_interval);
                 }
 
-                std::span<const Block> best_chain;
+                BlockIndex best_tip{BlockTree::GENESIS};
                 for (const auto& miner: miners) {
-                    const auto pub_chain{miner.PublishedChain(cur_time)};
-                    const bool more_work{pub_chain.size() > best_chain.size()};
-                    const bool first_seen{pub_chain.size() == best_chain.size() && !pub_chain.empty() && pub_chain.back().arrival < best_chain.back().arrival};
+                    const auto pub_tip{miner.PublishedTip(tree, cur_time)};
+                    const bool more_work{tree.Height(pub_tip) > tree.Height(best_tip)};
+                    const bool first_seen{tree.Height(pub_tip) == tree.Height(best_tip) && tree.Arrival(pub_tip) < tree.Arrival(best_tip)};
                     if (more_work || first_seen) {
-                        best_chain = pub_chain;
+                        best_tip = pub_tip;
                     }
                 }
+                best_chain.SetTip(tree, best_tip);
                 for (auto& miner: miners) {
-                    miner.NotifyBestChain(best_chain, cur_time);
+                    miner.MaybeReorg(tree, best_chain);
                 }
             }
 
             for (size_t i{0}; i < miners.size(); ++i) {
-                means[i] += miners[i].BlocksFoundShare(SIM_DURATION);
-                miners[i].chain.clear();
+                means[i] += miners[i].BlocksFoundShare(best_chain);
+                miners[i].tip = BlockTree::GENESIS;
             }
         }
 
@@ -186,12 +193,12 @@ void SimpleSim()
     }
 }
 
-// Analyze a sample of the distribution of interval between blocks. We expect the mean to be 600'000 ms on average and
-// the standard deviation to be the same as this is an exponential distribution.
+// Analyze a sample of the distribution of interval between blocks, as drawn in batches by the simulation. We expect the
+// mean to be 600'000 ms on average and the standard deviation to be the same as this is an exponential distribution.
 void BlockIntervalSample()
 {
     std::random_device rd;
-    RNG rng{rd()};
+    ExponentialStream rng{rd()};
     constexpr int SAMPLE_SIZE{100'000'000};
 
     double mean{0.0}, squared_mean{0.0};
@@ -207,6 +214,31 @@ void BlockIntervalSample()
     std::cout << std::fixed << "Mean " << mean << " std dev " << std::sqrt(variance) << std::endl;
 }
 
+/** Extend the chain ending at `parent` with the given (miner id, arrival) blocks. Returns the new tip. */
+BlockIndex ExtendChain(BlockTree& tree, BlockIndex parent, std::initializer_list<std::pair<unsigned, std::chrono::milliseconds>> blocks)
+{
+    for (const auto& [miner_id, arrival]: blocks) {
+        parent = tree.Append(miner_id, arrival, parent);
+    }
+    return parent;
+}
+
+/** A block as its (miner id, arrival), to compare the content of chains. */
+using ChainBlock = std::pair<unsigned, std::chrono::milliseconds>;
+static const ChainBlock GENESIS_BLOCK{BlockTree::NO_MINER, 0s};
+
+/** Get the chain ending at the given tip as a list of blocks, starting from the genesis. */
+std::vector<ChainBlock> GetChain(const BlockTree& tree, BlockIndex tip)
+{
+    std::vector<ChainBlock> chain;
+    for (BlockIndex i{tip}; ; i = tree.Parent(i)) {
+        chain.emplace_back(tree.MinerId(i), tree.Arrival(i));
+        if (i == BlockTree::GENESIS) break;
+    }
+    std::ranges::reverse(chain);
+    return chain;
+}
+
 /** Test our implementation of the "worst case" (gamma=0) selfish mining strategy. This goes over all the possible state in
  * model presented in section 4.2 of the 2013 paper. We also exercise some scenarii not present in the 2013 paper's model.
  */
@@ -215,157 +247,1557 @@ void TestSelfishStrategy()
     constexpr int SM_ID{0}, OTHERS_ID{1};
     constexpr std::chrono::milliseconds SM_PROP_TIME{100ms};
     Miner selfish_miner{SM_ID, 35, SM_PROP_TIME, true};
+    BlockTree tree;
 
     /** Case (a), any state but two branches of length 1, pool finds a block. */
     // Start with a public chain of 2 blocks (+ genesis)
-    selfish_miner.chain.emplace_back(OTHERS_ID, 600s);
-    selfish_miner.chain.emplace_back(SM_ID, 600s * 2);
+    const BlockIndex public_tip{ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s * 2}})};
+    selfish_miner.SetTip(tree, public_tip);
 
     // Private fork of 0 block, best chain fork of 0 block, pool finds a block. "The pool appends
     // one block to its private branch, increasing its lead on the public branch by one."
-    selfish_miner.FoundBlock(600s * 3, selfish_miner.chain.size());
-    assert(selfish_miner.chain.size() == 4);
-    assert(selfish_miner.chain[3].miner_id == SM_ID && selfish_miner.chain[3].arrival == SELFISH_ARRIVAL);
+    SelfishStrategy::FoundBlock(selfish_miner, tree, BestChain{tree, public_tip}, 600s * 3);
+    assert(selfish_miner.ChainSize(tree) == 4);
+    assert(tree.MinerId(selfish_miner.tip) == SM_ID && tree.Arrival(selfish_miner.tip) == SELFISH_ARRIVAL);
 
     // Private chain of 1 block, best chain fork of 0 block, pool finds a block. "The pool appends
     // one block to its private branch, increasing its lead on the public branch by one."
-    selfish_miner.FoundBlock(600s * 4, 3);
-    assert(selfish_miner.chain.size() == 5);
-    std::vector<Block> expected_chain{Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)};
-    assert(selfish_miner.chain == expected_chain);
+    SelfishStrategy::FoundBlock(selfish_miner, tree, BestChain{tree, public_tip}, 600s * 4);
+    assert(selfish_miner.ChainSize(tree) == 5 && selfish_miner.SelfishBlocks() == 2);
+    std::vector<ChainBlock> expected_chain{GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}};
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case (b), was two branches of length 1, pool finds a block. */
     // Set the chain of the selfish miner accordingly to a 4 blocks best chain and its 1-block fork on top.
-    selfish_miner.chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, SELFISH_ARRIVAL)};
+    BlockIndex base_tip{ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}})};
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}}));
+
+    // Now the selfish miner finds a block. "The pool publishes its secret branch of length two". The rest of the
+    // miners have a 1-block fork too.
+    const BlockIndex others_fork{ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*5}})};
+    SelfishStrategy::FoundBlock(selfish_miner, tree, BestChain{tree, others_fork}, 600s * 6);
+    expected_chain = {
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3},
+        ChainBlock{SM_ID, 600s*6 + SM_PROP_TIME}, ChainBlock{SM_ID, 600s*6 + SM_PROP_TIME}
+    };
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
+    assert(selfish_miner.SelfishBlocks() == 0);
 
-    // Now the selfish miner finds a block. "The pool publishes its secret branch of length two".
-    selfish_miner.FoundBlock(600s * 6, 5); // best chain size is 5 cause the rest of the miners have a 1-block fork too.
+    /** Case (b) again, but the pool already published its block of the race. "The pool publishes its secret
+     * branch" which is now only the new block. */
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, 600s*5 + SM_PROP_TIME}}));
+    SelfishStrategy::FoundBlock(selfish_miner, tree, BestChain{tree, ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*5}})}, 600s * 6);
     expected_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3),
-        Block(SM_ID, 600s*6 + SM_PROP_TIME), Block(SM_ID, 600s*6 + SM_PROP_TIME)
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3},
+        ChainBlock{SM_ID, 600s*5 + SM_PROP_TIME}, ChainBlock{SM_ID, 600s*6 + SM_PROP_TIME}
     };
-    assert(selfish_miner.chain == expected_chain);
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case (c), was two branches of length 1, others find a block after pool head. */
-    // This never happens in our simulation since we only implement gamma=0
+    // Honest miners decide on which branch to mine, this is tested with the whole engine in TestSelfishGamma().
 
     /** Case (d), was two branches of length 1, others find a block after others’ head. */
     // Set the chain of the selfish miner accordingly to a 4 blocks best chain and its 1-block fork on top.
-    selfish_miner.chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, SELFISH_ARRIVAL)};
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}}));
 
     // Now the selfish miner is notified of a longer best chain with the last two blocks being the others'. He
     // switches to mining on top of it.
-    std::vector<Block> best_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(OTHERS_ID, 600s*4), Block(OTHERS_ID, 600s*5)};
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*5);
-    assert(selfish_miner.chain == best_chain);
+    BlockIndex best_tip{ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*4}, {OTHERS_ID, 600s*5}})};
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*5);
+    assert(selfish_miner.tip == best_tip);
 
     /** Case (e), no private branch, others find a block. */
     // Set the chain of the selfish miner accordingly to a 5 blocks best chain with no private fork on top.
-    selfish_miner.chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, 600s*4)};
+    selfish_miner.SetTip(tree, ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}, {SM_ID, 600s*4}}));
 
     // Now the selfish miner is notified of a longer best chain with the last block being the other's. He
     // switches to mining on top of it.
-    best_chain = selfish_miner.chain;
-    best_chain.emplace_back(OTHERS_ID, 600s*5);
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*5);
-    assert(selfish_miner.chain == best_chain);
+    best_tip = ExtendChain(tree, selfish_miner.tip, {{OTHERS_ID, 600s*5}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*5);
+    assert(selfish_miner.tip == best_tip);
 
     /** Case (f), lead was 1, others find a block. "Now there are two branches of length one, and the pool
      * publishes its single secret block." */
     // Set the chain of the selfish miner accordingly to a 3 blocks best chain with a 1-block private fork on top.
-    selfish_miner.chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, SELFISH_ARRIVAL)};
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}}));
 
     // Now the selfish miner is notified of an equal-size best chain with the last block being the others'. He reveals
     // his last block and continues mining on top of it.
-    best_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3)};
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*3);
-    expected_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, 600s*3 + SM_PROP_TIME)};
-    assert(selfish_miner.chain == expected_chain);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*3}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*3);
+    expected_chain = {GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{SM_ID, 600s*3 + SM_PROP_TIME}};
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case (g), lead was 2, others find a block. "The others almost close the gap as the lead drops to 1.
      * The pool publishes its secret blocks, causing everybody to start mining at the head of the previously
      * private branch, since it is longer". */
     // Set the chain of the selfish miner accordingly to a 3 blocks best chain with a 2-blocks private fork on top.
-    selfish_miner.chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)};
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}}));
 
     // Now the selfish miner is notified of a best public chain with only one block less than his private chain.
     // He reveals all his private blocks.
-    best_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3)};
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*3);
-    expected_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, 600s*3 + SM_PROP_TIME), Block(SM_ID, 600s*3 + SM_PROP_TIME)};
-    assert(selfish_miner.chain == expected_chain);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*3}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*3);
+    expected_chain = {GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{SM_ID, 600s*3 + SM_PROP_TIME}, ChainBlock{SM_ID, 600s*3 + SM_PROP_TIME}};
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case (h), lead was more than 2, others win. The others decrease the lead, which remains at least two.
      * The new block (say with number i) will end outside the chain once the pool publishes its entire branch. */
     // Set the chain of the selfish miner accordingly to a 3 blocks best chain with a 3-block private fork on top.
-    selfish_miner.chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, SELFISH_ARRIVAL),
-        Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
-    };
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}}));
 
     // Now the selfish miner is notified of a best public chain with two blocks less than his private chain. He reveals
     // the oldest block and keeps mining on its private fork.
-    best_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3)};
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*3);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*3}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*3);
     expected_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(SM_ID, 600s*3 + SM_PROP_TIME),
-        Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{SM_ID, 600s*3 + SM_PROP_TIME},
+        ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}
     };
-    assert(selfish_miner.chain == expected_chain);
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
+    assert(selfish_miner.SelfishBlocks() == 2);
 
     // Set the chain of the selfish miner accordingly to a 4 blocks best chain with a 5-block private fork on top.
-    selfish_miner.chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, SELFISH_ARRIVAL),
-        Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
-    };
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {
+        {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}
+    }));
 
     // Now the selfish miner is notified of a best public chain with four blocks less than his private chain. He reveals
     // the oldest block and keeps mining on its private fork.
-    best_chain = {Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(OTHERS_ID, 600s*4)};
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*4);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*4}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*4);
     expected_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, 600s*4 + SM_PROP_TIME),
-        Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3}, ChainBlock{SM_ID, 600s*4 + SM_PROP_TIME},
+        ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}
     };
-    assert(selfish_miner.chain == expected_chain);
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case absent from the paper. Same as above but the rest of the network found two blocks in a row. */
     // Set the chain of the selfish miner accordingly to a 4 blocks best chain with a 5-block private fork on top.
-    selfish_miner.chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, SELFISH_ARRIVAL),
-        Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
-    };
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {
+        {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}
+    }));
 
     // Now the selfish miner is notified of a best public chain with four blocks less than his private chain. He reveals
     // the oldest block and keeps mining on its private fork.
-    best_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3),
-        Block(OTHERS_ID, 600s*4), Block(OTHERS_ID, 600s*5)
-    };
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*5);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*4}, {OTHERS_ID, 600s*5}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*5);
     expected_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, 600s*5 + SM_PROP_TIME),
-        Block(SM_ID, 600s*5 + SM_PROP_TIME), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL), Block(SM_ID, SELFISH_ARRIVAL)
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3}, ChainBlock{SM_ID, 600s*5 + SM_PROP_TIME},
+        ChainBlock{SM_ID, 600s*5 + SM_PROP_TIME}, ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}, ChainBlock{SM_ID, SELFISH_ARRIVAL}
     };
-    assert(selfish_miner.chain == expected_chain);
+    assert(GetChain(tree, selfish_miner.tip) == expected_chain);
 
     /** Case absent from the paper. Selfish miner has a 1-block lead and other miners find two blocks in a row. */
     // Set the chain of the selfish miner accordingly to a 4 blocks best chain with a 1-block private fork on top.
-    selfish_miner.chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3), Block(SM_ID, SELFISH_ARRIVAL),
-    };
+    base_tip = ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}});
+    selfish_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}}));
 
     // Now the selfish miner is notified of a best public chain with 1 block more than his private one. He switches to it.
-    best_chain = {
-        Block::Genesis(), Block(OTHERS_ID, 600s), Block(SM_ID, 600s*2), Block(OTHERS_ID, 600s*3),
-        Block(OTHERS_ID, 600s*4), Block(OTHERS_ID, 600s*5)
-    };
-    selfish_miner.NotifyBestChain({best_chain.begin(), best_chain.end()}, 600s*5);
-    assert(selfish_miner.chain == best_chain);
+    best_tip = ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*4}, {OTHERS_ID, 600s*5}});
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, best_tip}, 600s*5);
+    assert(selfish_miner.tip == best_tip && selfish_miner.SelfishBlocks() == 0);
 
     std::cout << "Selfish mining strategy tests passed." << std::endl;
 }
 
+/** Test the variants of the selfish mining strategy from the 2016 "Stubborn Mining" paper, in the states where they
+ * differ from the regular strategy. */
+void TestStubbornStrategies()
+{
+    constexpr int SM_ID{0}, OTHERS_ID{1};
+    constexpr std::chrono::milliseconds SM_PROP_TIME{100ms};
+    BlockTree tree;
+    const BlockIndex base_tip{ExtendChain(tree, BlockTree::GENESIS, {{OTHERS_ID, 600s}, {SM_ID, 600s*2}, {OTHERS_ID, 600s*3}})};
+
+    /** Equal-fork stubborn: in a race, the pool keeps the block it finds to itself. */
+    Miner equal_fork_miner{SM_ID, 35, SM_PROP_TIME, true, {.equal_fork_stubborn = true}};
+    equal_fork_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, 600s*5 + SM_PROP_TIME}}));
+    const BlockIndex others_fork{ExtendChain(tree, base_tip, {{OTHERS_ID, 600s*5}})};
+    SelfishStrategy::FoundBlock(equal_fork_miner, tree, BestChain{tree, others_fork}, 600s * 6);
+    std::vector<ChainBlock> expected_chain{
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3},
+        ChainBlock{SM_ID, 600s*5 + SM_PROP_TIME}, ChainBlock{SM_ID, SELFISH_ARRIVAL}
+    };
+    assert(GetChain(tree, equal_fork_miner.tip) == expected_chain);
+
+    /** Lead stubborn: when the lead drops from 2 to 1, the pool only reveals one block to match the others'. */
+    Miner lead_miner{SM_ID, 35, SM_PROP_TIME, true, {.lead_stubborn = true}};
+    lead_miner.SetTip(tree, ExtendChain(tree, base_tip, {{SM_ID, SELFISH_ARRIVAL}, {SM_ID, SELFISH_ARRIVAL}}));
+    const auto revealed{SelfishStrategy::OnBestChain(lead_miner, tree, BestChain{tree, others_fork}, 600s*5)};
+    expected_chain = {
+        GENESIS_BLOCK, ChainBlock{OTHERS_ID, 600s}, ChainBlock{SM_ID, 600s*2}, ChainBlock{OTHERS_ID, 600s*3},
+        ChainBlock{SM_ID, 600s*5 + SM_PROP_TIME}, ChainBlock{SM_ID, SELFISH_ARRIVAL}
+    };
+    assert(GetChain(tree, lead_miner.tip) == expected_chain);
+    assert(revealed == tree.Parent(lead_miner.tip));
+
+    /** Trail stubborn: the pool keeps mining on its branch as long as it's not too far behind. */
+    Miner trail_miner{SM_ID, 35, SM_PROP_TIME, true, {.trail_stubbornness = 1}};
+    const BlockIndex pool_fork{ExtendChain(tree, base_tip, {{SM_ID, 600s*5 + SM_PROP_TIME}})};
+    trail_miner.SetTip(tree, pool_fork);
+    const BlockIndex others_lead{ExtendChain(tree, others_fork, {{OTHERS_ID, 600s*6}})};
+    SelfishStrategy::OnBestChain(trail_miner, tree, BestChain{tree, others_lead}, 600s*6);
+    assert(trail_miner.tip == pool_fork && trail_miner.stale_blocks == 0);
+
+    // If it catches up, it publishes its branch to start a race.
+    SelfishStrategy::FoundBlock(trail_miner, tree, BestChain{tree, others_lead}, 600s * 7);
+    assert(tree.Parent(trail_miner.tip) == pool_fork && tree.Arrival(trail_miner.tip) == 600s*7 + SM_PROP_TIME);
+
+    // If the others get further ahead, it gives up on its branch.
+    trail_miner.SetTip(tree, pool_fork);
+    const BlockIndex others_big_lead{ExtendChain(tree, others_lead, {{OTHERS_ID, 600s*7}})};
+    SelfishStrategy::OnBestChain(trail_miner, tree, BestChain{tree, others_big_lead}, 600s*7);
+    assert(trail_miner.tip == others_big_lead && trail_miner.stale_blocks == 1);
+
+    // Nothing changes for a regular selfish miner in the same situation.
+    Miner selfish_miner{SM_ID, 35, SM_PROP_TIME, true};
+    selfish_miner.SetTip(tree, pool_fork);
+    SelfishStrategy::OnBestChain(selfish_miner, tree, BestChain{tree, others_lead}, 600s*6);
+    assert(selfish_miner.tip == others_lead && selfish_miner.stale_blocks == 1);
+
+    std::cout << "Stubborn mining strategies tests passed." << std::endl;
+}
+
+/** Compare the revenue of a selfish miner to the closed form given in the 2013 paper, for various gammas. Blocks
+ * propagate instantly so that the honest miners don't have forks of their own. */
+void TestSelfishGamma()
+{
+    constexpr double ALPHA{0.4};
+    for (const float gamma: {0.0f, 0.5f, 1.0f}) {
+        std::vector<Miner> miners;
+        miners.emplace_back(0, ALPHA * 100, 0s, true, SelfishParams{.gamma = gamma});
+        miners.emplace_back(1, (1 - ALPHA) * 100, 0s);
+        SimulationContext ctx{miners, std::chrono::weeks{8}};
+        std::vector<MinerStats> stats(miners.size());
+        RunningStats share;
+        for (int i{0}; i < 200; ++i) {
+            RunSimulation(ctx, DeriveSeed(7, i), stats);
+            share.Add(stats[0].blocks_share);
+        }
+        const double expected{(ALPHA * std::pow(1 - ALPHA, 2) * (4 * ALPHA + gamma * (1 - 2 * ALPHA)) - std::pow(ALPHA, 3))
+                              / (1 - ALPHA * (1 + (2 - ALPHA) * ALPHA))};
+        assert(std::abs(share.mean - expected) < 0.005);
+    }
+
+    std::cout << "Selfish mining gamma tests passed." << std::endl;
+}
+
+/** The blocks of each miner in the best chain must stay counted right as it is extended and reorged. */
+void TestBestChain()
+{
+    BlockTree tree;
+    const auto fork_point{ExtendChain(tree, BlockTree::GENESIS, {{0, 1s}, {1, 2s}})};
+    const auto first_branch{ExtendChain(tree, fork_point, {{0, 3s}, {0, 4s}})};
+    const auto second_branch{ExtendChain(tree, fork_point, {{2, 3s}, {1, 4s}, {2, 5s}})};
+
+    // The blocks of each miner are counted as the best chain changes.
+    BestChain best_chain{tree, first_branch};
+    assert(best_chain.BlocksFound(0) == 3 && best_chain.BlocksFound(1) == 1 && best_chain.BlocksFound(2) == 0);
+    best_chain.SetTip(tree, second_branch);
+    assert(best_chain.BlocksFound(0) == 1 && best_chain.BlocksFound(1) == 2 && best_chain.BlocksFound(2) == 2);
+    best_chain.SetTip(tree, tree.Parent(first_branch));
+    assert(best_chain.size() == 4 && best_chain.BlocksFound(0) == 2 && best_chain.BlocksFound(2) == 0);
+    const auto next{ExtendChain(tree, second_branch, {{0, 6s}})};
+    best_chain.SetTip(tree, second_branch);
+    best_chain.Extend(tree, next);
+    assert(best_chain.Tip() == next && best_chain.size() == 7 && best_chain.BlocksFound(0) == 2);
+    best_chain.clear();
+    assert(best_chain.BlocksFound(0) == 0 && best_chain.BlocksFound(1) == 0 && best_chain.BlocksFound(7) == 0);
+
+    // They match the content of the best chain at the end of a run.
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 40, 20s, true);
+    miners.emplace_back(1, 35, 10s);
+    miners.emplace_back(2, 25, 30s);
+    SimulationContext ctx{miners, std::chrono::weeks{4}};
+    std::vector<MinerStats> stats(miners.size());
+    for (uint64_t seed{0}; seed < 10; ++seed) {
+        RunSimulation(ctx, seed, stats);
+        std::vector<long> blocks_found(miners.size());
+        for (BlockIndex i{ctx.best_chain.Tip()}; i != BlockTree::GENESIS; i = ctx.tree.Parent(i)) {
+            ++blocks_found[ctx.tree.MinerId(i)];
+        }
+        for (size_t i{0}; i < miners.size(); ++i) {
+            assert(stats[i].blocks_found == blocks_found[i]);
+            assert(stats[i].blocks_share == static_cast<double>(blocks_found[i]) / (ctx.best_chain.size() - 1));
+        }
+    }
+
+    std::cout << "Best chain tests passed." << std::endl;
+}
+
+/** Run counters must record reorgs and blocks in flight as they happen, and add up over runs. */
+void TestRunCounters()
+{
+    BlockTree tree;
+    const auto fork_point{ExtendChain(tree, BlockTree::GENESIS, {{0, 1s}, {1, 2s}})};
+    const auto first_branch{ExtendChain(tree, fork_point, {{0, 3s}, {0, 4s}})};
+    const auto second_branch{ExtendChain(tree, fork_point, {{2, 3s}, {1, 4s}, {2, 5s}})};
+
+    // Extending the best chain is not a reorg, switching to another branch is one as deep as the blocks it drops.
+    RunCounters counters{.runs = 1};
+    BestChain best_chain{tree, fork_point};
+    best_chain.SetTip(tree, first_branch);
+    counters.OnNewTip(ReorgDepth(tree, best_chain, fork_point));
+    assert(counters.reorgs == 0 && counters.reorged_blocks == 0);
+    best_chain.SetTip(tree, second_branch);
+    counters.OnNewTip(ReorgDepth(tree, best_chain, first_branch));
+    assert(counters.reorgs == 1 && counters.reorged_blocks == 2 && counters.max_reorg_depth == 2);
+    counters.SetInFlight(3);
+    counters.SetInFlight(1);
+    assert(counters.in_flight == 1 && counters.max_in_flight == 3);
+
+    // Counts add up over runs, maximums are kept.
+    RunCounters total;
+    total.Merge(counters);
+    total.Merge(RunCounters{.runs = 1, .events = 10, .reorgs = 1, .reorged_blocks = 1, .max_reorg_depth = 1, .max_in_flight = 2});
+    assert(total.runs == 2 && total.events == 10 && total.reorgs == 2 && total.reorged_blocks == 3);
+    assert(total.max_reorg_depth == 2 && total.max_in_flight == 3);
+
+    // In instrumented builds, every block found is an event of the run in both engines.
+    if constexpr (INSTRUMENT) {
+        std::vector<Miner> miners;
+        miners.emplace_back(0, 40, 20s);
+        miners.emplace_back(1, 60, 10s);
+        for (const bool selfish: {false, true}) {
+            miners[0].is_selfish = selfish;
+            SimulationContext ctx{miners, std::chrono::weeks{4}};
+            std::vector<MinerStats> stats(miners.size());
+            RunSimulation(ctx, 42, stats);
+            const auto blocks{ctx.tree.size() - 1};
+            assert(ctx.counters.runs == 1 && ctx.counters.events >= blocks && ctx.counters.max_in_flight > 0);
+            assert(selfish || ctx.counters.events <= 2 * blocks);
+        }
+    }
+
+    std::cout << "Run counters tests passed." << std::endl;
+}
+
+/** The alias table must give every miner exactly its share of the hashrate, including for tiny shares. */
+void TestFinderSampler()
+{
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 30, 0s);
+    miners.emplace_back(1, 29.65, 0s);
+    miners.emplace_back(2, 40, 0s);
+    miners.emplace_back(3, 0.3, 0s);
+    miners.emplace_back(4, 0.05, 0s);
+    const FinderSampler sampler{miners};
+    for (size_t i{0}; i < miners.size(); ++i) {
+        assert(std::abs(sampler.Probability(i) - miners[i].perc / 100) < 1e-12);
+    }
+
+    // A miner without any hashrate is never picked, including for extreme random values.
+    miners.emplace_back(5, 0, 0s);
+    const FinderSampler zero_sampler{miners};
+    assert(zero_sampler.Probability(5) == 0.0);
+    for (const uint64_t random: {uint64_t{0}, std::numeric_limits<uint64_t>::max(), uint64_t{1} << 63}) {
+        assert(zero_sampler.Pick(random) != 5);
+    }
+
+    // Shares are normalized.
+    miners.clear();
+    for (unsigned i{0}; i < 1'000; ++i) {
+        miners.emplace_back(i, 1, 0s);
+    }
+    FinderSampler uniform_sampler{miners};
+    for (size_t i{0}; i < miners.size(); ++i) {
+        assert(std::abs(uniform_sampler.Probability(i) - 0.001) < 1e-12);
+    }
+
+    // Rebuilding the sampler for another distribution gives the same probabilities as building it anew, without
+    // allocating.
+    for (auto& miner: miners) miner.perc = miner.id % 3;
+    const auto allocations_before{g_allocations.load()};
+    uniform_sampler.Rebuild(miners);
+    assert(g_allocations.load() == allocations_before);
+    const FinderSampler rebuilt_sampler{miners};
+    for (size_t i{0}; i < miners.size(); ++i) {
+        assert(uniform_sampler.Probability(i) == rebuilt_sampler.Probability(i));
+        assert(std::abs(uniform_sampler.Probability(i) - (i % 3) / 999.0) < 1e-12);
+    }
+
+    std::cout << "Finder sampler tests passed." << std::endl;
+}
+
+/** Once a simulation context was created, running simulations with it should not make any heap allocation. */
+void TestSimulationAllocations()
+{
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 40, 1s, true);
+    miners.emplace_back(1, 30, 1s);
+    miners.emplace_back(2, 20, 10s);
+    miners.emplace_back(3, 10, 0s);
+    std::vector<MinerStats> stats(miners.size());
+
+    // Both with and without a selfish miner, as honest networks take a faster path.
+    SimulationContext ctx{miners, std::chrono::weeks{2}};
+    miners[0].is_selfish = false;
+    SimulationContext honest_ctx{miners, std::chrono::weeks{2}};
+
+    const auto allocations_before{g_allocations.load()};
+    for (int i{0}; i < 100; ++i) {
+        RunSimulation(ctx, i, stats);
+        RunSimulation(honest_ctx, i, stats);
+    }
+    assert(g_allocations.load() == allocations_before);
+
+    std::cout << "Simulation allocations tests passed." << std::endl;
+}
+
+/** Runs with the same seed must give the exact same result, whatever the runs in between. */
+void TestReproducibleRuns()
+{
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 40, 1s, true);
+    miners.emplace_back(1, 35, 2s);
+    miners.emplace_back(2, 25, 10s);
+    SimulationContext ctx{miners, std::chrono::weeks{4}};
+
+    const auto run{[&](uint64_t seed) {
+        std::vector<MinerStats> stats(miners.size());
+        RunSimulation(ctx, DeriveSeed(42, seed), stats);
+        return stats;
+    }};
+    const auto same_stats{[](const std::vector<MinerStats>& a, const std::vector<MinerStats>& b) {
+        return std::ranges::equal(a, b, [](const MinerStats& x, const MinerStats& y) {
+            return x.blocks_found == y.blocks_found && x.blocks_share == y.blocks_share && x.stale_rate == y.stale_rate;
+        });
+    }};
+
+    const auto first{run(0)}, second{run(1)};
+    assert(!same_stats(first, second));
+    assert(same_stats(run(1), second));
+    assert(same_stats(run(0), first));
+
+    // Derived seeds must not collide, neither across indexes nor across parent seeds.
+    assert(DeriveSeed(0, 1) != DeriveSeed(1, 0));
+    assert(DeriveSeed(0, 0) != DeriveSeed(0, 1));
+
+    std::cout << "Reproducible runs tests passed." << std::endl;
+}
+
+/** Sampling the stats during a run must not change its outcome, nor allocate. */
+void TestSampling()
+{
+    assert(SampleCount(std::chrono::weeks{8}, std::chrono::weeks{2}) == 3);
+    assert(SampleCount(std::chrono::weeks{8}, std::chrono::weeks{3}) == 2);
+    assert(SampleCount(std::chrono::weeks{2}, std::chrono::weeks{2}) == 0);
+    assert(SampleCount(std::chrono::weeks{8}, {}) == 0);
+
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 40, 1s, true);
+    miners.emplace_back(1, 35, 2s);
+    miners.emplace_back(2, 25, 10s);
+    LinkLatency links[]{{1, 2, 100ms}};
+    const auto check{[&](std::span<const LinkLatency> links) {
+        SimulationContext ctx{miners, std::chrono::weeks{8}, links};
+        SimulationContext sampled_ctx{miners, std::chrono::weeks{8}, links, std::chrono::weeks{2}};
+        assert(ctx.samples.empty() && sampled_ctx.SampleCount() == 3 && sampled_ctx.samples.size() == 3 * miners.size());
+        assert(sampled_ctx.SampleTime(0) == std::chrono::weeks{2} && sampled_ctx.SampleTime(2) == std::chrono::weeks{6});
+
+        std::vector<MinerStats> stats(miners.size()), sampled_stats(miners.size());
+        for (int i{0}; i < 10; ++i) {
+            RunSimulation(ctx, DeriveSeed(42, i), stats);
+            const auto allocations_before{g_allocations.load()};
+            RunSimulation(sampled_ctx, DeriveSeed(42, i), sampled_stats);
+            assert(g_allocations.load() == allocations_before);
+            for (size_t j{0}; j < miners.size(); ++j) {
+                assert(stats[j].blocks_found == sampled_stats[j].blocks_found && stats[j].stale_rate == sampled_stats[j].stale_rate);
+            }
+
+            // About 2016 blocks are found every two weeks, and the shares of each sample add up.
+            long previous_total{0};
+            for (size_t sample{0}; sample < sampled_ctx.SampleCount(); ++sample) {
+                const auto row{std::span{sampled_ctx.samples}.subspan(sample * miners.size(), miners.size())};
+                long total{0};
+                double total_share{0};
+                for (const auto& miner_stats: row) {
+                    total += miner_stats.blocks_found;
+                    total_share += miner_stats.blocks_share;
+                }
+                assert(std::abs(total_share - 1) < 1e-9);
+                assert(total > previous_total + 1'000 && total < previous_total + 3'000);
+                previous_total = total;
+            }
+        }
+    }};
+    check({});
+    check(links);
+    miners[0].is_selfish = false;
+    check({});
+    check(links);
+
+    std::cout << "Sampling tests passed." << std::endl;
+}
+
+/** Scheduled changes to the hashrate and difficulty retargets must change how fast blocks are found. */
+void TestHashrateSchedule()
+{
+    const auto blocks_found{[](const std::vector<Miner>& miners, std::chrono::milliseconds duration,
+                               std::span<const HashrateChange> changes, std::optional<uint32_t> retarget_period,
+                               std::span<const LinkLatency> links = {}) {
+        SimulationContext ctx{miners, duration, links, {}, changes, retarget_period};
+        std::vector<MinerStats> stats(miners.size());
+        std::vector<double> mean_blocks(miners.size()), mean_share(miners.size());
+        static constexpr int RUNS{20};
+        for (int i{0}; i < RUNS; ++i) {
+            const auto allocations_before{g_allocations.load()};
+            RunSimulation(ctx, DeriveSeed(42, i), stats);
+            assert(g_allocations.load() == allocations_before);
+            for (size_t j{0}; j < miners.size(); ++j) {
+                mean_blocks[j] += static_cast<double>(stats[j].blocks_found) / RUNS;
+                mean_share[j] += stats[j].blocks_share / RUNS;
+            }
+        }
+        return std::pair{mean_blocks, mean_share};
+    }};
+    const auto total{[](const std::vector<double>& values) { return std::accumulate(values.begin(), values.end(), 0.0); }};
+
+    // A miner leaving halves the rate at which blocks are found, until the difficulty adjusts to it after the
+    // first period (clamped to a factor of 4).
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 50, 1s);
+    miners.emplace_back(1, 50, 1s);
+    const HashrateChange leave[]{{0ms, 1, 0.0, false, {}}};
+    const auto weeks{std::chrono::weeks{12}};
+    assert(std::abs(total(blocks_found(miners, weeks, {}, {}).first) - 12 * 1'008) < 100);
+    assert(std::abs(total(blocks_found(miners, weeks, {}, 2'016).first) - 12 * 1'008) < 100);
+    const auto [left_blocks, left_share]{blocks_found(miners, weeks, leave, {})};
+    assert(std::abs(total(left_blocks) - 6 * 1'008) < 100 && left_blocks[1] == 0);
+    assert(std::abs(total(blocks_found(miners, weeks, leave, 2'016).first) - 10 * 1'008) < 100);
+
+    // A miner joining halfway doubles the rate, until the difficulty catches up. It gets its share of what's left.
+    miners[1].perc = 0;
+    const HashrateChange join[]{{std::chrono::weeks{6}, 1, 50.0, false, {}}};
+    const auto [joined_blocks, joined_share]{blocks_found(miners, weeks, join, {})};
+    assert(std::abs(total(joined_blocks) - 18 * 1'008) < 150 && std::abs(joined_share[1] - 1.0 / 3) < 0.01);
+    // The first period after it joined only lasts a week, the last 5 weeks are back to a block every 10 minutes.
+    const auto retargeted_blocks{blocks_found(miners, weeks, join, 2'016).first};
+    assert(std::abs(total(retargeted_blocks) - 13 * 1'008) < 150);
+
+    // A large miner turning selfish halfway gets more than its share of the blocks afterwards, and a selfish
+    // miner turning honest stops doing so.
+    miners.clear();
+    miners.emplace_back(0, 40, 1s);
+    miners.emplace_back(1, 60, 1s);
+    const HashrateChange turn_selfish[]{{std::chrono::weeks{6}, 0, 40.0, true, {}}};
+    const auto honest_share{blocks_found(miners, weeks, {}, {}).second[0]};
+    const auto selfish_share{blocks_found(miners, weeks, turn_selfish, {}).second[0]};
+    assert(std::abs(honest_share - 0.4) < 0.01 && selfish_share > 0.42 && selfish_share < 0.47);
+    const LinkLatency links[]{{1, 0, 500ms}};
+    assert(std::abs(blocks_found(miners, weeks, turn_selfish, {}, links).second[0] - selfish_share) < 0.01);
+    miners[0].is_selfish = true;
+    const HashrateChange turn_honest[]{{std::chrono::weeks{6}, 0, 40.0, false, {}}};
+    assert(std::abs(blocks_found(miners, weeks, turn_honest, {}).second[0] - selfish_share) < 0.01);
+
+    std::cout << "Hashrate schedule tests passed." << std::endl;
+}
+
+/** Dropping the final blocks during a run must not change its outcome, and bound the blocks kept in memory. */
+void TestFinality()
+{
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 30, 1s, true);
+    miners.emplace_back(1, 30, 2s);
+    miners.emplace_back(2, 20, 10s);
+    // A miner which goes hundreds of blocks without finding one, and so mines below the final block.
+    miners.emplace_back(3, 0.2, 1s);
+    miners.emplace_back(4, 19.8, 1s);
+    const LinkLatency links[]{{1, 2, 100ms}, {4, 0, 800ms}};
+    const HashrateChange changes[]{{std::chrono::weeks{3}, 4, 19.8, true, {}}, {std::chrono::weeks{5}, 0, 30.0, false, {}}};
+    static constexpr uint32_t DEPTH{144};
+    const auto check{[&](std::span<const LinkLatency> links, std::span<const HashrateChange> changes) {
+        SimulationContext ctx{miners, std::chrono::weeks{8}, links, std::chrono::weeks{1}, changes, 2'016};
+        SimulationContext final_ctx{miners, std::chrono::weeks{8}, links, std::chrono::weeks{1}, changes, 2'016, DEPTH};
+        std::vector<MinerStats> stats(miners.size()), final_stats(miners.size());
+        const auto same_stats{[](const MinerStats& a, const MinerStats& b) {
+            return a.blocks_found == b.blocks_found && a.blocks_share == b.blocks_share && a.stale_rate == b.stale_rate;
+        }};
+        for (int i{0}; i < 10; ++i) {
+            RunSimulation(ctx, DeriveSeed(42, i), stats);
+            const auto allocations_before{g_allocations.load()};
+            RunSimulation(final_ctx, DeriveSeed(42, i), final_stats);
+            assert(g_allocations.load() == allocations_before);
+            assert(std::ranges::equal(stats, final_stats, same_stats));
+            assert(std::ranges::equal(ctx.samples, final_ctx.samples, same_stats));
+
+            // About 8k blocks were found, of which only the last few hundred are kept.
+            assert(final_ctx.tree.size() == ctx.tree.size() && final_ctx.best_chain.size() == ctx.best_chain.size());
+            assert(final_ctx.tree.size() - final_ctx.tree.First() <= 4 * DEPTH);
+            assert(final_ctx.best_chain.First() + 2 * DEPTH >= final_ctx.best_chain.size());
+        }
+    }};
+    check({}, {});
+    check(links, {});
+    check({}, changes);
+    check(links, changes);
+    miners[0].is_selfish = false;
+    check({}, {});
+    check(links, {});
+
+    std::cout << "Finality tests passed." << std::endl;
+}
+
+/** Races must find the same blocks as RunSimulation(), so that their results can be cross-checked. */
+void TestRaces()
+{
+    // A race draws the same values as the batched streams of RunSimulation().
+    UniformStream uniform{7};
+    ExponentialStream exponential{7};
+    RaceStream race_uniform{7}, race_exponential{7};
+    for (int i{0}; i < 3'000; ++i) {
+        assert(race_uniform.NextUniform() == uniform.Next());
+        assert(race_exponential.NextExponential() == exponential.Next());
+    }
+
+    const auto check{[](const std::vector<Miner>& miners, std::chrono::milliseconds duration, int runs) {
+        const RaceTables tables{miners, duration};
+        const auto network{tables.Network()};
+        const FinderSampler sampler{miners};
+        for (int i{0}; i < 10'000; ++i) {
+            const auto random{DeriveSeed(3, i)};
+            assert(PickRaceFinder(network, random) == sampler.Pick(random));
+        }
+
+        SimulationContext ctx{miners, duration};
+        const RaceWorkspace workspace{3, miners.size()};
+        std::vector<MinerStats> stats(miners.size());
+        MinerStatsAccumulator race_stats, sim_stats;
+        for (int i{0}; i < runs; ++i) {
+            const auto race{GetRaceState(workspace.Buffers(), i % 3)};
+            const auto chain_size{RunRace(network, DeriveSeed(42, i), race)};
+            RunSimulation(ctx, DeriveSeed(42, i), stats);
+            assert(chain_size == ctx.best_chain.size());
+            for (uint32_t j{0}; j < miners.size(); ++j) {
+                assert(race.blocks_found[j] == ctx.best_chain.BlocksFound(j));
+                assert(race.stale_blocks[j] == ctx.miners[j].stale_blocks);
+            }
+            AddRaceStats(race_stats, race, 0, chain_size);
+            sim_stats.Add(stats[0]);
+        }
+        assert(race_stats.blocks_found.mean == sim_stats.blocks_found.mean && race_stats.blocks_share.m2 == sim_stats.blocks_share.m2);
+        assert(race_stats.stale_rate.mean == sim_stats.stale_rate.mean && race_stats.stale_rate.m2 == sim_stats.stale_rate.m2);
+    }};
+    std::vector<Miner> miners;
+    for (const double perc: {30, 29, 12, 11, 8, 5, 3, 1, 1}) miners.emplace_back(miners.size(), perc, 1s);
+    check(miners, std::chrono::months{12}, 20);
+    // Many forks, some of which deeper than a block, and miners which don't find a block for long.
+    for (auto& miner: miners) miner.propagation = miner.id % 2 ? 30s : 2min;
+    miners.emplace_back(miners.size(), 0.01, 0s);
+    miners.emplace_back(miners.size(), 0, 1s);
+    check(miners, std::chrono::months{12}, 20);
+    std::vector<Miner> small_miners;
+    for (unsigned i{0}; i < 1'000; ++i) small_miners.emplace_back(i, 0.1, 1s);
+    check(small_miners, std::chrono::weeks{8}, 5);
+    check({Miner{0, 100, 10s}}, std::chrono::weeks{4}, 5);
+
+    // Runs which don't fit are left to RunSimulation().
+    const std::vector<Miner> slow_miners{Miner{0, 50, std::chrono::days{1}}, Miner{1, 50, std::chrono::days{1}}};
+    const RaceTables tables{slow_miners, std::chrono::weeks{1}};
+    const RaceWorkspace workspace{1, slow_miners.size()};
+    assert(RunRace(tables.Network(), 1, GetRaceState(workspace.Buffers(), 0)) == 0);
+    SimulationContext ctx{slow_miners, std::chrono::weeks{1}};
+    std::vector<MinerStats> stats(slow_miners.size());
+    RunSimulation(ctx, 1, stats);
+    assert(SetRaceResults(ctx, GetRaceState(workspace.Buffers(), 0)) == ctx.best_chain.size());
+    MinerStatsAccumulator race_stats;
+    AddRaceStats(race_stats, GetRaceState(workspace.Buffers(), 0), 1, ctx.best_chain.size());
+    assert(race_stats.blocks_found.mean == stats[1].blocks_found && race_stats.stale_rate.mean == stats[1].stale_rate);
+
+    // A batch of races, simulated and added up by chunks as the kernels of the GPU backend do, gives the exact same
+    // stats as RunScenarios() whatever the seed.
+    Scenario race_scenario;
+    for (const double perc: {30, 29, 12, 11, 8, 5, 3, 1, 1}) race_scenario.miners.emplace_back(race_scenario.miners.size(), perc, 2s);
+    const auto miner_count{static_cast<uint32_t>(race_scenario.miners.size())};
+    const RaceTables race_tables{race_scenario.miners, std::chrono::weeks{2}};
+    for (const uint64_t seed: {1, 2, 3}) {
+        const SweepParams batch_params{std::chrono::weeks{2}, 3 * RUNS_PER_CHUNK + 10, seed, 2, {}};
+        const RaceWorkspace batch{static_cast<size_t>(batch_params.runs), miner_count};
+        for (size_t race{0}; race < batch.Buffers().races; ++race) {
+            RunBatchRace(race_tables.Network(), batch.Buffers(), seed, 0, race);
+            assert(batch.Buffers().chain_sizes[race] != 0);
+        }
+        std::vector<MinerStatsAccumulator> batch_stats(miner_count);
+        for (size_t i{0}; i < 4 * miner_count; ++i) batch_stats[i % miner_count].Merge(ReduceBatchRaces(batch.Buffers(), miner_count, i));
+        std::ostringstream progress;
+        RunScenarios(std::span{&race_scenario, 1}, batch_params, progress, [&](size_t, auto stats, auto, const auto&) {
+            for (uint32_t j{0}; j < miner_count; ++j) {
+                assert(stats[j].blocks_found.count == static_cast<uint64_t>(batch_params.runs) && stats[j].blocks_found.m2 == batch_stats[j].blocks_found.m2);
+                assert(stats[j].blocks_share.mean == batch_stats[j].blocks_share.mean && stats[j].blocks_share.m2 == batch_stats[j].blocks_share.m2);
+                assert(stats[j].stale_rate.mean == batch_stats[j].stale_rate.mean && stats[j].stale_rate.m2 == batch_stats[j].stale_rate.m2);
+            }
+        });
+    }
+
+    // Only honest networks with uniform propagation and nothing changing during the runs are races.
+    Config config{.duration = std::chrono::weeks{1}, .runs = 10, .miners = miners};
+    const SweepParams params{std::chrono::weeks{1}, 10, 42, 1, {}};
+    assert(IsRace(MakeScenarios(config)[0], params));
+    SweepParams sampled{params}, retargeted{params}, finalized{params};
+    sampled.sample_interval = std::chrono::days{1};
+    retargeted.retarget_period = 2'016;
+    finalized.finality_depth = 1'000;
+    assert(!IsRace(MakeScenarios(config)[0], sampled) && !IsRace(MakeScenarios(config)[0], retargeted));
+    assert(!IsRace(MakeScenarios(config)[0], finalized));
+    config.sweep_selfish = {0, 30};
+    assert(!IsRace(MakeScenarios(config)[0], params));
+    config.sweep_selfish.clear();
+    config.latencies.push_back({0, 1, 100ms});
+    assert(!IsRace(MakeScenarios(config)[0], params));
+
+    std::cout << "Race tests passed." << std::endl;
+}
+
+/** Deep reorgs estimated by importance sampling must match those counted by plain runs, with far fewer runs. */
+void TestRareEvents()
+{
+    // The weights of tilted draws average to one, and make short intervals as likely as they actually are.
+    ExponentialStream exponential{3};
+    UniformStream uniform{4};
+    RunningStats weights, short_weights;
+    for (int i{0}; i < 200'000; ++i) {
+        double weight{1.0};
+        const auto interval{NextTiltedBlockInterval(exponential, uniform, BLOCK_INTERVAL_MS, 30s, weight)};
+        assert(weight > 0.0 && weight <= 1.0 / (1.0 - REORG_TILT));
+        weights.Add(weight);
+        short_weights.Add(interval < 30s ? weight : 0.0);
+    }
+    assert(std::abs(weights.mean - 1.0) < weights.ConfidenceInterval());
+    const double p_short{-std::expm1(-30'000 / BLOCK_INTERVAL_MS)};
+    assert(std::abs(short_weights.mean - p_short) < short_weights.ConfidenceInterval());
+
+    // Deep reorgs are counted by plain runs of the event loop, with a selfish miner which never finds a block. The
+    // estimate from honest networks must match with a much narrower confidence interval.
+    std::vector<Miner> miners;
+    for (const double perc: {30, 30, 20, 20}) miners.emplace_back(miners.size(), perc, 30s);
+    std::vector<Miner> plain_miners{miners};
+    plain_miners.emplace_back(miners.size(), 0, 30s, true);
+    static constexpr uint32_t DEPTH{3};
+    SimulationContext ctx{miners, std::chrono::days{1}, {}, {}, {}, {}, {}, DEPTH};
+    SimulationContext plain_ctx{plain_miners, std::chrono::days{1}, {}, {}, {}, {}, {}, DEPTH};
+    std::vector<MinerStats> stats(miners.size()), plain_stats(plain_miners.size());
+    RunningStats estimate, counted;
+    for (int i{0}; i < 20'000; ++i) {
+        RunSimulation(ctx, DeriveSeed(42, i), stats);
+        estimate.Merge(ctx.counters.deep_reorgs);
+        RunSimulation(plain_ctx, DeriveSeed(42, i), plain_stats);
+        assert(plain_ctx.weight == 1.0 && plain_ctx.weighted_ms == std::chrono::milliseconds{std::chrono::days{1}}.count());
+        counted.Merge(plain_ctx.counters.deep_reorgs);
+    }
+    assert(estimate.count == 20'000 && counted.count == 20'000 && counted.mean > 0.0);
+    assert(std::abs(estimate.mean - counted.mean) < estimate.ConfidenceInterval() + counted.ConfidenceInterval());
+    assert(estimate.ConfidenceInterval() < counted.ConfidenceInterval() / 2);
+
+    // Nothing is tilted nor recorded otherwise.
+    SimulationContext untilted_ctx{miners, std::chrono::days{1}};
+    RunSimulation(untilted_ctx, 1, stats);
+    assert(untilted_ctx.weight == 1.0 && untilted_ctx.counters.deep_reorgs.count == 0);
+
+    std::cout << "Rare event tests passed." << std::endl;
+}
+
+void TestLatencyMatrix()
+{
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 40, 10s);
+    miners.emplace_back(1, 40, 10s);
+    miners.emplace_back(2, 20, 5s);
+
+    // By default blocks reach every other miner after the sender's propagation time.
+    const LatencyMatrix uniform{miners};
+    assert(uniform.IsUniform());
+    assert(uniform(0, 1) == 10s && uniform(2, 0) == 5s && uniform(1, 1) == 0s);
+    assert(uniform.ReachAll(2) == 5s && uniform.Max() == 10s);
+
+    // The two large pools are well connected to each other.
+    const LinkLatency links[]{{0, 1, 100ms}, {1, 0, 100ms}, {2, 1, 12s}};
+    const LatencyMatrix matrix{miners, links};
+    assert(!matrix.IsUniform());
+    assert(matrix(0, 1) == 100ms && matrix(0, 2) == 10s && matrix(2, 1) == 12s && matrix(2, 0) == 5s);
+    assert(matrix.ReachAll(0) == 10s && matrix.ReachAll(2) == 12s && matrix.Max() == 12s);
+    BlockTree blocks;
+    const auto block{blocks.Append(2, 1min + 12s, BlockTree::GENESIS)};
+    assert(matrix.ReceivedAt(blocks, block, 0) == 1min + 5s && matrix.ReceivedAt(blocks, block, 1) == 1min + 12s);
+    // Only the links are stored, by sender, and a link set twice has the last latency set.
+    const LinkLatency twice[]{{2, 1, 12s}, {0, 1, 100ms}, {2, 1, 2s}};
+    const LatencyMatrix relinked{miners, twice};
+    assert(relinked(2, 1) == 2s && relinked.ReachAll(2) == 5s && relinked.Links(2).size() == 1 && relinked.Links(1).empty());
+    // A miner linked to all others doesn't reach any after its propagation time.
+    const LinkLatency all[]{{2, 0, 3s}, {2, 1, 3s}};
+    const LatencyMatrix all_linked{miners, all};
+    assert(all_linked.ReachAll(2) == 3s && all_linked.IsUniform());
+
+    // Each miner sees the blocks which reached it, along with their ancestors.
+    {
+        SimulationContext ctx{miners, std::chrono::weeks{1}, links};
+        auto& tree{ctx.tree};
+        assert(ctx.pairwise_latencies && ctx.miners[2].propagation == 12s);
+        const auto a{tree.Append(0, 1min + 10s, BlockTree::GENESIS)};
+        const auto b{tree.Append(1, 2min + 10s, a)};
+        const auto c{tree.Append(2, 2min + 12s, a)};
+        ctx.arrivals.Update(tree);
+        const auto visible_tip{[&](unsigned miner, std::chrono::milliseconds time) {
+            return ctx.arrivals.BestVisibleTip(tree, ctx.latencies, ctx.miners[miner], time);
+        }};
+        assert(visible_tip(1, 1min) == BlockTree::GENESIS);
+        assert(visible_tip(1, 1min + 1s) == a);
+        assert(visible_tip(2, 1min + 1s) == BlockTree::GENESIS);
+        // Miner 0 receives b before c and keeps it, miner 2 sees its own block right away.
+        assert(visible_tip(0, 2min) == a);
+        assert(visible_tip(0, 2min + 1s) == b);
+        assert(visible_tip(0, 2min + 6s) == b);
+        assert(visible_tip(2, 2min + 1s) == c);
+        assert(visible_tip(2, 2min + 11s) == c);
+        // A longer chain is adopted as soon as it is received.
+        ctx.miners[0].tip = b;
+        assert(visible_tip(0, 3min) == b);
+        const auto d{tree.Append(2, 3min + 12s, c)};
+        ctx.arrivals.Update(tree);
+        assert(visible_tip(0, 3min + 6s) == d);
+        // Switching to it reorgs b out.
+        ctx.best_chain.SetTip(tree, a);
+        ctx.miners[1].tip = b;
+        ctx.miners[1].ReorgTo(tree, ctx.best_chain, d);
+        assert(ctx.miners[1].tip == d && ctx.miners[1].stale_blocks == 1);
+        // Private blocks are never visible.
+        const auto e{tree.Append(0, SELFISH_ARRIVAL, d)};
+        ctx.arrivals.Update(tree);
+        assert(visible_tip(1, 1h) == d && e != d);
+    }
+
+    // Tracking latencies between pairs of miners does not change the results when they are all the same.
+    for (const bool selfish: {false, true}) {
+        std::vector<Miner> network;
+        network.emplace_back(0, 40, 1s, selfish);
+        network.emplace_back(1, 35, 2s);
+        network.emplace_back(2, 25, 10s);
+        SimulationContext ctx{network, std::chrono::weeks{4}}, pairwise_ctx{network, std::chrono::weeks{4}};
+        pairwise_ctx.pairwise_latencies = true;
+        std::vector<MinerStats> stats(2 * network.size());
+        const std::span uniform_stats{std::span{stats}.first(network.size())}, pairwise_stats{std::span{stats}.last(network.size())};
+        for (uint64_t seed{0}; seed < 20; ++seed) {
+            RunSimulation(ctx, seed, uniform_stats);
+            RunSimulation(pairwise_ctx, seed, pairwise_stats);
+            for (size_t i{0}; i < network.size(); ++i) {
+                assert(uniform_stats[i].blocks_found == pairwise_stats[i].blocks_found);
+                assert(uniform_stats[i].stale_rate == pairwise_stats[i].stale_rate);
+            }
+        }
+    }
+
+    // Well-connected pools see each other's blocks sooner, and suffer from fewer stale blocks than the others.
+    {
+        SimulationContext ctx{miners, std::chrono::weeks{8}, links}, uniform_ctx{miners, std::chrono::weeks{8}};
+        std::vector<MinerStats> stats(miners.size());
+        std::vector<MinerStatsAccumulator> totals(miners.size()), uniform_totals(miners.size());
+        for (uint64_t seed{0}; seed < 100; ++seed) {
+            RunSimulation(ctx, DeriveSeed(3, seed), stats);
+            for (size_t i{0}; i < miners.size(); ++i) totals[i].Add(stats[i]);
+            RunSimulation(uniform_ctx, DeriveSeed(3, seed), stats);
+            for (size_t i{0}; i < miners.size(); ++i) uniform_totals[i].Add(stats[i]);
+        }
+        assert(totals[0].stale_rate.mean < uniform_totals[0].stale_rate.mean / 2);
+        assert(totals[1].stale_rate.mean < uniform_totals[1].stale_rate.mean / 2);
+        assert(totals[2].stale_rate.mean > 2 * totals[0].stale_rate.mean);
+    }
+
+    std::cout << "Latency matrix tests passed." << std::endl;
+}
+
+void TestRunningStats()
+{
+    // Mean and sample variance of a known sample.
+    RunningStats stats;
+    for (const double value: {2.0, 4.0, 4.0, 4.0, 5.0, 5.0, 7.0, 9.0}) {
+        stats.Add(value);
+    }
+    assert(stats.count == 8);
+    assert(std::abs(stats.mean - 5.0) < 1e-12);
+    assert(std::abs(stats.Variance() - 32.0 / 7) < 1e-12);
+
+    // Merging accumulators of parts of a sample is the same as accumulating the whole sample, wherever it's split.
+    std::vector<double> values;
+    ExponentialStream stream{42};
+    for (int i{0}; i < 1'000; ++i) {
+        values.push_back(stream.Next() * 1'000);
+    }
+    RunningStats whole;
+    for (const auto value: values) whole.Add(value);
+    for (const size_t split: {size_t{0}, size_t{1}, size_t{500}, size_t{999}, values.size()}) {
+        RunningStats first, second;
+        for (size_t i{0}; i < split; ++i) first.Add(values[i]);
+        for (size_t i{split}; i < values.size(); ++i) second.Add(values[i]);
+        first.Merge(second);
+        assert(first.count == whole.count);
+        assert(std::abs(first.mean - whole.mean) < 1e-9);
+        assert(std::abs(first.Variance() - whole.Variance()) / whole.Variance() < 1e-9);
+    }
+
+    // No confidence in a mean without a variance estimate.
+    RunningStats single;
+    single.Add(1.0);
+    assert(single.ConfidenceInterval() == std::numeric_limits<double>::infinity());
+    assert(whole.ConfidenceInterval() > 0 && whole.ConfidenceInterval() < whole.ConfidenceInterval(3.0));
+
+    std::cout << "Running stats tests passed." << std::endl;
+}
+
+void TestConfigParsing()
+{
+    assert(ParseDuration("1s") == 1s);
+    assert(ParseDuration("100ms") == 100ms);
+    assert(ParseDuration("1.5s") == 1'500ms);
+    assert(ParseDuration("12mo") == std::chrono::months{12});
+    assert(ParseDuration("2w") == std::chrono::weeks{2});
+    assert(!ParseDuration("1") && !ParseDuration("s") && !ParseDuration("1 s") && !ParseDuration("-1s"));
+
+    const auto stubborn{ParseMiner(0, "30,1s,selfish:gamma=0.25:lead:equal-fork:trail=2")};
+    assert(stubborn && stubborn->is_selfish && stubborn->selfish_params.gamma == 0.25f && stubborn->selfish_params.trail_stubbornness == 2);
+    assert(stubborn->selfish_params.lead_stubborn && stubborn->selfish_params.equal_fork_stubborn);
+    assert(!ParseMiner(0, "30,1s,selfish:gamma=2") && !ParseMiner(0, "30,1s,selfish:stubborn") && !ParseMiner(0, "30,1s,honest:lead"));
+
+    const auto miner{ParseMiner(3, "0.3,250ms,selfish")};
+    assert(miner && miner->id == 3 && miner->perc == 0.3 && miner->propagation == 250ms && miner->is_selfish);
+    assert(!ParseMiner(0, "30,1s")->is_selfish && !ParseMiner(0, "30,1s,honest")->is_selfish);
+    assert(!ParseMiner(0, "30") && !ParseMiner(0, "30,1s,greedy") && !ParseMiner(0, "-1,1s") && !ParseMiner(0, "30,1s,"));
+    // Numbers which are not finite would pass any range check.
+    assert(!ParseMiner(0, "nan,1s") && !ParseMiner(0, "inf,1s") && !ParseShare("nan") && !ParseNumber<double>("-inf"));
+    assert(!ParseMiner(0, "30,1s,selfish:gamma=nan") && ParseNumber<double>("1e3") == 1'000);
+
+    const auto link{ParseLinkLatency("2,0,150ms")};
+    assert(link && link->sender == 2 && link->receiver == 0 && link->latency == 150ms);
+    assert(!ParseLinkLatency("1,1,1s") && !ParseLinkLatency("0,1") && !ParseLinkLatency("0,-1,1s"));
+
+    // Miners on the command line replace the default network, other options are kept unless overridden.
+    std::vector<Miner> defaults;
+    defaults.emplace_back(0, 100, 1s);
+    const Config default_config{.duration = std::chrono::weeks{1}, .runs = 10, .miners = defaults};
+    const char* args[]{"simulation", "--runs", "42", "--miner", "60,1s", "--miner", "40,2s,selfish", "--seed", "7"};
+    const auto config{ParseConfig(std::size(args), args, default_config)};
+    assert(config && config->runs == 42 && config->seed == 7 && config->duration == std::chrono::weeks{1});
+    assert(config->miners.size() == 2 && config->miners[1].id == 1 && config->miners[1].is_selfish);
+    assert(!config->stale_rate_precision && config->threads == 0 && !config->gpu);
+    const char* latency_args[]{"simulation", "--latency", "1,0,50ms", "--miner", "50,1s", "--miner", "50,1s"};
+    const auto latency_config{ParseConfig(std::size(latency_args), latency_args, default_config)};
+    assert(latency_config && latency_config->latencies.size() == 1 && latency_config->latencies[0].latency == 50ms);
+    assert(!latency_config->time_series && latency_config->sample_interval == std::chrono::weeks{2});
+    const char* schedule_args[]{"simulation", "--change", "1mo,1,0", "--change", "2w,0,40,selfish:lead", "--retarget", "2016", "--miner", "50,1s", "--miner", "50,1s"};
+    const auto schedule_config{ParseConfig(std::size(schedule_args), schedule_args, default_config)};
+    assert(schedule_config && schedule_config->hashrate_changes.size() == 2 && schedule_config->retarget_period == 2'016);
+    const auto& turn_selfish{schedule_config->hashrate_changes[1]};
+    assert(turn_selfish.time == std::chrono::weeks{2} && turn_selfish.miner == 0 && turn_selfish.is_selfish && turn_selfish.selfish_params.lead_stubborn);
+    assert(!ParseHashrateChange("1mo,1") && !ParseHashrateChange("1mo,1,-5") && !ParseHashrateChange("1mo,1,5,greedy"));
+    assert(!ParseHashrateChange("1mo,1,nan") && !ParseHashrateChange("1mo,1,inf"));
+    const char* finality_args[]{"simulation", "--finality", "1000"};
+    const auto finality_config{ParseConfig(std::size(finality_args), finality_args, default_config)};
+    assert(finality_config && finality_config->finality_depth == 1'000 && !schedule_config->finality_depth);
+    const char* time_series_args[]{"simulation", "--time-series", "out.csv", "--sample-interval", "1d"};
+    const auto time_series_config{ParseConfig(std::size(time_series_args), time_series_args, default_config)};
+    assert(time_series_config && time_series_config->time_series == "out.csv" && time_series_config->sample_interval == std::chrono::days{1});
+    const char* gpu_args[]{"simulation", "--backend", "gpu", "--sweep-propagation", "1s:10s:1s"};
+    const auto gpu_config{ParseConfig(std::size(gpu_args), gpu_args, default_config)};
+    assert(gpu_config && gpu_config->gpu);
+    const char* reorg_args[]{"simulation", "--reorg-depth", "4", "--sweep-propagation", "1s:10s:1s"};
+    const auto reorg_config{ParseConfig(std::size(reorg_args), reorg_args, default_config)};
+    assert(reorg_config && reorg_config->reorg_depth == 4 && !gpu_config->reorg_depth);
+    const char* model_args[]{"simulation", "--backend", "model", "--model-tolerance", "0.0001"};
+    const auto model_config{ParseConfig(std::size(model_args), model_args, default_config)};
+    assert(model_config && model_config->analytic && !model_config->gpu && model_config->model_tolerance == 0.0001 && !gpu_config->analytic);
+
+    const char* no_args[]{"simulation"};
+    const auto unchanged{ParseConfig(std::size(no_args), no_args, default_config)};
+    assert(unchanged && unchanged->miners.size() == 1 && unchanged->runs == 10);
+
+    std::cerr.setstate(std::ios::failbit);
+    const char* missing_value[]{"simulation", "--runs"};
+    assert(!ParseConfig(std::size(missing_value), missing_value, default_config));
+    const char* nan_precision[]{"simulation", "--precision", "nan"};
+    const char* inf_tolerance[]{"simulation", "--model-tolerance", "inf"};
+    const char* nan_miners[]{"simulation", "--miner", "nan,1s", "--miner", "50,1s"};
+    assert(!ParseConfig(std::size(nan_precision), nan_precision, default_config) && !ParseConfig(std::size(inf_tolerance), inf_tolerance, default_config));
+    assert(!ParseConfig(std::size(nan_miners), nan_miners, default_config));
+    const char* shallow_finality[]{"simulation", "--finality", "6"};
+    assert(!ParseConfig(std::size(shallow_finality), shallow_finality, default_config));
+    const char* no_hashrate[]{"simulation", "--miner", "0,1s"};
+    assert(!ParseConfig(std::size(no_hashrate), no_hashrate, default_config));
+    const char* unknown_miner[]{"simulation", "--latency", "0,1,1s"};
+    assert(!ParseConfig(std::size(unknown_miner), unknown_miner, default_config));
+    const char* unknown_changed_miner[]{"simulation", "--change", "1mo,1,0"};
+    assert(!ParseConfig(std::size(unknown_changed_miner), unknown_changed_miner, default_config));
+    const char* all_leave[]{"simulation", "--change", "1mo,0,0", "--change", "2mo,0,10"};
+    assert(!ParseConfig(std::size(all_leave), all_leave, default_config));
+    const char* unknown_backend[]{"simulation", "--backend", "tpu"};
+    assert(!ParseConfig(std::size(unknown_backend), unknown_backend, default_config));
+    const char* selfish_gpu[]{"simulation", "--backend", "gpu", "--sweep-selfish", "10:30:10"};
+    assert(!ParseConfig(std::size(selfish_gpu), selfish_gpu, default_config));
+    const char* checkpoint_gpu[]{"simulation", "--backend", "gpu", "--resume", "sweep.ckpt"};
+    assert(!ParseConfig(std::size(checkpoint_gpu), checkpoint_gpu, default_config));
+    const char* finality_gpu[]{"simulation", "--backend", "gpu", "--finality", "1000"};
+    assert(!ParseConfig(std::size(finality_gpu), finality_gpu, default_config));
+    const char* no_reorg[]{"simulation", "--reorg-depth", "0"};
+    assert(!ParseConfig(std::size(no_reorg), no_reorg, default_config));
+    const char* reorg_precision[]{"simulation", "--reorg-depth", "3", "--precision", "0.001"};
+    assert(!ParseConfig(std::size(reorg_precision), reorg_precision, default_config));
+    const char* reorg_shard[]{"simulation", "--reorg-depth", "3", "--seed", "1", "--shard", "0/2"};
+    assert(!ParseConfig(std::size(reorg_shard), reorg_shard, default_config));
+    const char* selfish_model[]{"simulation", "--backend", "model", "--sweep-selfish", "10:30:10"};
+    assert(!ParseConfig(std::size(selfish_model), selfish_model, default_config));
+    const char* tolerance_checkpoint[]{"simulation", "--model-tolerance", "0.001", "--checkpoint", "sweep.ckpt"};
+    assert(!ParseConfig(std::size(tolerance_checkpoint), tolerance_checkpoint, default_config));
+    std::cerr.clear();
+
+    std::cout << "Config parsing tests passed." << std::endl;
+}
+
+void TestSweep()
+{
+    const auto shares{ParseSweep<double>("5,10:30:10,0:0.3:0.1", ParseShare)};
+    assert(shares && shares->size() == 8);
+    assert((*shares)[0] == 5 && (*shares)[3] == 30 && std::abs((*shares)[7] - 0.3) < 1e-12);
+    const auto propagation_times{ParseSweep<std::chrono::milliseconds>("100ms:1s:300ms", ParseDuration)};
+    assert(propagation_times && propagation_times->size() == 4 && propagation_times->back() == 1s);
+    assert(!ParseSweep<double>("10:5:1", ParseShare) && !ParseSweep<double>("0:10:0", ParseShare) && !ParseSweep<double>("1:2", ParseShare));
+    assert(!ParseSweep<double>("101", ParseShare));
+
+    // Swept shares are set as percentages of the whole network, the others are scaled to fill what's left.
+    Config config{.duration = std::chrono::weeks{1}, .runs = 100};
+    config.miners.emplace_back(0, 20, 1s);
+    config.miners.emplace_back(1, 20, 1s);
+    config.miners.emplace_back(2, 10, 1s);
+    assert(MakeScenarios(config).size() == 1 && MakeScenarios(config)[0].miners[1].perc == 20);
+    config.sweep_propagation = {100ms, 2s};
+    config.sweep_share = {10, 60};
+    config.sweep_selfish = {0, 30, 45};
+    const auto scenarios{MakeScenarios(config)};
+    assert(scenarios.size() == 2 * 5); // 60% and 45% exceed the whole network.
+    const auto& scenario{scenarios[1]};
+    assert(scenario.propagation == 100ms && scenario.share == 10 && scenario.selfish_share == 30);
+    assert(scenario.miners.size() == 4 && scenario.miners[3].id == 3 && scenario.miners[3].is_selfish);
+    assert(scenario.miners[0].perc == 10 && scenario.miners[3].perc == 30);
+    assert(std::abs(scenario.miners[1].perc - 40) < 1e-12 && std::abs(scenario.miners[2].perc - 20) < 1e-12);
+    assert(std::ranges::all_of(scenarios.back().miners, [](const auto& miner) { return miner.propagation == 2s; }));
+
+    // Results are reported in order and don't depend on the number of threads.
+    const std::vector<Scenario> few_scenarios{scenarios[0], scenarios[1], scenarios[2]};
+    const auto sweep{[&](unsigned threads) {
+        std::vector<std::vector<MinerStatsAccumulator>> results;
+        std::ostringstream progress;
+        RunScenarios(few_scenarios, SweepParams{std::chrono::weeks{1}, 100, 42, threads, {}}, progress, [&](size_t i, auto stats, auto, const auto&) {
+            assert(i == results.size());
+            results.emplace_back(stats.begin(), stats.end());
+        });
+        return results;
+    }};
+    const auto single{sweep(1)}, parallel{sweep(3)};
+    assert(single.size() == few_scenarios.size() && parallel.size() == few_scenarios.size());
+    for (size_t i{0}; i < single.size(); ++i) {
+        for (size_t j{0}; j < single[i].size(); ++j) {
+            assert(single[i][j].stale_rate.count == 100);
+            assert(single[i][j].stale_rate.mean == parallel[i][j].stale_rate.mean);
+            assert(single[i][j].blocks_found.m2 == parallel[i][j].blocks_found.m2);
+        }
+    }
+
+    std::cout << "Sweep tests passed." << std::endl;
+}
+
+void TestModel()
+{
+    // Each miner's blocks go stale if another's were found within their propagation time, before or after them.
+    Scenario scenario;
+    scenario.miners.emplace_back(0, 30, 10s);
+    scenario.miners.emplace_back(1, 70, 10s);
+    const auto model{ModelStaleRates(scenario)};
+    const double p_within{-std::expm1(-10.0 / 600)};
+    assert(model && model->size() == 2);
+    assert(std::abs((*model)[0] - ((1 - std::pow(1 - p_within, 0.7)) * 0.7 + (1 - std::pow(1 - p_within, 0.7)) * 0.7)) < 1e-12);
+    assert(std::abs((*model)[1] - ((1 - std::pow(1 - p_within, 0.3)) * 0.3 + (1 - std::pow(1 - p_within, 0.3)) * 0.3)) < 1e-12);
+    // Latencies between miners override the sender's propagation time.
+    Scenario linked{scenario};
+    linked.latencies.push_back({1, 0, 0ms});
+    const auto linked_model{ModelStaleRates(linked)};
+    assert(linked_model && std::abs((*linked_model)[0] - (1 - std::pow(1 - p_within, 0.7)) * 0.7) < 1e-12);
+    assert(std::abs((*linked_model)[1] - (*model)[1] / 2) < 1e-12);
+    // It doesn't describe selfish miners nor networks which change.
+    Scenario selfish{scenario}, changing{scenario};
+    selfish.miners.emplace_back(2, 10, 1s, true);
+    changing.hashrate_changes.push_back({std::chrono::days{1}, 0, 40, false, {}});
+    assert(!ModelStaleRates(selfish) && !ModelStaleRates(changing));
+
+    // Only the scenarios the model doesn't describe well are simulated to the end. It is mostly accurate for short
+    // propagation times.
+    Scenario fast{scenario};
+    for (auto& miner: fast.miners) miner.propagation = 1s;
+    std::vector<int> runs;
+    SweepParams params{std::chrono::weeks{1}, 2'048, 42, 2, {}};
+    params.model_tolerance = 0.0005;
+    std::ostringstream progress;
+    RunScenarios(std::vector{fast, selfish}, params, progress, [&](size_t, auto stats, auto, const auto&) {
+        runs.push_back(stats[0].stale_rate.count);
+    });
+    assert((runs == std::vector{MIN_RUNS_TO_STOP, 2'048}));
+    params.model_tolerance = 1e-6;
+    runs.clear();
+    RunScenarios(std::span{&fast, 1}, params, progress, [&](size_t, auto stats, auto, const auto&) {
+        const auto fast_model{ModelStaleRates(fast)};
+        for (size_t i{0}; i < stats.size(); ++i) {
+            assert(std::abs(stats[i].stale_rate.mean - (*fast_model)[i]) < stats[i].stale_rate.ConfidenceInterval() * 2);
+        }
+        runs.push_back(stats[0].stale_rate.count);
+    });
+    assert(runs == std::vector{2'048});
+
+    std::cout << "Model tests passed." << std::endl;
+}
+
+void TestPopulation()
+{
+    const auto spec{ParsePopulation("1000,20,pareto:1.5,lognormal:1s:0.5")};
+    assert(spec && spec->count == 1'000 && spec->perc == 20 && spec->pareto_alpha == 1.5 && spec->propagation == 1s && spec->propagation_sigma == 0.5 && spec->seed == 0);
+    const auto simple{ParsePopulation("500,5,equal,2s,7")};
+    assert(simple && !simple->pareto_alpha && simple->propagation == 2s && simple->propagation_sigma == 0 && simple->seed == 7);
+    assert(!ParsePopulation("0,5,equal,1s") && !ParsePopulation("10,-1,equal,1s") && !ParsePopulation("10,5,pareto:0,1s"));
+    assert(!ParsePopulation("10,5,zipf,1s") && !ParsePopulation("10,5,equal,lognormal:1s") && !ParsePopulation("10,5,equal"));
+    assert(!ParsePopulation("10,nan,equal,1s") && !ParsePopulation("10,inf,equal,1s") && !ParsePopulation("10,5,pareto:nan,1s"));
+    assert(!ParsePopulation("10,5,pareto:inf,1s") && !ParsePopulation("10,5,equal,lognormal:1s:nan") && !ParsePopulation("10,5,equal,lognormal:nan:1"));
+
+    // The miners are numbered after the others and share the population's hashrate.
+    std::vector<Miner> miners;
+    miners.emplace_back(0, 80, 1s);
+    AddPopulation(miners, *spec);
+    assert(miners.size() == 1'001 && miners.back().id == 1'000);
+    const auto population{std::span{miners}.subspan(1)};
+    double total_perc{0.0};
+    for (const auto& miner: population) total_perc += miner.perc;
+    assert(std::abs(total_perc - 20) < 1e-9);
+    // Hashrates are unequal, a few miners having much more than most. Propagation times are spread around the median.
+    const auto [smallest, largest]{std::ranges::minmax(population | std::views::transform(&Miner::perc))};
+    assert(largest > 50 * smallest);
+    std::vector<std::chrono::milliseconds> propagations;
+    for (const auto& miner: population) propagations.push_back(miner.propagation);
+    std::ranges::nth_element(propagations, propagations.begin() + 500);
+    assert(propagations[500] > 900ms && propagations[500] < 1'100ms && std::ranges::max(propagations) > 2s);
+    // The same spec gives the same miners, another seed others.
+    std::vector<Miner> again, reseeded;
+    AddPopulation(again, *spec);
+    auto other_spec{*spec};
+    other_spec.seed = 1;
+    AddPopulation(reseeded, other_spec);
+    assert(again[0].perc == miners[1].perc && again[999].propagation == miners[1'000].propagation && reseeded[0].perc != again[0].perc);
+    // Without distributions, every miner is the same.
+    std::vector<Miner> equal;
+    AddPopulation(equal, *simple);
+    assert(std::ranges::all_of(equal, [](const auto& miner) { return miner.perc == 0.01 && miner.propagation == 2s; }));
+
+    // Populations replace the default network as miners do, up to as many miners as blocks can tell apart.
+    std::vector<Miner> defaults;
+    defaults.emplace_back(0, 100, 1s);
+    const Config default_config{.duration = std::chrono::weeks{1}, .runs = 10, .miners = defaults};
+    const char* args[]{"simulation", "--miner", "50,1s", "--population", "100,50,equal,1s"};
+    const auto config{ParseConfig(std::size(args), args, default_config)};
+    assert(config && config->miners.size() == 101 && config->miners[100].id == 100 && config->miners[100].perc == 0.5);
+    std::cerr.setstate(std::ios::failbit);
+    const char* too_many_args[]{"simulation", "--population", "65535,100,equal,1s"};
+    assert(!ParseConfig(std::size(too_many_args), too_many_args, default_config));
+    std::cerr.clear();
+
+    // Large networks are reported by classes of miners.
+    std::vector<Miner> network;
+    network.emplace_back(0, 0.5, 1s);
+    network.emplace_back(1, 0.5, 2s);
+    network.emplace_back(2, 3, 1'500ms);
+    network.emplace_back(3, 96, 0ms);
+    network.emplace_back(4, 10, 1s, true);
+    std::vector<MinerStatsAccumulator> stats(network.size());
+    for (size_t i{0}; i < network.size(); ++i) {
+        stats[i].blocks_share.Add(network[i].perc / 100);
+        stats[i].stale_rate.Add(0.01 * i);
+    }
+    const std::vector<double> model{0.1, 0.2, 0.3, 0.4, 0.5};
+    const auto by_share{ClassifyMiners(network, stats, model, &Miner::perc, 10)};
+    assert(by_share.size() == 3 && by_share[0].lower == 0.1 && by_share[0].upper == 1 && by_share[0].miners == 2 && by_share[0].perc == 1);
+    assert(std::abs(by_share[0].stale_rate - 0.005) < 1e-12 && by_share[0].min_stale_rate == 0 && by_share[0].max_stale_rate == 0.01);
+    assert(std::abs(*by_share[0].model_stale_rate - 0.15) < 1e-12 && std::abs(by_share[0].blocks_share - 0.01) < 1e-12);
+    assert(by_share[1].lower == 1 && by_share[1].miners == 1 && by_share[2].lower == 10 && by_share[2].upper == 100);
+    const auto by_propagation{ClassifyMiners(network, {}, {}, [](const Miner& miner) { return static_cast<double>(miner.propagation.count()); }, 2)};
+    assert(by_propagation.size() == 3 && by_propagation[0].upper == 0 && by_propagation[0].perc == 96 && !by_propagation[0].model_stale_rate);
+    assert(by_propagation[1].lower == 512 && by_propagation[1].miners == 1 && by_propagation[2].lower == 1'024 && by_propagation[2].miners == 2);
+
+    // The model of miners sharing their propagation times is computed once per propagation time, to the same rates.
+    Scenario scenario;
+    AddPopulation(scenario.miners, PopulationSpec{.count = 200, .perc = 100, .pareto_alpha = 1.2, .propagation = 2s, .propagation_sigma = 0.8, .seed = 3});
+    scenario.latencies = {{0, 1, 100ms}, {5, 150, 0ms}, {150, 7, 20s}};
+    const auto rates{ModelStaleRates(scenario)};
+    const LatencyMatrix latencies{scenario.miners, scenario.latencies};
+    for (const auto& miner: scenario.miners) {
+        const double share{miner.perc / 100};
+        double race_rate{0.0}, stale_after{0.0};
+        for (const auto& other: scenario.miners) {
+            if (other.id == miner.id) continue;
+            const double other_share{other.perc / 100};
+            race_rate += other_share * latencies(other.id, miner.id).count() / BLOCK_INTERVAL_MS;
+            stale_after += -std::expm1(-other_share * latencies(miner.id, other.id).count() / BLOCK_INTERVAL_MS) * other_share;
+        }
+        assert(std::abs((*rates)[miner.id] - (-std::expm1(-race_rate) * (1 - share) + stale_after)) < 1e-12);
+    }
+
+    // Whatever their number, the stats of the miners of a sweep are only kept for the chunks of runs being simulated.
+    Scenario small_miners;
+    AddPopulation(small_miners.miners, PopulationSpec{.count = 2'000, .perc = 100, .propagation = 1s});
+    SweepParams params{std::chrono::days{1}, 4 * RUNS_PER_CHUNK, 42, 2, {}};
+    std::ostringstream progress;
+    RunScenarios(std::span{&small_miners, 1}, params, progress, [&](size_t, auto stats, auto, const auto&) {
+        assert(stats.size() == 2'000 && stats[1'999].stale_rate.count == 4 * RUNS_PER_CHUNK);
+    });
+
+    std::cout << "Population tests passed." << std::endl;
+}
+
+void TestShards()
+{
+    // The slices of the runs cover all of them, once.
+    for (const unsigned count: {1u, 3u, 7u}) {
+        int next_run{0};
+        for (unsigned index{0}; index < count; ++index) {
+            const auto [first_run, runs]{ShardRuns(100, ShardSpec{index, count})};
+            assert(first_run == next_run && runs > 0);
+            next_run += runs;
+        }
+        assert(next_run == 100);
+    }
+    const auto shard{ParseShard("2/8")};
+    assert(shard && shard->index == 2 && shard->count == 8);
+    assert(!ParseShard("8/8") && !ParseShard("1") && !ParseShard("1/0") && !ParseShard("-1/2"));
+
+    // Simulate a sweep at once and in shards, the latter being written to files and read back.
+    Config config{.duration = std::chrono::weeks{4}, .runs = 90};
+    config.miners.emplace_back(0, 40, 2s, true, SelfishParams{.gamma = 0.5});
+    config.miners.emplace_back(1, 60, 1s);
+    config.latencies.push_back({1, 0, 100ms});
+    config.sweep_propagation = {1s, 10s};
+    const auto scenarios{MakeScenarios(config)};
+    const auto run{[&](const SweepParams& params) {
+        std::vector<std::vector<MinerStatsAccumulator>> results;
+        std::ostringstream progress;
+        RunScenarios(scenarios, params, progress, [&](size_t, auto stats, auto samples, const auto&) {
+            results.emplace_back(stats.begin(), stats.end());
+            results.back().insert(results.back().end(), samples.begin(), samples.end());
+        });
+        return results;
+    }};
+    const SweepParams params{config.duration, config.runs, 3, 2, {}, std::chrono::weeks{1}};
+    const auto whole{run(params)};
+    std::vector<std::string> files;
+    for (unsigned index{0}; index < 3; ++index) {
+        ShardResults results{{index, 3}, params.seed, config.runs, config.duration, params.sample_interval, {}, {}, true, scenarios, {}};
+        auto shard_params{params};
+        std::tie(shard_params.first_run, shard_params.runs) = ShardRuns(config.runs, results.shard);
+        results.stats = run(shard_params);
+        std::ostringstream out;
+        WriteShard(out, results);
+        files.push_back(std::move(out).str());
+    }
+    std::vector<ShardResults> shards;
+    for (const auto index: {2, 0, 1}) {
+        std::istringstream in{files[index]};
+        shards.push_back(*ReadShard(in, "shard"));
+    }
+    const auto& read{shards[0]};
+    assert(read.shard == (ShardSpec{2, 3}) && read.seed == 3 && read.runs == 90 && read.sample_interval == std::chrono::weeks{1});
+    assert(read.scenarios.size() == 2 && read.scenarios[1].propagation == 10s && read.scenarios[1].latencies.size() == 1);
+    assert(read.scenarios[0].miners[0].is_selfish && read.scenarios[0].miners[0].selfish_params.gamma == 0.5f);
+
+    // Merged, the shards give the same stats as the whole sweep, up to rounding.
+    const auto merged{MergeShards(shards)};
+    assert(merged && merged->shard == (ShardSpec{0, 1}) && merged->stats.size() == whole.size());
+    for (size_t i{0}; i < whole.size(); ++i) {
+        assert(merged->stats[i].size() == whole[i].size() && whole[i].size() == 4 * 2);
+        for (size_t j{0}; j < whole[i].size(); ++j) {
+            const auto& expected{whole[i][j]};
+            const auto& actual{merged->stats[i][j]};
+            assert(actual.stale_rate.count == 90 && actual.blocks_found.count == expected.blocks_found.count);
+            assert(std::abs(actual.blocks_found.mean - expected.blocks_found.mean) < 1e-9 * expected.blocks_found.mean);
+            assert(std::abs(actual.stale_rate.Variance() - expected.stale_rate.Variance()) < 1e-9);
+        }
+    }
+
+    // Shards must all be there once, and from the same sweep.
+    std::cerr.setstate(std::ios::failbit);
+    assert(!MergeShards(std::span{shards}.first(2)) && !MergeShards({}));
+    auto duplicate{shards};
+    duplicate[1] = duplicate[0];
+    assert(!MergeShards(duplicate));
+    auto other_sweep{shards};
+    other_sweep[1].seed = 4;
+    assert(!MergeShards(other_sweep));
+    other_sweep = shards;
+    other_sweep[1].finality_depth = 6;
+    assert(!MergeShards(other_sweep));
+    std::istringstream truncated{files[0].substr(0, files[0].size() - 1)}, not_shard{"scenario,miner"};
+    assert(!ReadShard(truncated, "truncated") && !ReadShard(not_shard, "not a shard"));
+
+    // Shards only make sense with a seed, and without stopping early.
+    const char* no_seed[]{"simulation", "--shard", "0/2"};
+    assert(!ParseConfig(std::size(no_seed), no_seed, config));
+    const char* early_stop[]{"simulation", "--shard", "0/2", "--seed", "1", "--precision", "0.001"};
+    assert(!ParseConfig(std::size(early_stop), early_stop, config));
+    const char* too_many[]{"simulation", "--shard", "0/200", "--seed", "1"};
+    assert(!ParseConfig(std::size(too_many), too_many, config));
+    std::cerr.clear();
+    const char* shard_args[]{"simulation", "--shard", "1/2", "--seed", "1", "--shard-file", "part.bin"};
+    const auto shard_config{ParseConfig(std::size(shard_args), shard_args, config)};
+    assert(shard_config && shard_config->shard == (ShardSpec{1, 2}) && shard_config->shard_file == "part.bin");
+
+    std::cout << "Shard tests passed." << std::endl;
+}
+
+void TestCheckpoints()
+{
+    Config config{.duration = std::chrono::weeks{2}, .runs = 200};
+    config.miners.emplace_back(0, 40, 2s, true);
+    config.miners.emplace_back(1, 60, 1s);
+    config.sweep_propagation = {1s, 10s};
+    const auto scenarios{MakeScenarios(config)};
+    const SweepParams params{config.duration, config.runs, 5, 2, {}, std::chrono::weeks{1}};
+    const auto run{[&](const SweepParams& params, const std::optional<SweepProgress>& resume, const std::optional<SweepCheckpoints>& checkpoints) {
+        std::vector<std::vector<MinerStatsAccumulator>> results;
+        std::ostringstream progress;
+        RunScenarios(scenarios, params, progress, [&](size_t i, auto stats, auto, const auto&) {
+            assert(i == results.size());
+            results.emplace_back(stats.begin(), stats.end());
+        }, resume, checkpoints);
+        return results;
+    }};
+
+    // The progress is saved once at the end at least, with all the chunks merged.
+    std::optional<SweepProgress> last;
+    const auto whole{run(params, {}, SweepCheckpoints{1h, [&](const SweepProgress& progress) { last = progress; }})};
+    assert(last && last->merged_chunks == (std::vector<int>{4, 4}) && last->stats.size() == 2 && last->stats[0].size() == 2 * 2);
+    assert(last->stats[1][1].stale_rate.mean == whole[1][1].stale_rate.mean);
+
+    // The first two chunks are the first 128 runs. Resuming from there gives the exact same stats, and so does
+    // resuming a finished sweep.
+    auto half_params{params};
+    half_params.runs = 2 * RUNS_PER_CHUNK;
+    std::optional<SweepProgress> half;
+    run(half_params, {}, SweepCheckpoints{1h, [&](const SweepProgress& progress) { half = progress; }});
+    assert(half && half->merged_chunks == (std::vector<int>{2, 2}));
+    for (const auto& resume: {*half, *last}) {
+        const auto resumed{run(params, resume, {})};
+        for (size_t i{0}; i < whole.size(); ++i) {
+            for (size_t j{0}; j < whole[i].size(); ++j) {
+                assert(resumed[i][j].stale_rate.count == 200 && resumed[i][j].stale_rate.mean == whole[i][j].stale_rate.mean);
+                assert(resumed[i][j].blocks_found.m2 == whole[i][j].blocks_found.m2);
+            }
+        }
+    }
+
+    // Checkpoints are saved to files along with the sweep, and read back.
+    const auto path{(std::filesystem::temp_directory_path() / "simulation-test-checkpoint.bin").string()};
+    const ShardResults sweep{{0, 1}, params.seed, config.runs, config.duration, params.sample_interval, {}, {}, true, scenarios, {}};
+    assert(WriteCheckpoint(path, sweep, 0.001, *half));
+    const auto checkpoint{ReadCheckpoint(path)};
+    assert(checkpoint && DescribeSweep(checkpoint->sweep) == DescribeSweep(sweep) && checkpoint->stale_rate_precision == 0.001);
+    assert(checkpoint->progress.merged_chunks == half->merged_chunks && checkpoint->progress.stats[1][0].blocks_found.mean == half->stats[1][0].blocks_found.mean);
+    // It is only resumed by the same sweep, with the same options.
+    auto other_sweep{sweep};
+    assert(IsSameSweep(*checkpoint, other_sweep, 0.001) && !IsSameSweep(*checkpoint, other_sweep, {}));
+    other_sweep.finality_depth = 300;
+    assert(!IsSameSweep(*checkpoint, other_sweep, 0.001));
+    other_sweep = sweep;
+    other_sweep.shard = ShardSpec{1, 2};
+    assert(!IsSameSweep(*checkpoint, other_sweep, 0.001));
+    std::cerr.setstate(std::ios::failbit);
+    std::ofstream{path, std::ios::binary | std::ios::app} << "trailing";
+    assert(!ReadCheckpoint(path) && !ReadCheckpoint(path + ".missing"));
+    std::cerr.clear();
+    std::filesystem::remove(path);
+
+    // Resuming keeps saving to the same file unless set otherwise.
+    const char* resume_args[]{"simulation", "--resume", "sweep.ckpt", "--checkpoint-interval", "10min"};
+    const auto resume_config{ParseConfig(std::size(resume_args), resume_args, config)};
+    assert(resume_config && resume_config->resume == "sweep.ckpt" && resume_config->checkpoint == "sweep.ckpt");
+    assert(resume_config->checkpoint_interval == std::chrono::minutes{10});
+
+    std::cout << "Checkpoint tests passed." << std::endl;
+}
+
+void TestTraces()
+{
+    // Tracing a run records everything which happens in it, in order, and doesn't change its outcome.
+    for (const bool selfish: {true, false}) {
+        std::vector<Miner> miners;
+        miners.emplace_back(0, 40, 1s, selfish);
+        miners.emplace_back(1, 35, 2s);
+        miners.emplace_back(2, 25, 10s);
+        SimulationContext ctx{miners, std::chrono::weeks{4}};
+        std::vector<MinerStats> stats(miners.size()), traced_stats(miners.size());
+        RunSimulation(ctx, DeriveSeed(42, 0), stats);
+        RunTrace trace;
+        ctx.trace = &trace;
+        RunSimulation(ctx, DeriveSeed(42, 0), traced_stats);
+        for (size_t i{0}; i < miners.size(); ++i) {
+            assert(stats[i].blocks_found == traced_stats[i].blocks_found && stats[i].stale_rate == traced_stats[i].stale_rate);
+        }
+        const auto& events{trace.events};
+        assert(std::ranges::is_sorted(events, {}, &TraceEvent::time_ms) && events.back().time_ms < std::chrono::milliseconds{ctx.duration}.count());
+        const auto count{[&](TraceEvent::Type type) { return static_cast<size_t>(std::ranges::count(events, type, &TraceEvent::type)); }};
+        assert(count(TraceEvent::Type::Found) == ctx.tree.size() - 1);
+        assert(count(TraceEvent::Type::Published) >= (selfish ? 1 : count(TraceEvent::Type::Found)));
+        assert(count(TraceEvent::Type::Reorg) > 0);
+        for (const auto& event: events) {
+            assert(event.block < ctx.tree.size() && (event.miner < miners.size() || event.type == TraceEvent::Type::Received));
+            if (event.type == TraceEvent::Type::Found) assert(ctx.tree.MinerId(event.block) == event.miner);
+            if (event.type == TraceEvent::Type::Reorg) assert(event.depth > 0);
+        }
+        if constexpr (INSTRUMENT) assert(count(TraceEvent::Type::Reorg) == ctx.counters.reorgs);
+
+        // The state of the run can be inspected right after any event.
+        const auto recorded{events};
+        trace.inspect_at = recorded.size() / 2;
+        size_t inspected{0};
+        trace.inspect = [&](const SimulationContext& state) {
+            const auto& event{state.trace->events.back()};
+            assert(state.trace->events.size() == trace.inspect_at && event.block < state.tree.size());
+            if (event.type == TraceEvent::Type::Found) assert(state.miners[event.miner].tip == event.block);
+            ++inspected;
+        };
+        RunSimulation(ctx, DeriveSeed(42, 0), traced_stats);
+        assert(inspected == 1 && events == recorded);
+    }
+
+    // Sweeps hand over the events of one run in so many, which trace files record along with the sweep.
+    Scenario scenario;
+    scenario.miners.emplace_back(0, 50, 1s);
+    scenario.miners.emplace_back(1, 50, 10s);
+    const std::vector<Scenario> scenarios{scenario, scenario};
+    SweepParams params{std::chrono::days{1}, 50, 7, 2, {}};
+    params.finality_depth = 300;
+    const auto path{(std::filesystem::temp_directory_path() / "simulation-test-trace.bin").string()};
+    const ShardResults sweep{{0, 1}, params.seed, params.runs, params.duration, {}, {}, params.finality_depth, true, scenarios, {}};
+    TraceFile file;
+    assert(file.Open(path, TraceHeader{sweep, {}}));
+    std::atomic<int> traced_runs{0};
+    std::ostringstream progress;
+    RunScenarios(scenarios, params, progress, [](size_t, auto, auto, const auto&) {}, {}, {}, SweepTraces{20, [&](size_t i, int run, auto events) {
+        assert(i < scenarios.size() && run % 20 == 0 && !events.empty());
+        file.Write(i, run, events);
+        ++traced_runs;
+    }});
+    assert(traced_runs == 2 * 3 && file.Close());
+
+    std::ifstream in{path, std::ios::binary};
+    const auto header{ReadTraceHeader(in, path)};
+    assert(header && DescribeSweep(header->sweep) == DescribeSweep(sweep) && header->sweep.finality_depth == 300 && !header->reorg_depth);
+    TracedRun traced;
+    std::vector<std::pair<uint32_t, int32_t>> runs;
+    while (ReadTracedRun(in, traced, path)) {
+        runs.emplace_back(traced.scenario, traced.run);
+        // Replaying a run from its seed gives the same events.
+        SimulationContext ctx{scenario.miners, params.duration, {}, {}, {}, {}, params.finality_depth};
+        RunTrace trace;
+        ctx.trace = &trace;
+        std::vector<MinerStats> stats(scenario.miners.size());
+        RunSimulation(ctx, DeriveSeed(params.seed, traced.run), stats);
+        assert(trace.events == traced.events);
+    }
+    assert(!in.fail());
+    std::ranges::sort(runs);
+    assert((runs == std::vector<std::pair<uint32_t, int32_t>>{{0, 0}, {0, 20}, {0, 40}, {1, 0}, {1, 20}, {1, 40}}));
+    in.close();
+    std::cerr.setstate(std::ios::failbit);
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    in.open(path, std::ios::binary);
+    assert(ReadTraceHeader(in, path));
+    while (ReadTracedRun(in, traced, path)) {}
+    assert(in.fail());
+    std::cerr.clear();
+    std::filesystem::remove(path);
+
+    std::vector<Miner> defaults;
+    defaults.emplace_back(0, 100, 1s);
+    const Config default_config{.duration = std::chrono::weeks{1}, .runs = 10, .miners = defaults};
+    const char* args[]{"simulation", "--trace", "runs.trace", "--trace-every", "100"};
+    const auto config{ParseConfig(std::size(args), args, default_config)};
+    assert(config && config->trace == "runs.trace" && config->trace_every == 100);
+    std::cerr.setstate(std::ios::failbit);
+    const char* gpu_args[]{"simulation", "--trace", "runs.trace", "--backend", "gpu"};
+    assert(!ParseConfig(std::size(gpu_args), gpu_args, default_config));
+    const char* never_args[]{"simulation", "--trace-every", "0"};
+    assert(!ParseConfig(std::size(never_args), never_args, default_config));
+    std::cerr.clear();
+
+    std::cout << "Trace tests passed." << std::endl;
+}
+
+void TestProgress()
+{
+    // Rates are measured since the start, then averaged with the previous ones, and the time left follows them.
+    std::ostringstream out, log;
+    const auto start{std::chrono::steady_clock::now()};
+    ProgressMeter meter{out, &log, 1'000, 100, start};
+    assert(!meter.TimeLeft(100));
+    meter.Report(200, 50'000, start + 1s);
+    assert(meter.TimeLeft(200) == 8s && meter.TimeLeft(1'000) == 0ms);
+    assert(out.str() == "\r20% progress, 100 runs/s, 50000 blocks/s, 8s left..");
+    meter.Report(200, 50'000, start + 2s);
+    const auto left{meter.TimeLeft(200)};
+    assert(left && *left > 8s && *left < 16s);
+    meter.Report(1'000, 400'000, start + 3s);
+    meter.Finish();
+    assert(out.str().find("\r100% progress, ") != std::string::npos && out.str().ends_with("0s left..\n"));
+
+    std::istringstream lines{log.str()};
+    std::string line;
+    std::getline(lines, line);
+    assert(line == PROGRESS_CSV_HEADER);
+    std::getline(lines, line);
+    assert(line == "1000,200,1000,50000,100,50000,8000");
+    std::getline(lines, line);
+    std::getline(lines, line);
+    assert(line.starts_with("3000,1000,1000,400000,") && line.ends_with(",0"));
+    assert(!std::getline(lines, line));
+
+    // The workers' counts are reported while sweeping, and the log is set on the command line.
+    std::ostringstream sweep_out, sweep_log;
+    SweepParams params{std::chrono::days{1}, 100, 42, 2, {}};
+    params.progress_log = &sweep_log;
+    Scenario scenario;
+    scenario.miners.emplace_back(0, 50, 1s);
+    scenario.miners.emplace_back(1, 50, 1s);
+    RunScenarios(std::span{&scenario, 1}, params, sweep_out, [](size_t, auto, auto, const auto&) {});
+    assert(sweep_out.str().find("100% progress") != std::string::npos && sweep_out.str().ends_with("\n"));
+    assert(sweep_log.str().starts_with(PROGRESS_CSV_HEADER) && sweep_log.str().find(",100,100,") != std::string::npos);
+    // Runs skipped by stopping early count as done, so the progress ends at 100% with no time left either way.
+    std::ostringstream early_out, early_log;
+    params.runs = 100 * MIN_RUNS_TO_STOP;
+    params.stale_rate_precision = 0.1;
+    params.progress_log = &early_log;
+    RunScenarios(std::span{&scenario, 1}, params, early_out, [&](size_t, auto stats, auto, const auto&) {
+        assert(stats[0].stale_rate.count < static_cast<uint64_t>(params.runs));
+    });
+    const auto last_line{early_out.str().substr(early_out.str().rfind('\r') + 1)};
+    assert(last_line.starts_with("100% progress") && last_line.find(" 0s left..") != std::string::npos);
+    const auto last_row{early_log.str().substr(early_log.str().rfind('\n', early_log.str().size() - 2) + 1)};
+    assert(last_row.find(",102400,102400,") != std::string::npos && last_row.ends_with(",0\n"));
+    const char* args[]{"simulation", "--progress-log", "progress.csv"};
+    Config default_config{.duration = std::chrono::weeks{1}, .runs = 100};
+    default_config.miners = scenario.miners;
+    const auto config{ParseConfig(std::size(args), args, default_config)};
+    assert(config && config->progress_log == "progress.csv");
+
+    std::cout << "Progress tests passed." << std::endl;
+}
+
 int main()
 {
     //MinerPickerSample();
@@ -373,4 +1805,26 @@ int main()
     //MinerPickerSmallBig();
     //SimpleSim();
     TestSelfishStrategy();
+    TestStubbornStrategies();
+    TestSelfishGamma();
+    TestBestChain();
+    TestRunCounters();
+    TestFinderSampler();
+    TestSimulationAllocations();
+    TestReproducibleRuns();
+    TestSampling();
+    TestHashrateSchedule();
+    TestFinality();
+    TestRaces();
+    TestRareEvents();
+    TestLatencyMatrix();
+    TestRunningStats();
+    TestConfigParsing();
+    TestSweep();
+    TestModel();
+    TestPopulation();
+    TestShards();
+    TestCheckpoints();
+    TestTraces();
+    TestProgress();
 }
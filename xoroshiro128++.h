@@ -1,3 +1,11 @@
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
 /** A fast, non cryptographically secure, RNG courtesy of Pieter Wuille who pointed
  * out that it would be much more efficient to use it instead of the standard library's.
  */
@@ -38,3 +46,134 @@ public:
         return mean * MakeExponentiallyDistributed(rand64());
     }
 };
+
+/** Derive the seed of an independent stream from a parent seed and the stream's index (counter-based seeding).
+ * This allows to re-create any stream on its own, whatever the order in which the streams are used.
+ */
+constexpr uint64_t DeriveSeed(uint64_t seed, uint64_t index) noexcept
+{
+    const auto mix{[](uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }};
+    // Two rounds of SplitMix64's finalizer, so that neighbouring seeds and indexes give unrelated results.
+    return mix(mix(seed + 0x9e3779b97f4a7c15) ^ (index * 0x9e3779b97f4a7c15 + 0x6a09e667f3bcc909));
+}
+
+/** Natural logarithm for doubles in the normal range, without branches so that loops calling it can be
+ * vectorized. Same algorithm and precision (< 1 ULP) as musl's log(). Subnormals, zero, infinities and NaNs
+ * are not handled.
+ */
+constexpr double BranchlessLog(double x) noexcept
+{
+    constexpr double LN2_HI{6.93147180369123816490e-01}, LN2_LO{1.90821492927058770002e-10};
+    constexpr double LG1{6.666666666666735130e-01}, LG2{3.999999999940941908e-01}, LG3{2.857142874366239149e-01},
+        LG4{2.222219843214978396e-01}, LG5{1.818357216161805012e-01}, LG6{1.531383769920937332e-01},
+        LG7{1.479819860511658591e-01};
+
+    // Reduce x to m * 2^k with m in [sqrt(2)/2, sqrt(2)).
+    uint64_t bits{std::bit_cast<uint64_t>(x) + (0x3ff0000000000000 - 0x3fe6a09e667f3bcd)};
+    const auto k{static_cast<double>(static_cast<int64_t>(bits >> 52) - 0x3ff)};
+    bits = (bits & 0x000fffffffffffff) + 0x3fe6a09e667f3bcd;
+    const double f{std::bit_cast<double>(bits) - 1.0};
+
+    // log(1+f) = f - f^2/2 + s*(f^2/2 + R) with s = f/(2+f) and R a minimax polynomial in s^2.
+    const double hfsq{0.5 * f * f};
+    const double s{f / (2.0 + f)};
+    const double z{s * s};
+    const double w{z * z};
+    const double t1{w * (LG2 + w * (LG4 + w * LG6))};
+    const double t2{z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)))};
+    return s * (hfsq + t2 + t1) + k * LN2_LO - hfsq + f + k * LN2_HI;
+}
+
+/** A number of interleaved xoroshiro128++ streams generating random values in batches. There is no dependency
+ * between the streams so the compiler can vectorize the generation as well as the exponential transform (with
+ * SSE2, AVX2 or NEON depending on the target, falling back to scalar code otherwise).
+ */
+template<size_t LANES>
+class BatchRNG
+{
+    std::array<uint64_t, LANES> m_s0;
+    std::array<uint64_t, LANES> m_s1;
+
+public:
+    static_assert(LANES > 0);
+    static constexpr size_t LANE_COUNT{LANES};
+
+    constexpr explicit BatchRNG(uint64_t seedval) noexcept
+    {
+        for (size_t i{0}; i < LANES; ++i) {
+            RNG lane{seedval};
+            m_s0[i] = lane.rand64();
+            m_s1[i] = lane.rand64();
+            seedval = lane.rand64();
+        }
+    }
+
+    /** Fill the buffer with uniformly distributed 64 bits integers. Its size must be a multiple of the number of lanes. */
+    void FillUniform(std::span<uint64_t> out) noexcept
+    {
+        assert(out.size() % LANES == 0);
+        for (size_t i{0}; i < out.size(); i += LANES) {
+            for (size_t l{0}; l < LANES; ++l) {
+                const uint64_t s0{m_s0[l]};
+                uint64_t s1{m_s1[l]};
+                out[i + l] = std::rotl(s0 + s1, 17) + s0;
+                s1 ^= s0;
+                m_s0[l] = std::rotl(s0, 49) ^ s1 ^ (s1 << 21);
+                m_s1[l] = std::rotl(s1, 28);
+            }
+        }
+    }
+
+    /** Fill the buffer with draws from an exponential distribution of mean 1. Its size must be a multiple of the
+     * number of lanes. */
+    void FillExponential(std::span<double> out) noexcept
+    {
+        assert(out.size() % LANES == 0);
+        std::array<uint64_t, LANES> uniform;
+        for (size_t i{0}; i < out.size(); i += LANES) {
+            FillUniform(uniform);
+            for (size_t l{0}; l < LANES; ++l) {
+                // Same mapping as RNG::exporand(): 1 - u is in [2^-53; 1], never zero.
+                out[i + l] = -BranchlessLog(1.0 - static_cast<double>(uniform[l] >> 11) * 0x1.0p-53);
+            }
+        }
+    }
+};
+
+/** Random values generated in batches of BATCH_SIZE, and handed out one at a time. */
+template<typename T, size_t BATCH_SIZE = 1024, size_t LANES = 4>
+class BatchedStream
+{
+    static_assert(BATCH_SIZE % LANES == 0);
+    BatchRNG<LANES> m_rng;
+    std::array<T, BATCH_SIZE> m_buffer;
+    size_t m_pos{BATCH_SIZE};
+
+    void Refill() noexcept
+    {
+        if constexpr (std::is_same_v<T, double>) {
+            m_rng.FillExponential(m_buffer);
+        } else {
+            m_rng.FillUniform(m_buffer);
+        }
+        m_pos = 0;
+    }
+
+public:
+    explicit BatchedStream(uint64_t seedval) noexcept : m_rng{seedval} {}
+
+    T Next() noexcept
+    {
+        if (m_pos == BATCH_SIZE) [[unlikely]] Refill();
+        return m_buffer[m_pos++];
+    }
+};
+
+//! Uniformly distributed 64 bits integers, generated in batches.
+using UniformStream = BatchedStream<uint64_t>;
+//! Draws from an exponential distribution of mean 1, generated in batches.
+using ExponentialStream = BatchedStream<double>;